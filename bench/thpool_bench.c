@@ -0,0 +1,271 @@
+/*
+ * thpool microbenchmarks
+ *
+ * Prints one CSV row per measurement, all times in ns:
+ *
+ *   bench,queue,producers,workers,samples,mean_ns,p50_ns,p99_ns,max_ns,ops_per_sec
+ *
+ *   throughput   empty tasks pushed by producers until thpool_wait() returns
+ *   latency      push of a single task to the start of its handler, pool idle
+ *   wait         end of the last handler to the return of thpool_wait()
+ *   init         thpool_init(), including worker start up
+ *   destroy      thpool_destroy() of an idle pool
+ *
+ * Fields that do not apply to a row are 0.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "thpool.h"
+
+#define BENCH_TASKS         200000  /* tasks per throughput run    */
+#define BENCH_SAMPLES       2000    /* latency and wait samples    */
+#define BENCH_INIT_ROUNDS   200     /* init/destroy pairs per size */
+
+typedef struct sample {
+    uint64_t submit;
+    uint64_t start;
+    uint64_t end;
+} sample_t;
+
+typedef struct producer {
+    pthread_t pthread;
+    thpool_t *thpool;
+    pthread_barrier_t *barrier;
+    size_t tasks;
+} producer_t;
+
+static const char *queue_name;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Print a row of percentiles, sorts values */
+static void report(const char *bench, int producers, int workers, uint64_t *values, size_t count)
+{
+    uint64_t sum = 0;
+    size_t n;
+
+    if (count == 0)
+        return;
+    qsort(values, count, sizeof(*values), cmp_u64);
+    for (n = 0; n < count; n++)
+        sum += values[n];
+    printf("%s,%s,%d,%d,%zu,%llu,%llu,%llu,%llu,0\n", bench, queue_name, producers, workers,
+           count, (unsigned long long)(sum / count),
+           (unsigned long long)values[(count - 1) / 2],
+           (unsigned long long)values[(count * 99 + 99) / 100 - 1],
+           (unsigned long long)values[count - 1]);
+}
+
+static thpool_t *pool_init(int workers, thpool_queue_type_t queue_type)
+{
+    thpool_options_t opts;
+
+    thpool_options_init(&opts);
+    opts.num_threads = workers;
+    opts.queue_type = queue_type;
+    opts.queue_capacity = BENCH_TASKS;
+    opts.task_slab_max = BENCH_TASKS;
+    return thpool_init_opts(&opts);
+}
+
+static void empty_handler(task_t *task)
+{
+    (void)task;
+}
+
+static void *producer_do(void *arg)
+{
+    producer_t *producer = arg;
+    task_queue_t *queue = thpool_taskqueue(producer->thpool);
+    size_t n;
+
+    pthread_barrier_wait(producer->barrier);
+    for (n = 0; n < producer->tasks; n++) {
+        task_t *task = thpool_task_init(producer->thpool);
+        task->handler = empty_handler;
+        while (task_queue_push(queue, task) == -1)
+            sched_yield();
+    }
+    return NULL;
+}
+
+/* Empty tasks per second, producers start together behind a barrier */
+static void bench_throughput(int producers, int workers, thpool_queue_type_t queue_type)
+{
+    producer_t *producer = calloc(producers, sizeof(*producer));
+    pthread_barrier_t barrier;
+    thpool_t *thpool;
+    uint64_t begin, elapsed;
+    int n;
+
+    thpool = pool_init(workers, queue_type);
+    if (producer == NULL || thpool == NULL) {
+        fprintf(stderr, "thpool_bench: Could not set up throughput run\n");
+        exit(1);
+    }
+    pthread_barrier_init(&barrier, NULL, producers + 1);
+    for (n = 0; n < producers; n++) {
+        producer[n].thpool = thpool;
+        producer[n].barrier = &barrier;
+        producer[n].tasks = BENCH_TASKS / producers;
+        pthread_create(&producer[n].pthread, NULL, producer_do, &producer[n]);
+    }
+
+    pthread_barrier_wait(&barrier);
+    begin = now_ns();
+    for (n = 0; n < producers; n++)
+        pthread_join(producer[n].pthread, NULL);
+    thpool_wait(thpool);
+    elapsed = now_ns() - begin;
+
+    printf("throughput,%s,%d,%d,%zu,%llu,0,0,0,%.0f\n", queue_name, producers, workers,
+           producer[0].tasks * producers,
+           (unsigned long long)(elapsed / (producer[0].tasks * producers)),
+           producer[0].tasks * producers * 1e9 / elapsed);
+
+    pthread_barrier_destroy(&barrier);
+    thpool_destroy(thpool);
+    free(producer);
+}
+
+static void timed_handler(task_t *task)
+{
+    sample_t *sample = task->user_data;
+
+    sample->start = now_ns();
+    sample->end = now_ns();
+}
+
+/* Submit-to-start and thpool_wait() latency of one task on an idle pool */
+static void bench_latency(int workers, thpool_queue_type_t queue_type)
+{
+    sample_t *samples = calloc(BENCH_SAMPLES, sizeof(*samples));
+    uint64_t *latency = calloc(BENCH_SAMPLES, sizeof(*latency));
+    uint64_t *wait = calloc(BENCH_SAMPLES, sizeof(*wait));
+    thpool_t *thpool = pool_init(workers, queue_type);
+    int n;
+
+    if (samples == NULL || latency == NULL || wait == NULL || thpool == NULL) {
+        fprintf(stderr, "thpool_bench: Could not set up latency run\n");
+        exit(1);
+    }
+
+    for (n = 0; n < BENCH_SAMPLES; n++) {
+        task_t *task = thpool_task_init(thpool);
+        task->handler = timed_handler;
+        task->user_data = &samples[n];
+
+        /* Let the workers go back to sleep, the common case for a submit */
+        usleep(100);
+        samples[n].submit = now_ns();
+        task_queue_push(thpool_taskqueue(thpool), task);
+        thpool_wait(thpool);
+        wait[n] = now_ns() - samples[n].end;
+        latency[n] = samples[n].start - samples[n].submit;
+    }
+    report("latency", 1, workers, latency, BENCH_SAMPLES);
+    report("wait", 1, workers, wait, BENCH_SAMPLES);
+
+    thpool_destroy(thpool);
+    free(wait);
+    free(latency);
+    free(samples);
+}
+
+static void bench_init_destroy(int workers, thpool_queue_type_t queue_type)
+{
+    uint64_t *init = calloc(BENCH_INIT_ROUNDS, sizeof(*init));
+    uint64_t *destroy = calloc(BENCH_INIT_ROUNDS, sizeof(*destroy));
+    int n;
+
+    if (init == NULL || destroy == NULL) {
+        fprintf(stderr, "thpool_bench: Could not set up init run\n");
+        exit(1);
+    }
+    /* Default sizes, the throughput runs use a slab and ring for all tasks */
+    for (n = 0; n < BENCH_INIT_ROUNDS; n++) {
+        thpool_options_t opts;
+        thpool_options_init(&opts);
+        opts.num_threads = workers;
+        opts.queue_type = queue_type;
+
+        uint64_t begin = now_ns();
+        thpool_t *thpool = thpool_init_opts(&opts);
+        init[n] = now_ns() - begin;
+
+        begin = now_ns();
+        thpool_destroy(thpool);
+        destroy[n] = now_ns() - begin;
+    }
+    report("init", 0, workers, init, BENCH_INIT_ROUNDS);
+    report("destroy", 0, workers, destroy, BENCH_INIT_ROUNDS);
+
+    free(destroy);
+    free(init);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-t max_threads] [-q deque|ring]\n"
+                    "  producers and workers are swept 1, 2, 4 ... max_threads\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    thpool_queue_type_t queue_type = THPOOL_QUEUE_DEQUE;
+    long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int producers, workers, opt;
+
+    queue_name = "deque";
+    while ((opt = getopt(argc, argv, "t:q:h")) != -1) {
+        switch (opt) {
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'q':
+            if (strcmp(optarg, "ring") == 0) {
+                queue_type = THPOOL_QUEUE_RING;
+                queue_name = "ring";
+            } else if (strcmp(optarg, "deque") != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (max_threads < 1)
+        max_threads = 1;
+
+    printf("bench,queue,producers,workers,samples,mean_ns,p50_ns,p99_ns,max_ns,ops_per_sec\n");
+    for (workers = 1; workers <= max_threads; workers *= 2) {
+        for (producers = 1; producers <= max_threads; producers *= 2)
+            bench_throughput(producers, workers, queue_type);
+        bench_latency(workers, queue_type);
+        bench_init_destroy(workers, queue_type);
+        fflush(stdout);
+    }
+
+    return 0;
+}
@@ -1,11 +1,17 @@
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/signalfd.h>
 
 #include "thpool.h"
 #include "wifi.h"
 
+#define WIFI_SCAN_INTERVAL_MS   (1000)
+#define WIFI_SCAN_KEY           (0x5343414eULL)  /* coalesces scans still in flight */
+
 static void task_wifi_scan_handler(task_t *task)
 {
     if (!task)
@@ -14,45 +20,98 @@ static void task_wifi_scan_handler(task_t *task)
     wifi_t* wifi = (wifi_t*)task->user_data;
     printf("wifi scanning...\n");
     wifi_scan(wifi);
-    usleep(1000 * 1000);
+}
+
+/* Runs on the main thread, from thpool_completion_drain() */
+static void task_wifi_scan_done(task_t __attribute__((unused)) *task)
+{
     printf("wifi scan OK...\n");
 }
 
-static void task_push_wifi_scan(thpool_t *thpool, task_handler_t handler, void *wifi)
+static thpool_timer_t *task_schedule_wifi_scan(thpool_t *thpool, task_handler_t handler,
+                                               task_handler_t done, void *wifi)
 {
-    task_t *task = task_init();
+    thpool_timer_t *timer;
+    task_t *task = thpool_task_init(thpool);
+
+    if (task == NULL)
+        return NULL;
     task->handler = handler;
+    task->result_cb = done;
+    task->flags |= TASK_F_DEFERRED;
+    task->dedup_key = WIFI_SCAN_KEY;
     task->user_data = wifi;
-    task_queue_push(thpool_taskqueue(thpool), task);
+    task->priority = TASK_PRIO_BACKGROUND;
+    if ((timer = thpool_schedule_every(thpool, task, WIFI_SCAN_INTERVAL_MS)) == NULL)
+        task_free(task);
+    return timer;
 }
 
 int main()
 {
+    /* Blocked before the pool starts, so only signalfd sees them */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    int sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (sigfd < 0) {
+        printf("signalfd() fail\n");
+        return -1;
+    }
+
     printf("Making %d thread pool\n", 1);
     thpool_t *thpool = thpool_init(1);
+    if (thpool == NULL) {
+        printf("thpool_init() fail\n");
+        return -1;
+    }
 
     wifi_t *wifi;
     if ((wifi = wifi_new()) == NULL) {
         printf("wifi_new() fail\n");
+        thpool_destroy(thpool);
         return -1;
     }
     if (wifi_open(wifi, NULL) != 0) {
         printf("wifi_open() fail\n");
         wifi_free(wifi);
+        thpool_destroy(thpool);
+        return -1;
+    }
+
+    struct pollfd fds[2];
+    fds[0].fd = sigfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = thpool_completion_fd(thpool);
+    fds[1].events = POLLIN;
+    thpool_timer_t *scan_timer = task_schedule_wifi_scan(thpool, task_wifi_scan_handler,
+                                                         task_wifi_scan_done, wifi);
+    if (scan_timer == NULL) {
+        printf("task_schedule_wifi_scan() fail\n");
+        wifi_free(wifi);
+        thpool_destroy(thpool);
         return -1;
     }
-    task_push_wifi_scan(thpool, task_wifi_scan_handler, wifi);
-    task_push_wifi_scan(thpool, task_wifi_scan_handler, wifi);
 
-    while(1) {
-        printf("main...\n");
-        usleep(1000 * 1000);
+    /* Sleep until a scan completes or we are asked to stop */
+    while (1) {
+        if (poll(fds, 2, -1) < 0)
+            continue;
+        if (fds[0].revents & POLLIN)
+            break;
+        if (fds[1].revents & POLLIN)
+            thpool_completion_drain(thpool, 0);
     }
+    thpool_timer_cancel(scan_timer);
     thpool_wait(thpool);
+    thpool_completion_drain(thpool, 0);
     
     wifi_free(wifi);
     puts("Killing threadpool");
     thpool_destroy(thpool);
+    close(sigfd);
 
     return 0;
 }
@@ -0,0 +1,172 @@
+/*
+ * thpool coroutine tests
+ *
+ *   await_fd          coroutines awaiting pipes give the only worker to
+ *                     other tasks, resume in whatever order their pipes
+ *                     become readable and keep their stack across the
+ *                     await; fds epoll cannot watch are ready at once
+ *   await_destroy     a coroutine still parked when the pool goes away is
+ *                     dropped, its cleanup_cb runs and its future is
+ *                     cancelled
+ *
+ * Exits non-zero on the first failed check, best run under
+ * -fsanitize=address as well.
+ */
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thpool.h"
+
+#define CORO_TASKS          8
+#define CORO_TIMEOUT_MS     5000
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                        \
+        }                                                                   \
+    } while (0)
+
+static int pipes[CORO_TASKS][2];
+static char received[CORO_TASKS];
+static atomic_int cleaned;
+static atomic_int awaiting;
+
+static void count_task(task_t *task)
+{
+    (void)task;
+}
+
+static void cleanup_task(task_t *task)
+{
+    (void)task;
+    atomic_fetch_add(&cleaned, 1);
+}
+
+/* Reads one byte of its pipe, the expected value lives on its own stack */
+static void await_task(task_t *task)
+{
+    int n = (int)(long)task->user_data;
+    char expected = (char)('a' + n), byte = 0;
+
+    atomic_fetch_add(&awaiting, 1);
+    CHECK(task_await_fd(pipes[n][0], POLLIN) & POLLIN);
+    CHECK(read(pipes[n][0], &byte, 1) == 1);
+    CHECK(byte == expected);
+    received[n] = byte;
+}
+
+/* /dev/null cannot be watched by epoll, the await returns right away */
+static void await_devnull_task(task_t *task)
+{
+    int fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    (void)task;
+    CHECK(fd >= 0);
+    CHECK(task_await_fd(fd, POLLIN) == POLLIN);
+    close(fd);
+}
+
+static task_future_t *submit(thpool_t *thpool, task_handler_t handler, int n)
+{
+    task_t *task = thpool_task_init(thpool);
+    task_future_t *future;
+
+    CHECK(task != NULL);
+    task->handler = handler;
+    task->cleanup_cb = cleanup_task;
+    task->user_data = (void *)(long)n;
+    task->flags |= TASK_F_COROUTINE;
+    CHECK((future = task_queue_submit(thpool_taskqueue(thpool), task)) != NULL);
+    return future;
+}
+
+static void test_await_fd(void)
+{
+    thpool_t *thpool = thpool_init(1);
+    task_future_t *futures[CORO_TASKS], *plain;
+    task_t *task;
+    char byte;
+    int n;
+
+    CHECK(thpool != NULL);
+    atomic_store(&cleaned, 0);
+    for (n = 0; n < CORO_TASKS; n++) {
+        CHECK(pipe(pipes[n]) == 0);
+        futures[n] = submit(thpool, await_task, n);
+    }
+
+    /* All of them parked, the one worker is free for other work */
+    CHECK((task = thpool_task_init(thpool)) != NULL);
+    task->handler = count_task;
+    CHECK((plain = task_queue_submit(thpool_taskqueue(thpool), task)) != NULL);
+    CHECK(task_wait(plain, CORO_TIMEOUT_MS) == 0);
+    task_future_release(plain);
+    CHECK(task_wait_any(futures, CORO_TASKS, 0) == -1);
+
+    /* Ready in reverse order, each resumes once its byte is there */
+    for (n = CORO_TASKS - 1; n >= 0; n--) {
+        byte = (char)('a' + n);
+        CHECK(write(pipes[n][1], &byte, 1) == 1);
+        CHECK(task_wait(futures[n], CORO_TIMEOUT_MS) == 0);
+        CHECK(task_future_status(futures[n]) == TASK_STATUS_DONE);
+        CHECK(received[n] == byte);
+    }
+    for (n = 0; n < CORO_TASKS; n++) {
+        task_future_release(futures[n]);
+        close(pipes[n][0]);
+        close(pipes[n][1]);
+    }
+
+    futures[0] = submit(thpool, await_devnull_task, 0);
+    CHECK(task_wait(futures[0], CORO_TIMEOUT_MS) == 0);
+    task_future_release(futures[0]);
+    thpool_wait(thpool);
+    CHECK(atomic_load(&cleaned) == CORO_TASKS + 1);
+
+    /* Outside of a coroutine it simply polls */
+    CHECK(pipe(pipes[0]) == 0);
+    byte = 'x';
+    CHECK(write(pipes[0][1], &byte, 1) == 1);
+    CHECK(task_await_fd(pipes[0][0], POLLIN) & POLLIN);
+    close(pipes[0][0]);
+    close(pipes[0][1]);
+
+    thpool_destroy(thpool);
+    printf("await_fd: ok\n");
+}
+
+static void test_await_destroy(void)
+{
+    thpool_t *thpool = thpool_init(1);
+    task_future_t *future;
+
+    CHECK(thpool != NULL);
+    atomic_store(&cleaned, 0);
+    atomic_store(&awaiting, 0);
+    CHECK(pipe(pipes[0]) == 0);
+    future = submit(thpool, await_task, 0);
+    /* Parked once the worker let go of it */
+    while (!atomic_load(&awaiting) || thpool_num_threads_working(thpool) > 0)
+        usleep(1000);
+
+    thpool_destroy(thpool);
+    CHECK(atomic_load(&cleaned) == 1);
+    CHECK(task_future_status(future) == TASK_STATUS_CANCELLED);
+    task_future_release(future);
+    close(pipes[0][0]);
+    close(pipes[0][1]);
+    printf("await_destroy: ok\n");
+}
+
+int main(void)
+{
+    test_await_fd();
+    test_await_destroy();
+    return 0;
+}
@@ -0,0 +1,290 @@
+/*
+ * thpool future tests
+ *
+ *   dedup_cancel      a submitter attached by dedup key only cancels its own
+ *                     submission, the last one to cancel cancels the task
+ *   wait_any          task_wait_any times out while all are pending, then
+ *                     returns the one that completed, a cancelled one
+ *                     counts; task_wait_all waits for the last one
+ *   completion_drain  deferred callbacks wait for the completion fd to be
+ *                     drained on the calling thread, in parts or all at
+ *                     once, leftovers keep it readable, destroy runs the
+ *                     undrained ones
+ *
+ * Exits non-zero on the first failed check, best run under
+ * -fsanitize=address or thread as well.
+ */
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thpool.h"
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                        \
+        }                                                                   \
+    } while (0)
+
+#define WAIT_TASKS          3
+#define WAIT_TIMEOUT_MS     20
+#define DRAIN_TASKS         10
+#define DRAIN_FIRST         4       /* drained in a first, partial call */
+
+static atomic_int ran;
+static atomic_int release;
+static atomic_int cleaned;
+static atomic_int started;
+static atomic_int gates[WAIT_TASKS];
+static atomic_int results;
+static atomic_int results_elsewhere;
+static pthread_t main_thread;
+
+static void count_task(task_t *task)
+{
+    (void)task;
+    atomic_fetch_add(&ran, 1);
+}
+
+static void blocking_task(task_t *task)
+{
+    (void)task;
+    while (!atomic_load(&release))
+        usleep(1000);
+    atomic_fetch_add(&ran, 1);
+}
+
+static void cleanup_task(task_t *task)
+{
+    (void)task;
+    atomic_fetch_add(&cleaned, 1);
+}
+
+/* Counts the result callbacks not run by the main thread */
+static void result_task(task_t *task)
+{
+    (void)task;
+    atomic_fetch_add(&results, 1);
+    if (!pthread_equal(pthread_self(), main_thread))
+        atomic_fetch_add(&results_elsewhere, 1);
+}
+
+/* Runs until the gate of its index opens */
+static void gated_task(task_t *task)
+{
+    int n = (int)(long)task->user_data;
+
+    atomic_fetch_add(&started, 1);
+    while (!atomic_load(&gates[n]))
+        usleep(1000);
+    atomic_fetch_add(&ran, 1);
+}
+
+/* Occupies the only worker of the pool until release is set */
+static void block_worker(thpool_t *thpool)
+{
+    task_t *task = thpool_task_init(thpool);
+
+    CHECK(task != NULL);
+    atomic_store(&release, 0);
+    task->handler = blocking_task;
+    CHECK(task_queue_push(thpool_taskqueue(thpool), task) == 0);
+}
+
+static task_future_t *submit_keyed(thpool_t *thpool, unsigned long long key)
+{
+    task_t *task = thpool_task_init(thpool);
+
+    CHECK(task != NULL);
+    task->handler = count_task;
+    task->cleanup_cb = cleanup_task;
+    task->dedup_key = key;
+    return task_queue_submit(thpool_taskqueue(thpool), task);
+}
+
+static void test_dedup_cancel(void)
+{
+    thpool_t *thpool = thpool_init(1);
+    task_future_t *first, *second;
+
+    CHECK(thpool != NULL);
+    atomic_store(&ran, 0);
+    atomic_store(&cleaned, 0);
+
+    /* Both cancel, the task never runs */
+    block_worker(thpool);
+    first = submit_keyed(thpool, 7);
+    second = submit_keyed(thpool, 7);
+    CHECK(first != NULL && second == first);
+    CHECK(atomic_load(&cleaned) == 1);      /* the attached duplicate */
+    CHECK(task_cancel(first) == 0);
+    CHECK(task_future_status(second) == TASK_STATUS_PENDING);
+    CHECK(task_cancel(second) == 0);
+    CHECK(task_future_status(first) == TASK_STATUS_CANCELLED);
+    atomic_store(&release, 1);
+    thpool_wait(thpool);
+    CHECK(atomic_load(&ran) == 1);
+    CHECK(atomic_load(&cleaned) == 2);
+    task_future_release(first);
+    task_future_release(second);
+
+    /* Only one cancels, the other still gets its run */
+    block_worker(thpool);
+    first = submit_keyed(thpool, 7);
+    second = submit_keyed(thpool, 7);
+    CHECK(first != NULL && second == first);
+    CHECK(task_cancel(second) == 0);
+    atomic_store(&release, 1);
+    CHECK(task_wait(first, -1) == 0);
+    CHECK(task_future_status(first) == TASK_STATUS_DONE);
+    CHECK(task_cancel(first) == -1);
+    thpool_wait(thpool);
+    CHECK(atomic_load(&ran) == 3);
+    task_future_release(first);
+    task_future_release(second);
+
+    thpool_destroy(thpool);
+    printf("dedup_cancel: ok\n");
+}
+
+static void test_wait_any(void)
+{
+    thpool_t *thpool = thpool_init(WAIT_TASKS);
+    task_future_t *futures[WAIT_TASKS + 1], *some[3];
+    task_t *task;
+    int n;
+
+    CHECK(thpool != NULL);
+    atomic_store(&ran, 0);
+    atomic_store(&started, 0);
+    for (n = 0; n < WAIT_TASKS; n++) {
+        atomic_store(&gates[n], 0);
+        CHECK((task = thpool_task_init(thpool)) != NULL);
+        task->handler = gated_task;
+        task->user_data = (void *)(long)n;
+        CHECK((futures[n] = task_queue_submit(thpool_taskqueue(thpool), task)) != NULL);
+    }
+    while (atomic_load(&started) < WAIT_TASKS)
+        usleep(1000);
+
+    /* All workers are busy, this one stays queued until cancelled */
+    CHECK((task = thpool_task_init(thpool)) != NULL);
+    task->handler = count_task;
+    CHECK((futures[WAIT_TASKS] = task_queue_submit(thpool_taskqueue(thpool), task)) != NULL);
+
+    CHECK(task_wait_any(futures, WAIT_TASKS + 1, WAIT_TIMEOUT_MS) == -1);
+    CHECK(task_wait_all(futures, WAIT_TASKS, WAIT_TIMEOUT_MS) == -1);
+
+    CHECK(task_cancel(futures[WAIT_TASKS]) == 0);
+    some[0] = futures[0];
+    some[1] = futures[2];
+    some[2] = futures[WAIT_TASKS];
+    CHECK(task_wait_any(some, 3, -1) == 2);
+    CHECK(task_future_status(futures[WAIT_TASKS]) == TASK_STATUS_CANCELLED);
+
+    atomic_store(&gates[1], 1);
+    CHECK(task_wait_any(futures, WAIT_TASKS, -1) == 1);
+    CHECK(task_future_status(futures[1]) == TASK_STATUS_DONE);
+    CHECK(task_future_status(futures[0]) == TASK_STATUS_PENDING);
+    /* Already complete, returned without waiting */
+    CHECK(task_wait_any(futures, WAIT_TASKS, 0) == 1);
+
+    atomic_store(&gates[0], 1);
+    atomic_store(&gates[2], 1);
+    CHECK(task_wait_all(futures, WAIT_TASKS + 1, -1) == 0);
+    for (n = 0; n < WAIT_TASKS; n++)
+        CHECK(task_future_status(futures[n]) == TASK_STATUS_DONE);
+    thpool_wait(thpool);
+    CHECK(atomic_load(&ran) == WAIT_TASKS);
+
+    for (n = 0; n <= WAIT_TASKS; n++)
+        task_future_release(futures[n]);
+    thpool_destroy(thpool);
+    printf("wait_any: ok\n");
+}
+
+static task_future_t *submit_deferred(thpool_t *thpool)
+{
+    task_t *task = thpool_task_init(thpool);
+
+    CHECK(task != NULL);
+    task->handler = count_task;
+    task->result_cb = result_task;
+    task->cleanup_cb = cleanup_task;
+    task->flags |= TASK_F_DEFERRED;
+    return task_queue_submit(thpool_taskqueue(thpool), task);
+}
+
+static int readable(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+static void test_completion_drain(void)
+{
+    thpool_t *thpool = thpool_init(2);
+    task_future_t *futures[DRAIN_TASKS];
+    int fd, n;
+
+    CHECK(thpool != NULL);
+    main_thread = pthread_self();
+    atomic_store(&ran, 0);
+    atomic_store(&results, 0);
+    atomic_store(&cleaned, 0);
+
+    /* Without anyone polling, deferred tasks complete on the worker */
+    CHECK((futures[0] = submit_deferred(thpool)) != NULL);
+    CHECK(task_wait(futures[0], -1) == 0);
+    CHECK(atomic_load(&results_elsewhere) == 1);
+    task_future_release(futures[0]);
+    thpool_wait(thpool);
+
+    CHECK((fd = thpool_completion_fd(thpool)) >= 0);
+    CHECK(thpool_completion_fd(thpool) == fd);
+    CHECK(!readable(fd));
+    for (n = 0; n < DRAIN_TASKS; n++)
+        CHECK((futures[n] = submit_deferred(thpool)) != NULL);
+    thpool_wait(thpool);
+    CHECK(atomic_load(&ran) == 1 + DRAIN_TASKS);
+    CHECK(atomic_load(&results) == 1);
+    CHECK(task_wait(futures[0], 0) == -1);
+    CHECK(readable(fd));
+
+    CHECK(thpool_completion_drain(thpool, DRAIN_FIRST) == DRAIN_FIRST);
+    CHECK(atomic_load(&results) == 1 + DRAIN_FIRST);
+    CHECK(readable(fd));
+    CHECK(thpool_completion_drain(thpool, 0) == DRAIN_TASKS - DRAIN_FIRST);
+    CHECK(!readable(fd));
+    CHECK(thpool_completion_drain(thpool, 0) == 0);
+    CHECK(atomic_load(&results) == 1 + DRAIN_TASKS);
+    CHECK(atomic_load(&cleaned) == 1 + DRAIN_TASKS);
+    CHECK(atomic_load(&results_elsewhere) == 1);
+    CHECK(task_wait_all(futures, DRAIN_TASKS, 0) == 0);
+    for (n = 0; n < DRAIN_TASKS; n++)
+        task_future_release(futures[n]);
+
+    /* Left for thpool_destroy() */
+    CHECK((futures[0] = submit_deferred(thpool)) != NULL);
+    thpool_wait(thpool);
+    CHECK(readable(fd));
+    thpool_destroy(thpool);
+    CHECK(atomic_load(&cleaned) == 2 + DRAIN_TASKS);
+    CHECK(task_future_status(futures[0]) == TASK_STATUS_DONE);
+    task_future_release(futures[0]);
+    printf("completion_drain: ok\n");
+}
+
+int main(void)
+{
+    test_dedup_cancel();
+    test_wait_any();
+    test_completion_drain();
+    return 0;
+}
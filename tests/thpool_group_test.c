@@ -0,0 +1,125 @@
+/*
+ * thpool task group tests
+ *
+ *   free_after_wait   the group is freed as soon as task_group_wait()
+ *                     returns, while the last worker may still leave it
+ *   dedup_groups      keyed submissions only coalesce within one group
+ *
+ * Exits non-zero on the first failed check, best run under
+ * -fsanitize=address or thread as well.
+ */
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thpool.h"
+
+#define GROUP_ROUNDS        2000    /* groups freed right after waiting */
+#define GROUP_TASKS         32      /* short tasks per group            */
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                        \
+        }                                                                   \
+    } while (0)
+
+static atomic_int ran;
+static atomic_int release;
+
+static void count_task(task_t *task)
+{
+    (void)task;
+    atomic_fetch_add(&ran, 1);
+}
+
+static void blocking_task(task_t *task)
+{
+    (void)task;
+    while (!atomic_load(&release))
+        usleep(1000);
+    atomic_fetch_add(&ran, 1);
+}
+
+static void test_free_after_wait(void)
+{
+    thpool_t *thpool = thpool_init(4);
+    int round, n;
+
+    CHECK(thpool != NULL);
+    atomic_store(&ran, 0);
+    for (round = 0; round < GROUP_ROUNDS; round++) {
+        task_group_t *group = task_group_new();
+
+        CHECK(group != NULL);
+        for (n = 0; n < GROUP_TASKS; n++) {
+            task_t *task = thpool_task_init(thpool);
+
+            CHECK(task != NULL);
+            task->handler = count_task;
+            task->group = group;
+            CHECK(task_queue_push(thpool_taskqueue(thpool), task) == 0);
+        }
+        CHECK(task_group_wait(group, -1) == 0);
+        task_group_free(group);
+    }
+    thpool_wait(thpool);
+    CHECK(atomic_load(&ran) == GROUP_ROUNDS * GROUP_TASKS);
+    thpool_destroy(thpool);
+    printf("free_after_wait: ok\n");
+}
+
+static task_future_t *submit_keyed(thpool_t *thpool, task_handler_t handler,
+                                   task_group_t *group)
+{
+    task_t *task = thpool_task_init(thpool);
+
+    CHECK(task != NULL);
+    task->handler = handler;
+    task->group = group;
+    task->dedup_key = 42;
+    return task_queue_submit(thpool_taskqueue(thpool), task);
+}
+
+static void test_dedup_groups(void)
+{
+    thpool_t *thpool = thpool_init(1);
+    task_group_t *a = task_group_new(), *b = task_group_new();
+    task_future_t *first, *same, *other;
+
+    CHECK(thpool != NULL && a != NULL && b != NULL);
+    atomic_store(&ran, 0);
+    atomic_store(&release, 0);
+
+    first = submit_keyed(thpool, blocking_task, a);
+    same = submit_keyed(thpool, count_task, a);
+    other = submit_keyed(thpool, count_task, b);
+    CHECK(first != NULL && same == first);
+    CHECK(other != NULL && other != first);
+
+    /* The worker is stuck in the first task, b's own task is still queued */
+    CHECK(task_group_wait(b, 50) == -1);
+
+    atomic_store(&release, 1);
+    CHECK(task_group_wait(a, -1) == 0);
+    CHECK(task_group_wait(b, -1) == 0);
+    CHECK(atomic_load(&ran) == 2);
+    CHECK(task_future_status(other) == TASK_STATUS_DONE);
+
+    task_future_release(first);
+    task_future_release(same);
+    task_future_release(other);
+    thpool_destroy(thpool);
+    task_group_free(a);
+    task_group_free(b);
+    printf("dedup_groups: ok\n");
+}
+
+int main(void)
+{
+    test_free_after_wait();
+    test_dedup_groups();
+    return 0;
+}
@@ -0,0 +1,387 @@
+/*
+ * thpool worker management tests
+ *
+ *   elastic_shrink    a pool grown to max_threads retires back to its
+ *                     minimum, still runs what is queued from outside and
+ *                     grows again into the freed slots
+ *   independent_pools pools start and stop in well under the old second,
+ *                     one going away leaves another running its tasks
+ *   pause_resume      a paused pool finishes the running task and starts
+ *                     no other, another pool carries on, resume picks up
+ *                     the queue right away
+ *   placement         workers of a pool pinned to one cpu run there with
+ *                     the stack size asked for and report it so
+ *   stats_histograms  queue wait and run time percentiles of a known mix of
+ *                     tasks, per worker entries add up to the total
+ *
+ * Exits non-zero on the first failed check, best run under
+ * -fsanitize=address or thread as well.
+ */
+#define _GNU_SOURCE         /* sched_getaffinity(), pthread_getattr_np() */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "thpool.h"
+
+#define POOL_TIMEOUT_MS     5000    /* longest wait for a resize        */
+#define POOL_TASKS          64      /* quick tasks queued after a shrink */
+#define POOL_CYCLES         20      /* init/destroy rounds               */
+#define POOL_CYCLES_MS      1000    /* all of them, was 1s per destroy   */
+#define PAUSE_MS            20      /* paused with tasks queued          */
+#define RESUME_MS           200     /* resume to drained, was up to 1s   */
+#define PLACEMENT_THREADS   2
+#define PLACEMENT_STACK     (512 * 1024)
+#define STATS_THREADS       2
+#define STATS_FAST          90      /* no-op tasks                       */
+#define STATS_SLOW          10      /* tasks sleeping STATS_SLOW_MS      */
+#define STATS_SLOW_MS       5
+#define STATS_WAIT_MS       10      /* all of them queued while paused   */
+#define MS                  1000000ULL
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                        \
+        }                                                                   \
+    } while (0)
+
+static atomic_int ran;
+static atomic_int release;
+static atomic_int started;
+
+static void count_task(task_t *task)
+{
+    (void)task;
+    atomic_fetch_add(&ran, 1);
+}
+
+static void blocking_task(task_t *task)
+{
+    (void)task;
+    atomic_fetch_add(&started, 1);
+    while (!atomic_load(&release))
+        usleep(1000);
+    atomic_fetch_add(&ran, 1);
+}
+
+/* Counts into the atomic_int in user_data */
+static void counter_task(task_t *task)
+{
+    atomic_fetch_add((atomic_int *)task->user_data, 1);
+}
+
+static unsigned long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void push(thpool_t *thpool, task_handler_t handler)
+{
+    task_t *task = thpool_task_init(thpool);
+
+    CHECK(task != NULL);
+    task->handler = handler;
+    CHECK(task_queue_push(thpool_taskqueue(thpool), task) == 0);
+}
+
+/* Wait until the pool runs exactly num_threads workers */
+static int wait_threads(thpool_t *thpool, int num_threads)
+{
+    thpool_resize_stats_t stats;
+    int waited;
+
+    for (waited = 0; waited < POOL_TIMEOUT_MS; waited++) {
+        thpool_resize_stats(thpool, &stats);
+        if (stats.num_threads == num_threads)
+            return 0;
+        usleep(1000);
+    }
+    return -1;
+}
+
+static void push_counted(thpool_t *thpool, atomic_int *counter)
+{
+    task_t *task = thpool_task_init(thpool);
+
+    CHECK(task != NULL);
+    task->handler = counter_task;
+    task->user_data = counter;
+    CHECK(task_queue_push(thpool_taskqueue(thpool), task) == 0);
+}
+
+static int running_slots(thpool_t *thpool)
+{
+    thpool_worker_info_t info[8];
+    int n, count, running = 0;
+
+    count = thpool_worker_placement(thpool, info, 8);
+    for (n = 0; n < count; n++)
+        running += info[n].running;
+    return running;
+}
+
+static void test_elastic_shrink(void)
+{
+    thpool_options_t opts;
+    thpool_resize_stats_t stats;
+    thpool_t *thpool;
+    int round, n;
+
+    thpool_options_init(&opts);
+    opts.num_threads = 1;
+    opts.max_threads = 4;
+    opts.grow_wait_ms = 5;
+    opts.idle_timeout_ms = 20;
+    thpool = thpool_init_opts(&opts);
+    CHECK(thpool != NULL);
+    atomic_store(&ran, 0);
+
+    for (round = 0; round < 2; round++) {
+        atomic_store(&release, 0);
+        for (n = 0; n < opts.max_threads; n++)
+            push(thpool, blocking_task);
+        CHECK(wait_threads(thpool, opts.max_threads) == 0);
+        CHECK(running_slots(thpool) == opts.max_threads);
+        atomic_store(&release, 1);
+        thpool_wait(thpool);
+
+        CHECK(wait_threads(thpool, 1) == 0);
+        CHECK(running_slots(thpool) == 1);
+        for (n = 0; n < POOL_TASKS; n++)
+            push(thpool, count_task);
+        thpool_wait(thpool);
+    }
+
+    CHECK(atomic_load(&ran) == 2 * (opts.max_threads + POOL_TASKS));
+    thpool_resize_stats(thpool, &stats);
+    CHECK(stats.grown >= 2 * (unsigned long)(opts.max_threads - 1));
+    CHECK(stats.shrunk >= 2 * (unsigned long)(opts.max_threads - 1));
+    CHECK(stats.peak_threads == opts.max_threads);
+    thpool_destroy(thpool);
+    printf("elastic_shrink: ok\n");
+}
+
+static void test_independent_pools(void)
+{
+    thpool_t *first, *second;
+    atomic_int first_ran, second_ran;
+    unsigned long long start;
+    int n;
+
+    start = now_ms();
+    for (n = 0; n < POOL_CYCLES; n++) {
+        CHECK((first = thpool_init(4)) != NULL);
+        thpool_destroy(first);
+    }
+    CHECK(now_ms() - start < POOL_CYCLES_MS);
+
+    atomic_init(&first_ran, 0);
+    atomic_init(&second_ran, 0);
+    CHECK((first = thpool_init(2)) != NULL);
+    CHECK((second = thpool_init(2)) != NULL);
+    for (n = 0; n < POOL_TASKS; n++) {
+        push_counted(first, &first_ran);
+        push_counted(second, &second_ran);
+    }
+    thpool_wait(first);
+    thpool_destroy(first);
+    for (n = 0; n < POOL_TASKS; n++)
+        push_counted(second, &second_ran);
+    thpool_wait(second);
+    CHECK(atomic_load(&first_ran) == POOL_TASKS);
+    CHECK(atomic_load(&second_ran) == 2 * POOL_TASKS);
+    CHECK(thpool_num_threads_working(second) == 0);
+    thpool_destroy(second);
+    printf("independent_pools: ok\n");
+}
+
+static void test_pause_resume(void)
+{
+    thpool_t *paused, *other;
+    atomic_int paused_ran, other_ran;
+    unsigned long long start;
+    int n;
+
+    atomic_init(&paused_ran, 0);
+    atomic_init(&other_ran, 0);
+    CHECK((paused = thpool_init(2)) != NULL);
+    CHECK((other = thpool_init(1)) != NULL);
+    atomic_store(&ran, 0);
+    atomic_store(&started, 0);
+    atomic_store(&release, 0);
+    push(paused, blocking_task);
+    while (!atomic_load(&started))
+        usleep(1000);
+
+    /* Takes effect at the task boundary */
+    thpool_pause(paused);
+    for (n = 0; n < POOL_TASKS; n++) {
+        push_counted(paused, &paused_ran);
+        push_counted(other, &other_ran);
+    }
+    atomic_store(&release, 1);
+    thpool_wait(other);
+    CHECK(atomic_load(&other_ran) == POOL_TASKS);
+    usleep(PAUSE_MS * 1000);
+    CHECK(atomic_load(&ran) == 1);
+    CHECK(atomic_load(&paused_ran) == 0);
+    CHECK(thpool_num_threads_working(paused) == 0);
+
+    start = now_ms();
+    thpool_resume(paused);
+    thpool_wait(paused);
+    CHECK(now_ms() - start < RESUME_MS);
+    CHECK(atomic_load(&paused_ran) == POOL_TASKS);
+
+    thpool_destroy(other);
+    thpool_destroy(paused);
+    printf("pause_resume: ok\n");
+}
+
+static atomic_int placement_cpu_other;
+static atomic_size_t placement_stack;
+
+/* Notes a cpu other than the pinned one, and the smallest stack seen */
+static void placement_task(task_t *task)
+{
+    int pinned = (int)(long)task->user_data;
+    size_t size, seen;
+    pthread_attr_t attr;
+
+    if (sched_getcpu() != pinned)
+        atomic_store(&placement_cpu_other, 1);
+    CHECK(pthread_getattr_np(pthread_self(), &attr) == 0);
+    CHECK(pthread_attr_getstacksize(&attr, &size) == 0);
+    pthread_attr_destroy(&attr);
+    seen = atomic_load(&placement_stack);
+    while ((seen == 0 || size < seen) &&
+           !atomic_compare_exchange_weak(&placement_stack, &seen, size)) {
+    }
+}
+
+static void test_placement(void)
+{
+    thpool_worker_info_t info[PLACEMENT_THREADS];
+    thpool_options_t opts;
+    thpool_cpuset_t set;
+    thpool_t *thpool;
+    cpu_set_t allowed;
+    task_t *task;
+    int cpu = -1, n;
+
+    /* The last cpu we may run on, likely not the one of this thread */
+    CHECK(sched_getaffinity(0, sizeof(allowed), &allowed) == 0);
+    for (n = 0; n < CPU_SETSIZE && n < THPOOL_CPUSET_MAX; n++) {
+        if (CPU_ISSET(n, &allowed))
+            cpu = n;
+    }
+    CHECK(cpu >= 0);
+    thpool_cpuset_zero(&set);
+    CHECK(thpool_cpuset_add(&set, cpu) == 0);
+
+    thpool_options_init(&opts);
+    opts.num_threads = PLACEMENT_THREADS;
+    opts.cpusets = &set;
+    opts.num_cpusets = 1;
+    opts.stack_size = PLACEMENT_STACK;
+    CHECK((thpool = thpool_init_opts(&opts)) != NULL);
+    for (n = 0; n < POOL_TASKS; n++) {
+        CHECK((task = thpool_task_init(thpool)) != NULL);
+        task->handler = placement_task;
+        task->user_data = (void *)(long)cpu;
+        CHECK(task_queue_push(thpool_taskqueue(thpool), task) == 0);
+    }
+    thpool_wait(thpool);
+
+    CHECK(atomic_load(&placement_cpu_other) == 0);
+    CHECK(atomic_load(&placement_stack) >= PLACEMENT_STACK);
+    CHECK(atomic_load(&placement_stack) < 2 * PLACEMENT_STACK);
+    CHECK(thpool_worker_placement(thpool, info, PLACEMENT_THREADS) == PLACEMENT_THREADS);
+    for (n = 0; n < PLACEMENT_THREADS; n++) {
+        CHECK(info[n].id == n);
+        CHECK(info[n].running && info[n].pinned);
+        CHECK(info[n].cpu == cpu);
+        CHECK(info[n].migrations == 0);
+    }
+    thpool_destroy(thpool);
+
+    /* Unpinned unless asked for */
+    CHECK((thpool = thpool_init(1)) != NULL);
+    CHECK(thpool_worker_placement(thpool, info, PLACEMENT_THREADS) == 1);
+    CHECK(info[0].running && !info[0].pinned);
+    thpool_destroy(thpool);
+    printf("placement: ok\n");
+}
+
+static void sleep_task(task_t *task)
+{
+    (void)task;
+    usleep(STATS_SLOW_MS * 1000);
+}
+
+static void test_stats_histograms(void)
+{
+    thpool_stats_t total, workers[STATS_THREADS];
+    thpool_options_t opts;
+    thpool_t *thpool;
+    unsigned long tasks = 0;
+    int n;
+
+    CHECK((thpool = thpool_init(1)) != NULL);
+    CHECK(thpool_stats_snapshot(thpool, &total, NULL, 0) == -1);
+    thpool_destroy(thpool);
+
+    thpool_options_init(&opts);
+    opts.num_threads = STATS_THREADS;
+    opts.collect_stats = 1;
+    CHECK((thpool = thpool_init_opts(&opts)) != NULL);
+    thpool_pause(thpool);
+    for (n = 0; n < STATS_FAST + STATS_SLOW; n++)
+        push(thpool, n < STATS_FAST ? count_task : sleep_task);
+    usleep(STATS_WAIT_MS * 1000);
+    thpool_resume(thpool);
+    thpool_wait(thpool);
+
+    CHECK(thpool_stats_snapshot(thpool, &total, workers, STATS_THREADS) == STATS_THREADS);
+    CHECK(total.id == -1);
+    CHECK(total.tasks == STATS_FAST + STATS_SLOW);
+    CHECK(total.wait.count == total.tasks && total.run.count == total.tasks);
+    CHECK(total.busy_ns >= STATS_SLOW * STATS_SLOW_MS * MS);
+
+    /* Buckets are within 1/8 of the value */
+    CHECK(total.wait.p50_ns >= STATS_WAIT_MS * MS * 7 / 8);
+    CHECK(total.run.p50_ns < STATS_SLOW_MS * MS / 2);
+    CHECK(total.run.p99_ns >= STATS_SLOW_MS * MS * 7 / 8);
+    CHECK(total.run.max_ns >= STATS_SLOW_MS * MS);
+    CHECK(total.run.p99_ns <= total.run.max_ns);
+
+    for (n = 0; n < STATS_THREADS; n++) {
+        CHECK(workers[n].id == n);
+        CHECK(workers[n].run.count == workers[n].tasks);
+        CHECK(workers[n].run.max_ns <= total.run.max_ns);
+        tasks += workers[n].tasks;
+    }
+    CHECK(tasks == total.tasks);
+    thpool_destroy(thpool);
+    printf("stats_histograms: ok\n");
+}
+
+int main(void)
+{
+    test_elastic_shrink();
+    test_independent_pools();
+    test_pause_resume();
+    test_placement();
+    test_stats_histograms();
+    return 0;
+}
@@ -0,0 +1,347 @@
+/*
+ * thpool queue tests
+ *
+ *   steal_contention  tasks a worker pushes onto its own deque, well past
+ *                     its initial size, run exactly once each while the
+ *                     other workers steal them and the owner pops
+ *   ring_full_empty   a ring takes its capacity and refuses more, single
+ *                     and batched, then drains empty, over several laps
+ *   slab_reuse        a slab capped at one chunk falls back to malloc when
+ *                     exhausted and reuses freed and finished tasks
+ *                     without growing
+ *   lane_order        queued tasks run high before normal, background only
+ *                     on the anti-starvation pull until normal is empty
+ *   background_max    no more background tasks run at once than allowed,
+ *                     normal tasks pass them on the other workers
+ *
+ * Exits non-zero on the first failed check, best run under
+ * -fsanitize=address or thread as well.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thpool.h"
+
+#define STEAL_THREADS       4
+#define STEAL_TASKS         4096    /* children of one spawner, > a deque  */
+#define STEAL_ROUNDS        8
+#define RING_CAPACITY       8
+#define RING_LAPS           5
+#define SLAB_ROUNDS         8
+#define LANE_TASKS          4       /* per lane */
+#define BACKGROUND_THREADS  4
+#define BACKGROUND_TASKS    6
+#define BACKGROUND_RUN_MS   20
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                        \
+        }                                                                   \
+    } while (0)
+
+static atomic_int ran;
+static atomic_int started;
+static atomic_int release;
+
+static void count_task(task_t *task)
+{
+    (void)task;
+    atomic_fetch_add(&ran, 1);
+}
+
+static void blocking_task(task_t *task)
+{
+    (void)task;
+    atomic_fetch_add(&started, 1);
+    while (!atomic_load(&release))
+        usleep(1000);
+    atomic_fetch_add(&ran, 1);
+}
+
+static task_t *new_task(thpool_t *thpool, task_handler_t handler)
+{
+    task_t *task = thpool_task_init(thpool);
+
+    CHECK(task != NULL);
+    task->handler = handler;
+    return task;
+}
+
+/* Occupies the only worker of the pool until release is set */
+static void block_worker(thpool_t *thpool)
+{
+    atomic_store(&started, 0);
+    atomic_store(&release, 0);
+    CHECK(task_queue_push(thpool_taskqueue(thpool), new_task(thpool, blocking_task)) == 0);
+    while (!atomic_load(&started))
+        usleep(1000);
+}
+
+static atomic_int steal_runs[STEAL_TASKS];
+static atomic_int stolen;
+static pthread_t spawner_thread;
+
+static void steal_child(task_t *task)
+{
+    int n = (int)(long)task->user_data;
+    volatile int spin;
+
+    for (spin = 0; spin < 200; spin++) {
+    }
+    atomic_fetch_add(&steal_runs[n], 1);
+    if (!pthread_equal(pthread_self(), spawner_thread))
+        atomic_fetch_add(&stolen, 1);
+}
+
+/* Runs on a worker, so its children go to that worker's own deque */
+static void steal_spawner(task_t *task)
+{
+    thpool_t *thpool = (thpool_t *)task->user_data;
+    int n;
+
+    spawner_thread = pthread_self();
+    for (n = 0; n < STEAL_TASKS; n++) {
+        task_t *child = thpool_task_init(thpool);
+
+        CHECK(child != NULL);
+        child->handler = steal_child;
+        child->user_data = (void *)(long)n;
+        CHECK(task_queue_push(thpool_taskqueue(thpool), child) == 0);
+    }
+}
+
+static void test_steal_contention(void)
+{
+    thpool_t *thpool = thpool_init(STEAL_THREADS);
+    int round, n;
+
+    CHECK(thpool != NULL);
+    for (round = 0; round < STEAL_ROUNDS; round++) {
+        task_t *task = thpool_task_init(thpool);
+
+        for (n = 0; n < STEAL_TASKS; n++)
+            atomic_store(&steal_runs[n], 0);
+        CHECK(task != NULL);
+        task->handler = steal_spawner;
+        task->user_data = thpool;
+        CHECK(task_queue_push(thpool_taskqueue(thpool), task) == 0);
+        thpool_wait(thpool);
+
+        for (n = 0; n < STEAL_TASKS; n++)
+            CHECK(atomic_load(&steal_runs[n]) == 1);
+    }
+    /* Only thieves run children anywhere but on the spawner's worker */
+    CHECK(atomic_load(&stolen) > 0);
+    thpool_destroy(thpool);
+    printf("steal_contention: ok\n");
+}
+
+static void test_ring_full_empty(void)
+{
+    thpool_options_t opts;
+    thpool_t *thpool;
+    task_t *tasks[2 * RING_CAPACITY], *task;
+    int lap, n, expected = 0;
+
+    thpool_options_init(&opts);
+    opts.num_threads = 1;
+    opts.queue_type = THPOOL_QUEUE_RING;
+    opts.queue_capacity = RING_CAPACITY;
+    thpool = thpool_init_opts(&opts);
+    CHECK(thpool != NULL);
+    atomic_store(&ran, 0);
+
+    for (lap = 0; lap < RING_LAPS; lap++) {
+        block_worker(thpool);
+        expected++;
+        if (lap % 2 == 0) {
+            for (n = 0; n < RING_CAPACITY; n++)
+                CHECK(task_queue_push(thpool_taskqueue(thpool), new_task(thpool, count_task)) == 0);
+        } else {
+            for (n = 0; n < 2 * RING_CAPACITY; n++)
+                tasks[n] = new_task(thpool, count_task);
+            CHECK(task_queue_push_batch(thpool_taskqueue(thpool), tasks, 2 * RING_CAPACITY) ==
+                  RING_CAPACITY);
+            for (n = RING_CAPACITY; n < 2 * RING_CAPACITY; n++)
+                task_free(tasks[n]);
+        }
+        expected += RING_CAPACITY;
+
+        /* Full: neither one more nor a batch gets in, the caller keeps them */
+        task = new_task(thpool, count_task);
+        CHECK(task_queue_push(thpool_taskqueue(thpool), task) == -1);
+        CHECK(task_queue_push_batch(thpool_taskqueue(thpool), &task, 1) == 0);
+        task_free(task);
+
+        atomic_store(&release, 1);
+        thpool_wait(thpool);
+        CHECK(atomic_load(&ran) == expected);
+    }
+    CHECK(thpool_num_threads_working(thpool) == 0);
+    thpool_destroy(thpool);
+    printf("ring_full_empty: ok\n");
+}
+
+static void test_slab_reuse(void)
+{
+    thpool_options_t opts;
+    thpool_task_stats_t stats;
+    thpool_t *thpool;
+    task_t **tasks, *first, *extra;
+    size_t capacity, n;
+    int round;
+
+    thpool_options_init(&opts);
+    opts.num_threads = 2;
+    opts.task_slab_max = 1;         /* rounded up to one chunk */
+    thpool = thpool_init_opts(&opts);
+    CHECK(thpool != NULL);
+    thpool_task_stats(thpool, &stats);
+    CHECK(stats.slab_capacity == 0 && stats.slab_hits == 0);
+
+    /* Exhaust the slab, the next task is malloc'ed */
+    first = new_task(thpool, count_task);
+    thpool_task_stats(thpool, &stats);
+    capacity = stats.slab_capacity;
+    CHECK(capacity > 0);
+    CHECK((tasks = malloc(capacity * sizeof(task_t *))) != NULL);
+    tasks[0] = first;
+    for (n = 1; n < capacity; n++)
+        tasks[n] = new_task(thpool, count_task);
+    extra = new_task(thpool, count_task);
+    thpool_task_stats(thpool, &stats);
+    CHECK(stats.slab_hits == capacity);
+    CHECK(stats.fallback_allocs == 1);
+
+    /* Freed ones come back, the slab does not grow */
+    for (n = 0; n < capacity; n++)
+        task_free(tasks[n]);
+    for (n = 0; n < capacity; n++)
+        tasks[n] = new_task(thpool, count_task);
+    thpool_task_stats(thpool, &stats);
+    CHECK(stats.slab_hits == 2 * capacity);
+    CHECK(stats.fallback_allocs == 1);
+    CHECK(stats.slab_capacity == capacity);
+
+    /* So do the ones workers finished, the malloc'ed one is freed */
+    atomic_store(&ran, 0);
+    CHECK(task_queue_push_batch(thpool_taskqueue(thpool), tasks, capacity) == capacity);
+    CHECK(task_queue_push(thpool_taskqueue(thpool), extra) == 0);
+    thpool_wait(thpool);
+    for (round = 0; round < SLAB_ROUNDS; round++) {
+        for (n = 0; n < capacity / 2; n++)
+            tasks[n] = new_task(thpool, count_task);
+        CHECK(task_queue_push_batch(thpool_taskqueue(thpool), tasks, capacity / 2) == capacity / 2);
+        thpool_wait(thpool);
+    }
+    CHECK(atomic_load(&ran) == (int)(capacity + 1 + SLAB_ROUNDS * (capacity / 2)));
+    thpool_task_stats(thpool, &stats);
+    CHECK(stats.fallback_allocs == 1);
+    CHECK(stats.slab_capacity == capacity);
+
+    free(tasks);
+    thpool_destroy(thpool);
+    printf("slab_reuse: ok\n");
+}
+
+static task_prio_t lane_ran[TASK_PRIO_MAX * LANE_TASKS];
+static atomic_int lane_count;
+
+static void lane_task(task_t *task)
+{
+    lane_ran[atomic_fetch_add(&lane_count, 1)] = task->priority;
+}
+
+static void test_lane_order(void)
+{
+    static const task_prio_t order[] = { TASK_PRIO_BACKGROUND, TASK_PRIO_NORMAL, TASK_PRIO_HIGH };
+    thpool_t *thpool = thpool_init(1);
+    int n, lane, last_normal = -1, early_background = 0;
+
+    CHECK(thpool != NULL);
+    atomic_store(&lane_count, 0);
+    block_worker(thpool);
+    for (n = 0; n < LANE_TASKS; n++) {
+        for (lane = 0; lane < TASK_PRIO_MAX; lane++)
+            CHECK(task_queue_push_prio(thpool_taskqueue(thpool), new_task(thpool, lane_task),
+                                       order[lane]) == 0);
+    }
+    atomic_store(&release, 1);
+    thpool_wait(thpool);
+    CHECK(atomic_load(&lane_count) == TASK_PRIO_MAX * LANE_TASKS);
+
+    for (n = 0; n < TASK_PRIO_MAX * LANE_TASKS; n++) {
+        CHECK(lane_ran[n] == TASK_PRIO_HIGH || n >= LANE_TASKS);
+        if (lane_ran[n] == TASK_PRIO_NORMAL)
+            last_normal = n;
+    }
+    for (n = 0; n < last_normal; n++)
+        early_background += lane_ran[n] == TASK_PRIO_BACKGROUND;
+    CHECK(early_background == 1);
+    thpool_destroy(thpool);
+    printf("lane_order: ok\n");
+}
+
+static atomic_int background_running;
+static atomic_int background_peak;
+static atomic_int background_done;
+static atomic_int background_done_seen;
+
+static void background_task(task_t *task)
+{
+    int running = atomic_fetch_add(&background_running, 1) + 1;
+    int peak = atomic_load(&background_peak);
+
+    (void)task;
+    while (running > peak && !atomic_compare_exchange_weak(&background_peak, &peak, running)) {
+    }
+    usleep(BACKGROUND_RUN_MS * 1000);
+    atomic_fetch_sub(&background_running, 1);
+    atomic_fetch_add(&background_done, 1);
+}
+
+static void normal_task(task_t *task)
+{
+    (void)task;
+    atomic_store(&background_done_seen, atomic_load(&background_done));
+}
+
+static void test_background_max(void)
+{
+    thpool_options_t opts;
+    thpool_t *thpool;
+    int n;
+
+    thpool_options_init(&opts);
+    opts.num_threads = BACKGROUND_THREADS;
+    opts.background_max_threads = 1;
+    thpool = thpool_init_opts(&opts);
+    CHECK(thpool != NULL);
+
+    for (n = 0; n < BACKGROUND_TASKS; n++)
+        CHECK(task_queue_push_prio(thpool_taskqueue(thpool), new_task(thpool, background_task),
+                                   TASK_PRIO_BACKGROUND) == 0);
+    CHECK(task_queue_push(thpool_taskqueue(thpool), new_task(thpool, normal_task)) == 0);
+    thpool_wait(thpool);
+
+    CHECK(atomic_load(&background_done) == BACKGROUND_TASKS);
+    CHECK(atomic_load(&background_peak) == 1);
+    CHECK(atomic_load(&background_done_seen) < BACKGROUND_TASKS);
+    thpool_destroy(thpool);
+    printf("background_max: ok\n");
+}
+
+int main(void)
+{
+    test_steal_contention();
+    test_ring_full_empty();
+    test_slab_reuse();
+    test_lane_order();
+    test_background_max();
+    return 0;
+}
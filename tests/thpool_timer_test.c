@@ -0,0 +1,159 @@
+/*
+ * thpool timer wheel tests
+ *
+ *   cascade_order     timers on level 0 and ones cascading down from level 1
+ *                     fire in expiry order, equal ones in scheduling order,
+ *                     none before its time
+ *   periodic_cancel   a periodic timer cancelled by its own fire stops
+ *                     firing, its cleanup_cb runs once and copies never
+ *                     run it
+ *
+ * Exits non-zero on the first failed check, best run under
+ * -fsanitize=address or thread as well.
+ */
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "thpool.h"
+
+#define PERIODIC_MS         5
+#define PERIODIC_CANCEL_AT  3       /* fire that cancels its timer */
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                        \
+        }                                                                   \
+    } while (0)
+
+/* Level 0 covers 64ms, the others cascade down at least once */
+static const unsigned int cascade_ms[] = { 260, 70, 5, 130, 100, 66, 150, 40, 100, 90 };
+#define CASCADE_TIMERS      (sizeof(cascade_ms) / sizeof(cascade_ms[0]))
+
+static int cascade_ran[CASCADE_TIMERS];
+static unsigned long long cascade_at[CASCADE_TIMERS];
+static atomic_int cascade_count;
+static unsigned long long start_ms;
+
+static unsigned long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void cascade_task(task_t *task)
+{
+    int n = (int)(long)task->user_data;
+    int order = atomic_fetch_add(&cascade_count, 1);
+
+    cascade_ran[order] = n;
+    cascade_at[n] = now_ms() - start_ms;
+}
+
+static void test_cascade_order(void)
+{
+    thpool_t *thpool = thpool_init(1);
+    size_t n, order;
+    int last;
+
+    CHECK(thpool != NULL);
+    start_ms = now_ms();
+    for (n = 0; n < CASCADE_TIMERS; n++) {
+        task_t *task = thpool_task_init(thpool);
+        thpool_timer_t *timer;
+
+        CHECK(task != NULL);
+        task->handler = cascade_task;
+        task->user_data = (void *)(long)n;
+        CHECK((timer = thpool_schedule_after(thpool, task, cascade_ms[n])) != NULL);
+        thpool_timer_release(timer);
+    }
+    while (atomic_load(&cascade_count) < (int)CASCADE_TIMERS) {
+        CHECK(now_ms() - start_ms < 5000);
+        usleep(1000);
+    }
+    thpool_wait(thpool);
+
+    for (order = 0; order < CASCADE_TIMERS; order++) {
+        n = cascade_ran[order];
+        /* The wheel ticks in whole milliseconds since its epoch */
+        CHECK(cascade_at[n] + 1 >= cascade_ms[n]);
+        if (order == 0)
+            continue;
+        last = cascade_ran[order - 1];
+        CHECK(cascade_ms[last] < cascade_ms[n] ||
+              (cascade_ms[last] == cascade_ms[n] && last < (int)n));
+    }
+    thpool_destroy(thpool);
+    printf("cascade_order: ok\n");
+}
+
+static _Atomic(thpool_timer_t *) periodic_timer;
+static atomic_int periodic_fires;
+static atomic_int periodic_cancelled;
+static atomic_int periodic_cleaned;
+
+static void periodic_task(task_t *task)
+{
+    (void)task;
+    if (atomic_fetch_add(&periodic_fires, 1) + 1 != PERIODIC_CANCEL_AT)
+        return;
+
+    /* The caller may not have stored the handle yet */
+    while (atomic_load(&periodic_timer) == NULL)
+        usleep(100);
+    atomic_store(&periodic_cancelled, thpool_timer_cancel(atomic_load(&periodic_timer)) == 0);
+}
+
+static void periodic_cleanup(task_t *task)
+{
+    (void)task;
+    atomic_fetch_add(&periodic_cleaned, 1);
+}
+
+static void test_periodic_cancel(void)
+{
+    thpool_t *thpool = thpool_init(2);
+    task_t *task;
+    int fires;
+
+    CHECK(thpool != NULL);
+    CHECK((task = thpool_task_init(thpool)) != NULL);
+    task->handler = periodic_task;
+    task->cleanup_cb = periodic_cleanup;
+    atomic_store(&periodic_timer, thpool_schedule_every(thpool, task, PERIODIC_MS));
+    CHECK(atomic_load(&periodic_timer) != NULL);
+
+    start_ms = now_ms();
+    while (!atomic_load(&periodic_cancelled)) {
+        CHECK(now_ms() - start_ms < 5000);
+        usleep(1000);
+    }
+    CHECK(atomic_load(&periodic_cleaned) == 1);
+
+    /* A fire the wheel thread was queueing at the time may still land */
+    usleep(4 * PERIODIC_MS * 1000);
+    thpool_wait(thpool);
+    fires = atomic_load(&periodic_fires);
+    CHECK(fires >= PERIODIC_CANCEL_AT && fires <= PERIODIC_CANCEL_AT + 1);
+    usleep(10 * PERIODIC_MS * 1000);
+    thpool_wait(thpool);
+    CHECK(atomic_load(&periodic_fires) == fires);
+    CHECK(atomic_load(&periodic_cleaned) == 1);
+
+    thpool_destroy(thpool);
+    printf("periodic_cancel: ok\n");
+}
+
+int main(void)
+{
+    test_cascade_order();
+    test_periodic_cancel();
+    return 0;
+}
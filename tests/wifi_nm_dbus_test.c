@@ -0,0 +1,437 @@
+/*
+ * NetworkManager D-Bus backend tests against a stand-in NetworkManager
+ *
+ *   nm_load           the wifi device is picked out of GetDevices, access
+ *                     points and the active one are loaded
+ *   nm_scan_signals   RequestScan, AccessPointAdded and a burst of signal
+ *                     changes end up in snapshots, at most one per
+ *                     NM_DBUS_PUBLISH_MS, the last change included
+ *   nm_connect        AddAndActivateConnection carries ssid, psk and the
+ *                     access point, ActiveAccessPoint changes follow
+ *
+ * A private dbus-daemon stands in for the system bus, the stand-in
+ * NetworkManager runs on a thread of the test with its own connection.
+ * Skipped if dbus-daemon is not installed.
+ *
+ * The backend is built into the test, so its static helpers and state
+ * are reachable as well.
+ */
+#include "../wifi/wifi_nm_dbus.c"
+
+#include <signal.h>
+#include <stdatomic.h>
+
+#include "subprocess.h"
+
+#define STUB_DEV_ETH            NM_DBUS_PATH "/Devices/1"
+#define STUB_DEV_WIFI           NM_DBUS_PATH "/Devices/2"
+#define STUB_AP_HOME            NM_DBUS_PATH "/AccessPoint/1"
+#define STUB_AP_CAFE            NM_DBUS_PATH "/AccessPoint/2"
+#define STUB_BURST              50      /* Strength changes after a scan  */
+#define STUB_BURST_GAP_US       4000
+#define STUB_STRENGTH_LAST      20      /* HomeNet once the burst is over */
+#define STUB_TIMEOUT_MS         5000
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                        \
+        }                                                                   \
+    } while (0)
+
+typedef struct stub_ap {
+    const char *path;
+    const char *ssid;
+    const char *bssid;
+    uint8_t strength;
+    uint32_t freq;
+    uint32_t flags, rsn_flags;
+    bool visible;
+} stub_ap_t;
+
+/* Just enough of NetworkManager: two devices, two access points */
+static struct stub {
+    sd_bus *bus;
+    pthread_t pthread;
+    atomic_int stop;
+    pthread_mutex_t lock;               /* fields below                  */
+    stub_ap_t aps[2];
+    char active[NM_DBUS_PATH_MAX];
+    int scans;
+    int burst;                          /* Strength changes still to send */
+    int wireless_enabled;
+    char ssid[64], psk[64], specific[NM_DBUS_PATH_MAX];
+} stub = {
+    .aps = {
+        { STUB_AP_HOME, "HomeNet", "00:11:22:33:44:55", 80, 2412, 0x1, 0x188, true },
+        { STUB_AP_CAFE, "Cafe", "00:11:22:33:44:66", 45, 5180, 0, 0, false },
+    },
+    .active = STUB_AP_HOME,
+    .wireless_enabled = 1,
+};
+
+static subprocess_t daemon_proc = { .pid = -1, .out_fd = -1 };
+
+/* Notice: Caller MUST hold the stub lock */
+static stub_ap_t *stub_ap(const char *path)
+{
+    size_t n;
+
+    for (n = 0; n < sizeof(stub.aps) / sizeof(stub.aps[0]); n++) {
+        if (!strcmp(stub.aps[n].path, path))
+            return &stub.aps[n];
+    }
+    return NULL;
+}
+
+/* Notice: Caller MUST hold the stub lock */
+static void stub_set_active(sd_bus *bus, const char *path)
+{
+    snprintf(stub.active, sizeof(stub.active), "%s", path);
+    sd_bus_emit_signal(bus, STUB_DEV_WIFI, DBUS_IFACE_PROPERTIES, "PropertiesChanged",
+                       "sa{sv}as", NM_DBUS_IFACE_WIRELESS, 1,
+                       "ActiveAccessPoint", "o", path, 0);
+}
+
+/* Notice: Caller MUST hold the stub lock */
+static int stub_get_all(sd_bus_message *m, stub_ap_t *ap)
+{
+    sd_bus_message *reply = NULL;
+    int r;
+
+    r = sd_bus_message_new_method_return(m, &reply);
+    if (r >= 0)
+        r = sd_bus_message_open_container(reply, 'a', "{sv}");
+    if (r >= 0)
+        r = sd_bus_message_open_container(reply, 'e', "sv");
+    if (r >= 0)
+        r = sd_bus_message_append(reply, "s", "Ssid");
+    if (r >= 0)
+        r = sd_bus_message_open_container(reply, 'v', "ay");
+    if (r >= 0)
+        r = sd_bus_message_append_array(reply, 'y', ap->ssid, strlen(ap->ssid));
+    if (r >= 0)
+        r = sd_bus_message_close_container(reply);
+    if (r >= 0)
+        r = sd_bus_message_close_container(reply);
+    if (r >= 0)
+        r = sd_bus_message_append(reply, "{sv}{sv}{sv}{sv}{sv}{sv}",
+                                  "Strength", "y", ap->strength,
+                                  "HwAddress", "s", ap->bssid,
+                                  "Frequency", "u", ap->freq,
+                                  "Flags", "u", ap->flags,
+                                  "WpaFlags", "u", 0,
+                                  "RsnFlags", "u", ap->rsn_flags);
+    if (r >= 0)
+        r = sd_bus_message_close_container(reply);
+    if (r >= 0)
+        r = sd_bus_send(NULL, reply, NULL);
+    sd_bus_message_unref(reply);
+
+    return r;
+}
+
+/* Notice: Caller MUST hold the stub lock */
+static int stub_add_and_activate(sd_bus_message *m)
+{
+    const char *setting, *key, *device, *specific, *psk;
+    const void *ssid;
+    size_t len;
+    int r;
+
+    r = sd_bus_message_enter_container(m, 'a', "{sa{sv}}");
+    while (r >= 0 && (r = sd_bus_message_enter_container(m, 'e', "sa{sv}")) > 0) {
+        r = sd_bus_message_read(m, "s", &setting);
+        if (r >= 0)
+            r = sd_bus_message_enter_container(m, 'a', "{sv}");
+        while (r >= 0 && (r = sd_bus_message_enter_container(m, 'e', "sv")) > 0) {
+            r = sd_bus_message_read(m, "s", &key);
+            if (r >= 0 && !strcmp(key, "ssid")) {
+                r = sd_bus_message_enter_container(m, 'v', "ay");
+                if (r >= 0)
+                    r = sd_bus_message_read_array(m, 'y', &ssid, &len);
+                if (r >= 0)
+                    snprintf(stub.ssid, sizeof(stub.ssid), "%.*s", (int)len, (const char *)ssid);
+                if (r >= 0)
+                    r = sd_bus_message_exit_container(m);
+            } else if (r >= 0 && !strcmp(key, "psk")) {
+                r = sd_bus_message_read(m, "v", "s", &psk);
+                if (r >= 0)
+                    snprintf(stub.psk, sizeof(stub.psk), "%s", psk);
+            } else if (r >= 0) {
+                r = sd_bus_message_skip(m, "v");
+            }
+            if (r >= 0)
+                r = sd_bus_message_exit_container(m);
+        }
+        if (r >= 0)
+            r = sd_bus_message_exit_container(m);
+        if (r >= 0)
+            r = sd_bus_message_exit_container(m);
+    }
+    if (r >= 0)
+        r = sd_bus_message_exit_container(m);
+    if (r >= 0)
+        r = sd_bus_message_read(m, "oo", &device, &specific);
+    if (r < 0)
+        return r;
+    snprintf(stub.specific, sizeof(stub.specific), "%s", specific);
+
+    r = sd_bus_reply_method_return(m, "oo", NM_DBUS_PATH "/Settings/1",
+                                   NM_DBUS_PATH "/ActiveConnection/1");
+    if (r >= 0 && stub_ap(specific) && !strcmp(stub_ap(specific)->ssid, stub.ssid))
+        stub_set_active(sd_bus_message_get_bus(m), specific);
+    return r;
+}
+
+static int stub_method(sd_bus_message *m, void __attribute__((unused)) *userdata,
+                       sd_bus_error __attribute__((unused)) *ret_error)
+{
+    sd_bus *bus = sd_bus_message_get_bus(m);
+    const char *member = sd_bus_message_get_member(m);
+    const char *path = sd_bus_message_get_path(m);
+    const char *iface, *name;
+    stub_ap_t *ap;
+    int r = 1;
+
+    if (!sd_bus_message_is_method_call(m, NULL, NULL) || member == NULL || path == NULL)
+        return 0;
+
+    pthread_mutex_lock(&stub.lock);
+    if (!strcmp(member, "GetDevices")) {
+        sd_bus_reply_method_return(m, "ao", 2, STUB_DEV_ETH, STUB_DEV_WIFI);
+    } else if (!strcmp(member, "Get") && sd_bus_message_read(m, "ss", &iface, &name) >= 0) {
+        if (!strcmp(name, "DeviceType"))
+            sd_bus_reply_method_return(m, "v", "u", strcmp(path, STUB_DEV_WIFI) ? 1 : NM_DEVICE_TYPE_WIFI);
+        else if (!strcmp(name, "ActiveAccessPoint"))
+            sd_bus_reply_method_return(m, "v", "o", stub.active);
+        else
+            r = 0;
+    } else if (!strcmp(member, "Set") && sd_bus_message_read(m, "ss", &iface, &name) >= 0 &&
+               !strcmp(name, "WirelessEnabled")) {
+        sd_bus_message_read(m, "v", "b", &stub.wireless_enabled);
+        sd_bus_reply_method_return(m, "");
+    } else if (!strcmp(member, "GetAll") && (ap = stub_ap(path)) != NULL) {
+        stub_get_all(m, ap);
+    } else if (!strcmp(member, "GetAccessPoints")) {
+        sd_bus_reply_method_return(m, "ao", 1 + stub.aps[1].visible, stub.aps[0].path,
+                                   stub.aps[1].path);
+    } else if (!strcmp(member, "RequestScan")) {
+        stub.scans++;
+        if (sd_bus_message_get_expect_reply(m))
+            sd_bus_reply_method_return(m, "");
+        if (!stub.aps[1].visible) {
+            stub.aps[1].visible = true;
+            sd_bus_emit_signal(bus, STUB_DEV_WIFI, NM_DBUS_IFACE_WIRELESS, "AccessPointAdded",
+                               "o", STUB_AP_CAFE);
+        }
+        stub.burst = STUB_BURST;
+    } else if (!strcmp(member, "AddAndActivateConnection")) {
+        stub_add_and_activate(m);
+    } else if (!strcmp(member, "Disconnect")) {
+        sd_bus_reply_method_return(m, "");
+        stub_set_active(bus, "/");
+    } else {
+        r = 0;
+    }
+    pthread_mutex_unlock(&stub.lock);
+
+    return r;
+}
+
+/* Serve method calls, send the burst a change at a time */
+static void *stub_do(void __attribute__((unused)) *arg)
+{
+    int r, strength;
+
+    while (!atomic_load(&stub.stop)) {
+        r = sd_bus_process(stub.bus, NULL);
+        CHECK(r >= 0);
+        if (r > 0)
+            continue;
+
+        pthread_mutex_lock(&stub.lock);
+        strength = stub.burst > 0 ? STUB_STRENGTH_LAST + --stub.burst : -1;
+        if (strength >= 0) {
+            stub.aps[0].strength = strength;
+            sd_bus_emit_signal(stub.bus, STUB_AP_HOME, DBUS_IFACE_PROPERTIES, "PropertiesChanged",
+                               "sa{sv}as", NM_DBUS_IFACE_AP, 1, "Strength", "y", strength, 0);
+        }
+        pthread_mutex_unlock(&stub.lock);
+        sd_bus_wait(stub.bus, strength >= 0 ? STUB_BURST_GAP_US : 50 * 1000);
+    }
+
+    return NULL;
+}
+
+/* @return false if there is no dbus-daemon to run */
+static bool stub_start(void)
+{
+    const char *argv[] = { "dbus-daemon", "--session", "--nofork", "--print-address=1", NULL };
+    char address[512];
+    size_t len = 0;
+    ssize_t n;
+
+    if (subprocess_spawn(&daemon_proc, argv, SUBPROCESS_STDERR_NULL) != 0)
+        return false;
+    while (len < sizeof(address) - 1 && memchr(address, '\n', len) == NULL) {
+        struct pollfd pfd = { .fd = daemon_proc.out_fd, .events = POLLIN };
+
+        CHECK(poll(&pfd, 1, STUB_TIMEOUT_MS) == 1);
+        n = read(daemon_proc.out_fd, address + len, sizeof(address) - 1 - len);
+        CHECK(n > 0 || (n < 0 && errno == EAGAIN));
+        if (n > 0)
+            len += n;
+    }
+    address[len] = '\0';
+    address[strcspn(address, "\n")] = '\0';
+    setenv("DBUS_SYSTEM_BUS_ADDRESS", address, 1);
+
+    pthread_mutex_init(&stub.lock, NULL);
+    CHECK(sd_bus_open_system(&stub.bus) >= 0);
+    CHECK(sd_bus_add_filter(stub.bus, NULL, stub_method, NULL) >= 0);
+    CHECK(sd_bus_request_name(stub.bus, NM_DBUS_SERVICE, 0) >= 0);
+    CHECK(pthread_create(&stub.pthread, NULL, stub_do, NULL) == 0);
+
+    return true;
+}
+
+static void stub_stop(void)
+{
+    atomic_store(&stub.stop, 1);
+    pthread_join(stub.pthread, NULL);
+    sd_bus_flush_close_unref(stub.bus);
+    pthread_mutex_destroy(&stub.lock);
+    kill(daemon_proc.pid, SIGTERM);
+    subprocess_wait(&daemon_proc);
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Entry of ssid in the latest snapshot, NULL if it has none */
+static const wifi_bss_t *snapshot_find(const wifi_scan_snapshot_t *snap, const char *ssid)
+{
+    size_t n;
+
+    for (n = 0; snap && n < snap->count; n++) {
+        if (!strcmp(snap->ssids[snap->bss[n].ssid_id], ssid))
+            return &snap->bss[n];
+    }
+    return NULL;
+}
+
+static void test_nm_load(nm_dbus_t *nm)
+{
+    wifi_network_info_t info;
+
+    CHECK(nm_dbus_is_available(nm));
+    CHECK(!strcmp(nm->device, STUB_DEV_WIFI));
+
+    memset(&info, 0, sizeof(info));
+    CHECK(nm_dbus_connection_info(nm, &info));
+    CHECK(!strcmp(info.ssid, "HomeNet"));
+
+    pthread_mutex_lock(&nm->lock);
+    CHECK(nm_ap_find(nm, STUB_AP_HOME) != NULL);
+    CHECK(nm_ap_find(nm, STUB_AP_HOME)->info.secured);
+    CHECK(nm_ap_find(nm, STUB_AP_HOME)->info.freq == 2412);
+    CHECK(nm_ap_find(nm, STUB_AP_CAFE) == NULL);
+    pthread_mutex_unlock(&nm->lock);
+
+    CHECK(nm_dbus_enable(nm, false));
+    pthread_mutex_lock(&stub.lock);
+    CHECK(stub.wireless_enabled == 0);
+    pthread_mutex_unlock(&stub.lock);
+    printf("nm_load: ok\n");
+}
+
+static void test_nm_scan_signals(nm_dbus_t *nm)
+{
+    const wifi_scan_snapshot_t *snap;
+    const wifi_bss_t *home = NULL, *cafe = NULL;
+    uint64_t first, start, elapsed;
+
+    start = now_ms();
+    nm_dbus_scan(nm);
+    snap = wifi_snapshot_acquire(&nm->results);
+    CHECK(snap != NULL);
+    first = snap->generation;
+    wifi_snapshot_release(snap);
+
+    /* Until the last change of the burst made it into a snapshot */
+    for (;;) {
+        snap = wifi_snapshot_acquire(&nm->results);
+        home = snapshot_find(snap, "HomeNet");
+        cafe = snapshot_find(snap, "Cafe");
+        if (home && cafe && home->signal == STUB_STRENGTH_LAST)
+            break;
+        wifi_snapshot_release(snap);
+        CHECK(now_ms() - start < STUB_TIMEOUT_MS);
+        usleep(1000);
+    }
+    elapsed = now_ms() - start;
+    CHECK((home->flags & WIFI_BSS_CONNECTED) && !(cafe->flags & WIFI_BSS_CONNECTED));
+    CHECK(cafe->freq == 5180);
+    CHECK(snap->generation > first);
+    CHECK(snap->generation - first <= elapsed / NM_DBUS_PUBLISH_MS + 2);
+    CHECK(snap->generation - first < STUB_BURST / 2);
+    wifi_snapshot_release(snap);
+
+    pthread_mutex_lock(&stub.lock);
+    CHECK(stub.scans == 1);
+    pthread_mutex_unlock(&stub.lock);
+    printf("nm_scan_signals: ok\n");
+}
+
+static void test_nm_connect(nm_dbus_t *nm)
+{
+    wifi_network_info_t network, info;
+    uint64_t start;
+
+    memset(&network, 0, sizeof(network));
+    snprintf(network.ssid, sizeof(network.ssid), "Cafe");
+    CHECK(nm_dbus_connect_ssid(nm, &network, "password123"));
+    CHECK(network.connected);
+    pthread_mutex_lock(&stub.lock);
+    CHECK(!strcmp(stub.ssid, "Cafe"));
+    CHECK(!strcmp(stub.psk, "password123"));
+    CHECK(!strcmp(stub.specific, STUB_AP_CAFE));
+    pthread_mutex_unlock(&stub.lock);
+
+    memset(&info, 0, sizeof(info));
+    CHECK(nm_dbus_connection_info(nm, &info));
+    CHECK(!strcmp(info.ssid, "Cafe"));
+
+    CHECK(nm_dbus_disconnect_ssid(nm, &network));
+    CHECK(!network.connected);
+    for (start = now_ms(); nm_dbus_connection_info(nm, &info); usleep(1000))
+        CHECK(now_ms() - start < STUB_TIMEOUT_MS);
+    printf("nm_connect: ok\n");
+}
+
+int main(void)
+{
+    nm_dbus_t *nm;
+
+    if (!stub_start()) {
+        printf("dbus-daemon not found, skipped\n");
+        return 0;
+    }
+    nm = nm_dbus_init();
+    CHECK(nm != NULL);
+
+    test_nm_load(nm);
+    test_nm_scan_signals(nm);
+    test_nm_connect(nm);
+
+    nm_dbus_free(nm);
+    stub_stop();
+    return 0;
+}
@@ -0,0 +1,236 @@
+/*
+ * nmcli backend tests against a stand-in nmcli found first in PATH
+ *
+ *   monitor_devices   only lines of wifi devices change the wifi state,
+ *                     eth0 and p2p-dev-wlan0 lines are ignored
+ *   monitor_ssid      the active network is found by the ssid of the
+ *                     profile, not by the profile name
+ *   monitor_overlong  a line cut at the buffer size neither looks up nor
+ *                     records a name, the stream carries on after it
+ *
+ * The stand-in answers the few nmcli commands the backend runs, its
+ * "nmcli monitor" relays a fifo the test writes to.
+ *
+ * The backend is built into the test, so its static helpers and state
+ * are reachable as well.
+ */
+#include "../wifi/wifi_nmcli.c"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define STUB_DIR                "/tmp/wifi_nmcli_test"
+#define STUB_TIMEOUT_MS         5000
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                        \
+        }                                                                   \
+    } while (0)
+
+/* Profile "HomeNet 1" is ssid HomeNet, profile Cafe is ssid "Cafe:Guest" */
+static const char stub_script[] =
+    "#!/bin/sh\n"
+    "case \"$*\" in\n"
+    "\"-t -f DEVICE,TYPE dev\")\n"
+    "    printf 'wlan0:wifi\\neth0:ethernet\\np2p-dev-wlan0:wifi-p2p\\nlo:loopback\\n' ;;\n"
+    "\"-t -f IN-USE,BSSID,FREQ,SIGNAL,SECURITY,SSID dev wifi\")\n"
+    "    cat <<'EOF'\n"
+    " :00\\:11\\:22\\:33\\:44\\:55:2412 MHz:80:WPA2:HomeNet\n"
+    " :00\\:11\\:22\\:33\\:44\\:66:5180 MHz:60:--:Cafe\\:Guest\n"
+    "EOF\n"
+    "    ;;\n"
+    "\"-t -g 802-11-wireless.ssid c show id \"*)\n"
+    "    echo \"$*\" >> " STUB_DIR "/lookups\n"
+    "    case \"$7\" in\n"
+    "    \"HomeNet 1\") echo HomeNet ;;\n"
+    "    Cafe) echo 'Cafe\\:Guest' ;;\n"
+    "    *) exit 10 ;;\n"
+    "    esac ;;\n"
+    "monitor)\n"
+    "    exec cat " STUB_DIR "/monitor ;;\n"
+    "*)\n"
+    "    exit 1 ;;\n"
+    "esac\n";
+
+static void stub_start(void)
+{
+    char path[4096];
+    FILE *fp;
+
+    mkdir(STUB_DIR, 0700);
+    unlink(STUB_DIR "/lookups");
+    unlink(STUB_DIR "/monitor");
+    CHECK(mkfifo(STUB_DIR "/monitor", 0600) == 0);
+    CHECK((fp = fopen(STUB_DIR "/nmcli", "w")) != NULL);
+    fputs(stub_script, fp);
+    fclose(fp);
+    CHECK(chmod(STUB_DIR "/nmcli", 0700) == 0);
+
+    snprintf(path, sizeof(path), STUB_DIR ":%s", getenv("PATH") ? getenv("PATH") : "/bin:/usr/bin");
+    setenv("PATH", path, 1);
+}
+
+static void stub_stop(void)
+{
+    unlink(STUB_DIR "/nmcli");
+    unlink(STUB_DIR "/monitor");
+    unlink(STUB_DIR "/lookups");
+    rmdir(STUB_DIR);
+}
+
+/* Whether the stand-in was asked for the ssid of a name containing str */
+static bool stub_looked_up(const char *str)
+{
+    char line[1024];
+    bool found = false;
+    FILE *fp;
+
+    if ((fp = fopen(STUB_DIR "/lookups", "r")) == NULL)
+        return false;
+    while (!found && fgets(line, sizeof(line), fp))
+        found = strstr(line, str) != NULL;
+    fclose(fp);
+
+    return found;
+}
+
+static void feed(nmcli_t *nmcli, const char *text)
+{
+    char line[NMCLI_MONITOR_LINE];
+
+    snprintf(line, sizeof(line), "%s", text);
+    nmcli_monitor_line(nmcli, line);
+}
+
+static bool connected(nmcli_t *nmcli, const char *ssid)
+{
+    wifi_network_info_t *network;
+    bool found = false;
+
+    pthread_mutex_lock(&nmcli->lock);
+    list_for_each_entry(network, &nmcli->wifi_network, list) {
+        if (!strcmp(network->ssid, ssid))
+            found = network->connected;
+    }
+    pthread_mutex_unlock(&nmcli->lock);
+
+    return found;
+}
+
+static bool active_is(nmcli_t *nmcli, const char *ssid)
+{
+    bool same;
+
+    pthread_mutex_lock(&nmcli->lock);
+    same = nmcli->active_known && !strcmp(nmcli->active, ssid);
+    pthread_mutex_unlock(&nmcli->lock);
+
+    return same;
+}
+
+static bool stale(nmcli_t *nmcli)
+{
+    bool ret;
+
+    pthread_mutex_lock(&nmcli->lock);
+    ret = nmcli->stale;
+    nmcli->stale = false;
+    pthread_mutex_unlock(&nmcli->lock);
+
+    return ret;
+}
+
+static void test_monitor_devices(nmcli_t *nmcli)
+{
+    wifi_network_info_t info;
+
+    feed(nmcli, "wlan0: using connection 'HomeNet 1'");
+    CHECK(active_is(nmcli, "HomeNet"));
+    CHECK(stale(nmcli));
+
+    feed(nmcli, "eth0: using connection 'Wired connection 1'");
+    feed(nmcli, "eth0: disconnected");
+    feed(nmcli, "p2p-dev-wlan0: disconnected");
+    feed(nmcli, "NetworkManager is now in the 'connected' state");
+    feed(nmcli, "'Wired connection 1' is now the primary connection");
+    CHECK(active_is(nmcli, "HomeNet"));
+    CHECK(!stale(nmcli));
+    CHECK(!stub_looked_up("Wired"));
+
+    memset(&info, 0, sizeof(info));
+    CHECK(nmcli_connection_info(nmcli, &info));
+    CHECK(!strcmp(info.ssid, "HomeNet"));
+
+    feed(nmcli, "wlan0: disconnected");
+    CHECK(active_is(nmcli, ""));
+    CHECK(stale(nmcli));
+    CHECK(!connected(nmcli, "HomeNet"));
+    CHECK(!nmcli_connection_info(nmcli, &info));
+    printf("monitor_devices: ok\n");
+}
+
+static void test_monitor_ssid(nmcli_t *nmcli)
+{
+    feed(nmcli, "wlan0: using connection 'HomeNet 1'");
+    CHECK(connected(nmcli, "HomeNet"));
+    CHECK(!connected(nmcli, "Cafe:Guest"));
+
+    /* No ssid to be found, nmcli is asked again on the next query */
+    feed(nmcli, "wlan0: using connection 'Gone'");
+    pthread_mutex_lock(&nmcli->lock);
+    CHECK(!nmcli->active_known);
+    pthread_mutex_unlock(&nmcli->lock);
+    printf("monitor_ssid: ok\n");
+}
+
+static void test_monitor_overlong(nmcli_t *nmcli, int fd)
+{
+    char line[2 * NMCLI_MONITOR_LINE];
+    int waited;
+
+    snprintf(line, sizeof(line), "wlan0: using connection '%0*d'\n", NMCLI_MONITOR_LINE, 0);
+    CHECK(write(fd, line, strlen(line)) == (ssize_t)strlen(line));
+    snprintf(line, sizeof(line), "wlan0: using connection 'Cafe'\n");
+    CHECK(write(fd, line, strlen(line)) == (ssize_t)strlen(line));
+
+    for (waited = 0; waited < STUB_TIMEOUT_MS && !active_is(nmcli, "Cafe:Guest"); waited++)
+        usleep(1000);
+    CHECK(active_is(nmcli, "Cafe:Guest"));
+    CHECK(connected(nmcli, "Cafe:Guest"));
+    CHECK(!connected(nmcli, "HomeNet"));
+    CHECK(!stub_looked_up("0000"));
+    pthread_mutex_lock(&nmcli->lock);
+    CHECK(nmcli->streaming);
+    pthread_mutex_unlock(&nmcli->lock);
+    printf("monitor_overlong: ok\n");
+}
+
+int main(void)
+{
+    nmcli_t *nmcli;
+    int fd;
+
+    stub_start();
+    nmcli = nmcli_init();
+    CHECK(nmcli != NULL);
+    CHECK(nmcli->streaming);
+    CHECK(nmcli->num_devices == 4);
+    /* Opens once the stand-in monitor has the fifo open */
+    CHECK((fd = open(STUB_DIR "/monitor", O_WRONLY)) >= 0);
+
+    nmcli_scan(nmcli);
+    CHECK(!connected(nmcli, "HomeNet") && !connected(nmcli, "Cafe:Guest"));
+    stale(nmcli);
+
+    test_monitor_devices(nmcli);
+    test_monitor_ssid(nmcli);
+    test_monitor_overlong(nmcli, fd);
+
+    nmcli_free(nmcli);
+    close(fd);
+    stub_stop();
+    return 0;
+}
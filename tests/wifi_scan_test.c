@@ -0,0 +1,370 @@
+/*
+ * wifi scan snapshot tests
+ *
+ *   publish_concurrent  readers acquiring and releasing while a publisher
+ *                       keeps replacing the snapshot always see a whole
+ *                       generation, never an older one than before, and a
+ *                       snapshot stays valid past the publisher's destroy
+ *   diff_events         publishing reports added and removed networks,
+ *                       signal moves once they add up to the threshold and
+ *                       connection changes, an unchanged scan reports nothing
+ *   index_lookup        ssid and bssid lookups find the strongest access
+ *                       point and the exact record, and miss on anything
+ *                       not in the snapshot, close keys and empty ones too
+ *   arena_reset         a generation spread over several chunks leaves one
+ *                       chunk as large as all of them, the same generation
+ *                       again fits into it and gets zeroed memory
+ *
+ * The arena is built into the test, so its chunks are reachable as well.
+ *
+ * Exits non-zero on the first failed check, best run under
+ * -fsanitize=address or thread as well.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wifi_internal.h"
+#include "../wifi/wifi_arena.c"
+
+#define SCAN_NETWORKS       8
+#define PUBLISH_ROUNDS      20000
+#define PUBLISH_READERS     4
+#define DIFF_THRESHOLD      5
+#define DIFF_EVENTS         16
+#define ARENA_ALLOCS        64
+#define ARENA_SIZE          1000    /* ARENA_ALLOCS of them need 3 chunks */
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                        \
+        }                                                                   \
+    } while (0)
+
+static wifi_network_info_t networks[SCAN_NETWORKS];
+
+static void network_set(int n, const char *ssid, uint8_t last, uint8_t signal)
+{
+    wifi_network_info_t *network = &networks[n];
+
+    memset(network, 0, sizeof(*network));
+    snprintf(network->ssid, sizeof(network->ssid), "%s", ssid);
+    network->bssid[0] = 0x02;
+    network->bssid[5] = last;
+    network->freq = 2412;
+    network->signal = signal;
+}
+
+/* Publish the first count entries of networks */
+static void publish(wifi_snapshot_pub_t *pub, int count)
+{
+    LIST_HEAD(list);
+    int n;
+
+    for (n = 0; n < count; n++)
+        list_add_tail(&networks[n].list, &list);
+    wifi_snapshot_publish_list(pub, &list, 0);
+}
+
+/* Generation g has g % SCAN_NETWORKS + 1 records, all with signal g */
+static void generation_set(uint64_t generation)
+{
+    char ssid[64];
+    int n;
+
+    for (n = 0; n < SCAN_NETWORKS; n++) {
+        snprintf(ssid, sizeof(ssid), "net%d", n);
+        network_set(n, ssid, n, (uint8_t)generation);
+    }
+}
+
+static void generation_check(const wifi_scan_snapshot_t *snap)
+{
+    char ssid[64];
+    size_t n;
+
+    CHECK(snap->count == snap->generation % SCAN_NETWORKS + 1);
+    CHECK(snap->ssid_count == snap->count);
+    for (n = 0; n < snap->count; n++) {
+        snprintf(ssid, sizeof(ssid), "net%zu", n);
+        CHECK(snap->bss[n].signal == (uint8_t)snap->generation);
+        CHECK(snap->bss[n].bssid[5] == n);
+        CHECK(!strcmp(snap->ssids[snap->bss[n].ssid_id], ssid));
+    }
+}
+
+static wifi_snapshot_pub_t publish_pub;
+static atomic_int publish_done;
+static atomic_int publish_seen;
+
+static void *publish_reader(void *arg)
+{
+    const wifi_scan_snapshot_t *snap;
+    uint64_t last = 0;
+
+    (void)arg;
+    while (!atomic_load(&publish_done)) {
+        snap = wifi_snapshot_acquire(&publish_pub);
+        if (snap == NULL)
+            continue;
+        CHECK(snap->generation >= last);
+        last = snap->generation;
+        generation_check(snap);
+        /* Held across later publishes, still the same generation */
+        sched_yield();
+        generation_check(snap);
+        CHECK(snap->generation == last);
+        wifi_snapshot_release(snap);
+        atomic_fetch_add(&publish_seen, 1);
+    }
+    return NULL;
+}
+
+static void test_publish_concurrent(void)
+{
+    pthread_t readers[PUBLISH_READERS];
+    const wifi_scan_snapshot_t *held;
+    uint64_t generation;
+    int n;
+
+    wifi_snapshot_pub_init(&publish_pub);
+    CHECK(wifi_snapshot_acquire(&publish_pub) == NULL);
+    for (n = 0; n < PUBLISH_READERS; n++)
+        CHECK(pthread_create(&readers[n], NULL, publish_reader, NULL) == 0);
+
+    for (generation = 1; generation <= PUBLISH_ROUNDS; generation++) {
+        generation_set(generation);
+        publish(&publish_pub, generation % SCAN_NETWORKS + 1);
+    }
+    /* Readers got through some acquires before they stop */
+    while (atomic_load(&publish_seen) < PUBLISH_READERS)
+        sched_yield();
+    atomic_store(&publish_done, 1);
+    for (n = 0; n < PUBLISH_READERS; n++)
+        pthread_join(readers[n], NULL);
+
+    /* The last one outlives its publisher */
+    CHECK((held = wifi_snapshot_acquire(&publish_pub)) != NULL);
+    CHECK(held->generation == PUBLISH_ROUNDS);
+    wifi_snapshot_pub_destroy(&publish_pub);
+    generation_check(held);
+    wifi_snapshot_release(held);
+    printf("publish_concurrent: ok\n");
+}
+
+static wifi_event_t diff_events[DIFF_EVENTS];
+static size_t diff_count;
+static int diff_calls;
+
+static void diff_notify(void *arg, const wifi_event_t *events, size_t count)
+{
+    (void)arg;
+    CHECK(count > 0 && count <= DIFF_EVENTS);
+    memcpy(diff_events, events, count * sizeof(*events));
+    diff_count = count;
+    diff_calls++;
+}
+
+/* Event of type for ssid in the last notify, NULL if there is none */
+static const wifi_event_t *diff_find(wifi_event_type_t type, const char *ssid)
+{
+    size_t n;
+
+    for (n = 0; n < diff_count; n++) {
+        if (diff_events[n].type == type && !strcmp(diff_events[n].ssid, ssid))
+            return &diff_events[n];
+    }
+    return NULL;
+}
+
+static void test_diff_events(void)
+{
+    wifi_snapshot_pub_t pub;
+    const wifi_event_t *event;
+
+    wifi_snapshot_pub_init(&pub);
+    pub.notify = diff_notify;
+    pub.notify_arg = NULL;
+    pub.signal_threshold = DIFF_THRESHOLD;
+
+    /* Everything is new to the first scan */
+    network_set(0, "alpha", 1, 50);
+    network_set(1, "beta", 2, 60);
+    publish(&pub, 2);
+    CHECK(diff_calls == 1 && diff_count == 2);
+    CHECK((event = diff_find(WIFI_EVENT_ADDED, "alpha")) != NULL);
+    CHECK(event->generation == 1 && event->bssid[5] == 1 && event->signal == 50);
+    CHECK(diff_find(WIFI_EVENT_ADDED, "beta") != NULL);
+
+    /* A move below the threshold is not reported */
+    network_set(0, "alpha", 1, 50 + DIFF_THRESHOLD - 2);
+    network_set(2, "gamma", 3, 40);
+    publish(&pub, 3);
+    CHECK(diff_calls == 2 && diff_count == 1);
+    CHECK((event = diff_find(WIFI_EVENT_ADDED, "gamma")) != NULL);
+    CHECK(event->generation == 2);
+
+    /* but adds up with the next one, beta is gone */
+    network_set(0, "alpha", 1, 50 + DIFF_THRESHOLD);
+    network_set(1, "gamma", 3, 40);
+    publish(&pub, 2);
+    CHECK(diff_calls == 3 && diff_count == 2);
+    CHECK((event = diff_find(WIFI_EVENT_SIGNAL, "alpha")) != NULL);
+    CHECK(event->old_signal == 50 && event->signal == 50 + DIFF_THRESHOLD);
+    CHECK((event = diff_find(WIFI_EVENT_REMOVED, "beta")) != NULL);
+    CHECK(event->generation == 3 && event->bssid[5] == 2);
+
+    /* Falling back counts from the reported signal */
+    network_set(0, "alpha", 1, 50);
+    networks[0].connected = true;
+    publish(&pub, 2);
+    CHECK(diff_calls == 4 && diff_count == 2);
+    CHECK((event = diff_find(WIFI_EVENT_SIGNAL, "alpha")) != NULL);
+    CHECK(event->old_signal == 50 + DIFF_THRESHOLD && event->signal == 50);
+    CHECK((event = diff_find(WIFI_EVENT_CONNECTION, "alpha")) != NULL);
+    CHECK(event->connected);
+
+    publish(&pub, 2);
+    CHECK(diff_calls == 4);
+
+    wifi_snapshot_pub_destroy(&pub);
+    printf("diff_events: ok\n");
+}
+
+static void test_index_lookup(void)
+{
+    wifi_snapshot_pub_t pub;
+    const wifi_scan_snapshot_t *snap;
+    const wifi_bss_t *bss;
+    uint8_t bssid[6] = { 0x02, 0, 0, 0, 0, 0 };
+    char ssid[64];
+    int n;
+
+    wifi_snapshot_pub_init(&pub);
+    /* Nothing to find in an empty scan */
+    publish(&pub, 0);
+    CHECK((snap = wifi_snapshot_acquire(&pub)) != NULL);
+    CHECK(wifi_scan_snapshot_find_network(snap, "net0") == NULL);
+    CHECK(wifi_scan_snapshot_find_network(snap, "") == NULL);
+    CHECK(wifi_scan_snapshot_find_bss(snap, bssid) == NULL);
+    wifi_snapshot_release(snap);
+
+    /* Two access points of net0, one record without a bssid */
+    for (n = 0; n < SCAN_NETWORKS; n++) {
+        snprintf(ssid, sizeof(ssid), "net%d", n == 1 ? 0 : n);
+        network_set(n, ssid, n + 1, 10 + n);
+    }
+    memset(networks[SCAN_NETWORKS - 1].bssid, 0, sizeof(networks[0].bssid));
+    publish(&pub, SCAN_NETWORKS);
+    CHECK((snap = wifi_snapshot_acquire(&pub)) != NULL);
+    CHECK(snap->ssid_count == SCAN_NETWORKS - 1);
+
+    CHECK((bss = wifi_scan_snapshot_find_network(snap, "net0")) != NULL);
+    CHECK(bss == &snap->bss[1] && snap->groups[bss->ssid_id].count == 2);
+    for (n = 2; n < SCAN_NETWORKS; n++) {
+        snprintf(ssid, sizeof(ssid), "net%d", n);
+        CHECK(wifi_scan_snapshot_find_network(snap, ssid) == &snap->bss[n]);
+        bssid[5] = n + 1;
+        if (n < SCAN_NETWORKS - 1)
+            CHECK(wifi_scan_snapshot_find_bss(snap, bssid) == &snap->bss[n]);
+        else
+            CHECK(wifi_scan_snapshot_find_bss(snap, bssid) == NULL);
+    }
+
+    CHECK(wifi_scan_snapshot_find_network(snap, "net") == NULL);
+    CHECK(wifi_scan_snapshot_find_network(snap, "net00") == NULL);
+    CHECK(wifi_scan_snapshot_find_network(snap, "missing") == NULL);
+    CHECK(wifi_scan_snapshot_find_network(snap, "") == NULL);
+    CHECK(wifi_scan_snapshot_find_network(snap, NULL) == NULL);
+    CHECK(wifi_scan_snapshot_find_network(NULL, "net0") == NULL);
+    bssid[0] = 0x03;
+    bssid[5] = 1;
+    CHECK(wifi_scan_snapshot_find_bss(snap, bssid) == NULL);
+    memset(bssid, 0, sizeof(bssid));
+    CHECK(wifi_scan_snapshot_find_bss(snap, bssid) == NULL);
+    CHECK(wifi_scan_snapshot_find_bss(snap, NULL) == NULL);
+    wifi_snapshot_release(snap);
+
+    wifi_snapshot_pub_destroy(&pub);
+    printf("index_lookup: ok\n");
+}
+
+static size_t arena_chunks(const wifi_arena_t *arena, size_t *total)
+{
+    const wifi_arena_chunk_t *chunk;
+    size_t count = 0;
+
+    *total = 0;
+    for (chunk = arena->chunks; chunk; chunk = chunk->next) {
+        count++;
+        *total += chunk->size;
+    }
+    return count;
+}
+
+/* One generation: ARENA_ALLOCS zeroed blocks, filled afterwards */
+static void arena_generation(wifi_arena_t *arena)
+{
+    size_t n, i, size = (ARENA_SIZE + WIFI_ARENA_ALIGN - 1) & ~(WIFI_ARENA_ALIGN - 1);
+    unsigned char *ptr;
+
+    for (n = 0; n < ARENA_ALLOCS; n++) {
+        CHECK((ptr = wifi_arena_alloc(arena, ARENA_SIZE)) != NULL);
+        CHECK((uintptr_t)ptr % WIFI_ARENA_ALIGN == 0);
+        for (i = 0; i < ARENA_SIZE; i++)
+            CHECK(ptr[i] == 0);
+        memset(ptr, 0xa5, ARENA_SIZE);
+        CHECK(arena->used == (n + 1) * size);
+    }
+}
+
+static void test_arena_reset(void)
+{
+    wifi_arena_t arena;
+    wifi_arena_chunk_t *chunk;
+    size_t total, grown;
+
+    wifi_arena_init(&arena);
+    wifi_arena_reset(&arena);
+    CHECK(arena.chunks == NULL && arena.used == 0);
+
+    arena_generation(&arena);
+    CHECK(arena_chunks(&arena, &total) == 3);
+    CHECK(total == 7 * WIFI_ARENA_CHUNK);
+
+    wifi_arena_reset(&arena);
+    CHECK(arena.used == 0);
+    CHECK(arena_chunks(&arena, &grown) == 1 && grown == total);
+    chunk = arena.chunks;
+    CHECK(chunk->used == 0);
+
+    /* Fits without growing, every round */
+    arena_generation(&arena);
+    CHECK(arena.chunks == chunk && chunk->next == NULL);
+    wifi_arena_reset(&arena);
+    CHECK(arena.chunks == chunk && chunk->used == 0 && arena.used == 0);
+    arena_generation(&arena);
+    CHECK(arena_chunks(&arena, &grown) == 1 && grown == total);
+
+    /* Larger than twice the chunk, gets a chunk of its own size */
+    CHECK(wifi_arena_alloc(&arena, 4 * total) != NULL);
+    CHECK(arena_chunks(&arena, &grown) == 2 && grown == total + 4 * total);
+
+    wifi_arena_destroy(&arena);
+    CHECK(arena.chunks == NULL && arena.used == 0);
+    printf("arena_reset: ok\n");
+}
+
+int main(void)
+{
+    test_publish_concurrent();
+    test_diff_events();
+    test_index_lookup();
+    test_arena_reset();
+    return 0;
+}
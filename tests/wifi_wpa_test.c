@@ -0,0 +1,307 @@
+/*
+ * wpa_supplicant backend tests against a stand-in control socket
+ *
+ *   connect_psk       passphrase is sent quoted, the block gets WPA-PSK
+ *   connect_reuse     a second connect selects the existing block, a raw
+ *                     64 hex digit PSK is sent unquoted
+ *   connect_invalid   bad passwords are refused before touching wpa_supplicant
+ *   connect_open      no password sets key_mgmt NONE on a block of its own
+ *   connect_failed    a block added by a failed connect is removed again
+ *
+ * The stand-in prints ssids escaped in STATUS and LIST_NETWORKS like
+ * wpa_supplicant does, the tests use ones with quotes and tabs.
+ *
+ * The backend is built into the test with its control directory moved, so
+ * its static helpers are reachable as well.
+ */
+#define WPA_CTRL_DIR            "/tmp/wifi_wpa_test"
+#include "../wifi/wifi_wpa.c"
+
+#include <stdatomic.h>
+
+#define STUB_PATH               WPA_CTRL_DIR "/wlan0"
+#define STUB_NETWORKS           8
+#define STUB_LOG                64
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                        \
+        }                                                                   \
+    } while (0)
+
+/* Just enough of wpa_supplicant: network blocks, STATUS and one monitor */
+typedef struct stub {
+    int fd;
+    pthread_t pthread;
+    atomic_int stop;
+    pthread_mutex_t lock;
+    struct {
+        bool used;
+        char ssid[64];
+        char key_mgmt[128];
+        char psk[128];
+    } networks[STUB_NETWORKS];
+    int current;                        /* selected block, -1 none   */
+    char fail_psk[64];                  /* ssid whose psk is refused */
+    char log[STUB_LOG][512];            /* commands, psk values kept */
+    int logged;
+    struct sockaddr_un monitor;
+    socklen_t monitor_len;
+} stub_t;
+
+static stub_t stub;
+
+static void stub_hex_ssid(const char *hex, char *ssid, size_t size)
+{
+    size_t i;
+    unsigned int byte;
+
+    for (i = 0; i + 1 < size && sscanf(hex + 2 * i, "%2x", &byte) == 1; i++)
+        ssid[i] = (char)byte;
+    ssid[i] = '\0';
+}
+
+/* Print ssid escaped like wpa_supplicant does, only what the tests use */
+static const char *stub_ssid_txt(const char *ssid)
+{
+    static char txt[64 * 4 + 1];
+    size_t len = 0;
+
+    for (; *ssid && len + 5 < sizeof(txt); ssid++) {
+        if (*ssid == '"' || *ssid == '\\')
+            txt[len++] = '\\';
+        if (*ssid == '\t')
+            len += snprintf(txt + len, sizeof(txt) - len, "\\t");
+        else
+            txt[len++] = *ssid;
+    }
+    txt[len] = '\0';
+
+    return txt;
+}
+
+/* Notice: Caller MUST hold the stub lock */
+static void stub_answer(const char *cmd, char *reply, size_t size, bool *connected)
+{
+    char name[32], value[128];
+    int id, n, len;
+
+    if (!strcmp(cmd, "PING")) {
+        snprintf(reply, size, "PONG\n");
+    } else if (!strcmp(cmd, "STATUS")) {
+        if (stub.current >= 0)
+            snprintf(reply, size, "wpa_state=COMPLETED\nssid=%s\n",
+                     stub_ssid_txt(stub.networks[stub.current].ssid));
+        else
+            snprintf(reply, size, "wpa_state=DISCONNECTED\n");
+    } else if (!strcmp(cmd, "SCAN_RESULTS")) {
+        snprintf(reply, size, "bssid / frequency / signal level / flags / ssid\n");
+    } else if (!strcmp(cmd, "LIST_NETWORKS")) {
+        len = snprintf(reply, size, "network id / ssid / bssid / flags\n");
+        for (n = 0; n < STUB_NETWORKS; n++) {
+            if (stub.networks[n].used)
+                len += snprintf(reply + len, size - len, "%d\t%s\tany\t%s\n", n,
+                                stub_ssid_txt(stub.networks[n].ssid),
+                                n == stub.current ? "[CURRENT]" : "");
+        }
+    } else if (!strcmp(cmd, "ADD_NETWORK")) {
+        for (n = 0; n < STUB_NETWORKS && stub.networks[n].used; n++)
+            ;
+        CHECK(n < STUB_NETWORKS);
+        memset(&stub.networks[n], 0, sizeof(stub.networks[n]));
+        stub.networks[n].used = true;
+        snprintf(reply, size, "%d\n", n);
+    } else if (sscanf(cmd, "SET_NETWORK %d %31s %n", &id, name, &n) == 2 &&
+               id >= 0 && id < STUB_NETWORKS && stub.networks[id].used) {
+        snprintf(value, sizeof(value), "%s", cmd + n);
+        snprintf(reply, size, "OK\n");
+        if (!strcmp(name, "ssid"))
+            stub_hex_ssid(value, stub.networks[id].ssid, sizeof(stub.networks[id].ssid));
+        else if (!strcmp(name, "key_mgmt"))
+            snprintf(stub.networks[id].key_mgmt, sizeof(stub.networks[id].key_mgmt), "%s", value);
+        else if (strcmp(stub.fail_psk, stub.networks[id].ssid))
+            snprintf(stub.networks[id].psk, sizeof(stub.networks[id].psk), "%s", value);
+        else
+            snprintf(reply, size, "FAIL\n");
+    } else if (sscanf(cmd, "SELECT_NETWORK %d", &id) == 1 && id >= 0 && id < STUB_NETWORKS) {
+        stub.current = id;
+        *connected = true;
+        snprintf(reply, size, "OK\n");
+    } else if (sscanf(cmd, "REMOVE_NETWORK %d", &id) == 1 && id >= 0 && id < STUB_NETWORKS) {
+        stub.networks[id].used = false;
+        snprintf(reply, size, "OK\n");
+    } else if (!strcmp(cmd, "DISCONNECT")) {
+        stub.current = -1;
+        snprintf(reply, size, "OK\n");
+    } else if (!strcmp(cmd, "ATTACH") || !strcmp(cmd, "DETACH") || !strcmp(cmd, "SCAN")) {
+        snprintf(reply, size, "OK\n");
+    } else {
+        snprintf(reply, size, "UNKNOWN COMMAND\n");
+    }
+}
+
+static void *stub_do(void *arg)
+{
+    char cmd[512], reply[4096];
+    struct sockaddr_un from;
+    struct pollfd pfd = { .fd = stub.fd, .events = POLLIN };
+    socklen_t from_len;
+    bool connected;
+    ssize_t n;
+
+    (void)arg;
+    while (!atomic_load(&stub.stop)) {
+        if (poll(&pfd, 1, 50) <= 0)
+            continue;
+        from_len = sizeof(from);
+        n = recvfrom(stub.fd, cmd, sizeof(cmd) - 1, 0, (struct sockaddr *)&from, &from_len);
+        if (n <= 0)
+            continue;
+        cmd[n] = '\0';
+
+        connected = false;
+        pthread_mutex_lock(&stub.lock);
+        if (stub.logged < STUB_LOG)
+            snprintf(stub.log[stub.logged++], sizeof(stub.log[0]), "%s", cmd);
+        if (!strcmp(cmd, "ATTACH")) {
+            stub.monitor = from;
+            stub.monitor_len = from_len;
+        }
+        stub_answer(cmd, reply, sizeof(reply), &connected);
+        pthread_mutex_unlock(&stub.lock);
+        sendto(stub.fd, reply, strlen(reply), 0, (struct sockaddr *)&from, from_len);
+        if (connected && stub.monitor_len)
+            sendto(stub.fd, "<3>CTRL-EVENT-CONNECTED", strlen("<3>CTRL-EVENT-CONNECTED"), 0,
+                   (struct sockaddr *)&stub.monitor, stub.monitor_len);
+    }
+
+    return NULL;
+}
+
+static void stub_start(void)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    memset(&stub, 0, sizeof(stub));
+    stub.current = -1;
+    pthread_mutex_init(&stub.lock, NULL);
+    mkdir(WPA_CTRL_DIR, 0700);
+    unlink(STUB_PATH);
+    strcpy(addr.sun_path, STUB_PATH);
+    stub.fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    CHECK(stub.fd >= 0);
+    CHECK(bind(stub.fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    CHECK(pthread_create(&stub.pthread, NULL, stub_do, NULL) == 0);
+}
+
+static void stub_stop(void)
+{
+    atomic_store(&stub.stop, 1);
+    pthread_join(stub.pthread, NULL);
+    close(stub.fd);
+    unlink(STUB_PATH);
+    rmdir(WPA_CTRL_DIR);
+    pthread_mutex_destroy(&stub.lock);
+}
+
+/* Times cmd was logged since mark, prefix match */
+static int stub_count(int mark, const char *cmd)
+{
+    int n, count = 0;
+
+    pthread_mutex_lock(&stub.lock);
+    for (n = mark; n < stub.logged; n++)
+        count += !strncmp(stub.log[n], cmd, strlen(cmd));
+    pthread_mutex_unlock(&stub.lock);
+
+    return count;
+}
+
+static int stub_mark(void)
+{
+    int mark;
+
+    pthread_mutex_lock(&stub.lock);
+    mark = stub.logged;
+    pthread_mutex_unlock(&stub.lock);
+
+    return mark;
+}
+
+static int stub_blocks(void)
+{
+    int n, count = 0;
+
+    pthread_mutex_lock(&stub.lock);
+    for (n = 0; n < STUB_NETWORKS; n++)
+        count += stub.networks[n].used;
+    pthread_mutex_unlock(&stub.lock);
+
+    return count;
+}
+
+static bool connect_ssid(wpa_t *wpa, const char *ssid, const char *password)
+{
+    wifi_network_info_t network;
+
+    memset(&network, 0, sizeof(network));
+    snprintf(network.ssid, sizeof(network.ssid), "%s", ssid);
+    return wpa_connect_ssid(wpa, &network, password);
+}
+
+int main(void)
+{
+    const char *hex = "00112233445566778899aabbccddeeff00112233445566778899aabbccddeeff";
+    char psk[80];
+    wpa_t *wpa;
+    int mark;
+
+    stub_start();
+    wpa = wpa_init();
+    CHECK(wpa != NULL);
+
+    mark = stub_mark();
+    CHECK(connect_ssid(wpa, "Home\"Net", "pa ss\"word"));
+    CHECK(stub_count(mark, "ADD_NETWORK") == 1);
+    CHECK(stub_blocks() == 1);
+    CHECK(!strcmp(stub.networks[0].key_mgmt, "WPA-PSK"));
+    CHECK(!strcmp(stub.networks[0].psk, "\"pa ss\"word\""));
+    printf("connect_psk: ok\n");
+
+    mark = stub_mark();
+    CHECK(connect_ssid(wpa, "Home\"Net", hex));
+    CHECK(stub_count(mark, "ADD_NETWORK") == 0);
+    CHECK(stub_count(mark, "SELECT_NETWORK 0") == 1);
+    CHECK(stub_blocks() == 1);
+    CHECK(!strcmp(stub.networks[0].psk, hex));
+    printf("connect_reuse: ok\n");
+
+    mark = stub_mark();
+    CHECK(!connect_ssid(wpa, "Lab", "short"));
+    memset(psk, 'a', 64);
+    psk[64] = '\0';
+    psk[10] = 'x';
+    CHECK(!connect_ssid(wpa, "Lab", psk));
+    CHECK(!connect_ssid(wpa, "Lab", "tab\tinside"));
+    CHECK(stub_mark() == mark);
+    printf("connect_invalid: ok\n");
+
+    CHECK(connect_ssid(wpa, "Cafe\tGuest", ""));
+    CHECK(stub_blocks() == 2);
+    CHECK(!strcmp(stub.networks[1].key_mgmt, "NONE"));
+    CHECK(stub.networks[1].psk[0] == '\0');
+    printf("connect_open: ok\n");
+
+    mark = stub_mark();
+    snprintf(stub.fail_psk, sizeof(stub.fail_psk), "Lab");
+    CHECK(!connect_ssid(wpa, "Lab", "password"));
+    CHECK(stub_count(mark, "REMOVE_NETWORK 2") == 1);
+    CHECK(stub_blocks() == 2);
+    printf("connect_failed: ok\n");
+
+    wpa_free(wpa);
+    stub_stop();
+    return 0;
+}
@@ -1,21 +1,37 @@
 #if defined(__APPLE__)
 #include <AvailabilityMacros.h>
+#elif defined(__linux__)
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE         /* cpu_set_t, pthread_attr_setaffinity_np(), getcpu() */
+#endif
 #else
 #ifndef _POSIX_C_SOURCE
 #define _POSIX_C_SOURCE 200809L
 #endif
 #endif
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
-#include <signal.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <poll.h>
 #if defined(__linux__)
+#include <ucontext.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #endif
 
+#include "list.h"
 #include "thpool.h"
 
 #ifdef THPOOL_DEBUG
@@ -30,73 +46,468 @@
 #define err(str)
 #endif
 
-static volatile int threads_keepalive;
-static volatile int threads_on_hold;
+/* Thread the caller runs on, NULL for threads outside any pool */
+static __thread struct thread *thread_self;
+static __thread struct task_coro *coro_self;   /* coroutine being resumed */
+
+#define DEQUE_INIT_CAP   64 /* initial slots of a worker deque (power of 2) */
+#define STEAL_SPIN_ROUNDS 4 /* steal attempts before an idle worker sleeps  */
+#define RING_DEFAULT_CAP 1024 /* default capacity of the MPMC ring         */
+#define CACHELINE        64
+#define SLAB_CHUNK_TASKS 256  /* tasks carved out of one slab chunk        */
+#define SLAB_DEFAULT_MAX 4096 /* default slab capacity before malloc       */
+#define TASK_CACHE_BATCH 32   /* tasks moved between thread cache and slab */
+#define PRIO_STARVE_INTERVAL 8 /* every Nth pull scans lanes lowest first  */
+#define WHEEL_BITS       6    /* slots per timer wheel level, as a shift   */
+#define WHEEL_SIZE       (1 << WHEEL_BITS)
+#define WHEEL_MASK       (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS     4    /* 1ms ticks, 64^4 ms (~4.6h) range          */
+#define GROW_DEFAULT_WAIT_MS    50   /* queue wait before an elastic pool grows  */
+#define IDLE_DEFAULT_TIMEOUT_MS 5000 /* idle time before an extra worker retires */
+#define TASK_F_GROUPED   (1u << 31) /* counted as pending in task->group */
+#define DEDUP_BITS       6    /* hash buckets of keyed in-flight tasks     */
+#define DEDUP_BUCKETS    (1 << DEDUP_BITS)
+#define CORO_DEFAULT_STACK (256 * 1024) /* coroutine stack, plus a guard page */
+#define REACTOR_EVENTS   64   /* epoll events handled per wakeup           */
+#define HIST_SUB_BITS    3    /* linear sub-buckets per power of 2, 2^N    */
+#define HIST_SUB         (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS     ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
 
 /* ========================== STRUCTURES ============================ */
 
-/* Binary semaphore */
-typedef struct bsem {
+/* Work-stealing deque
+ *
+ * The owning worker pushes and pops at the bottom (LIFO), thieves steal from
+ * the top (FIFO). Submissions from threads outside the pool are appended at
+ * the top so that the owner still serves them oldest first.
+ */
+typedef struct deque {
+    pthread_mutex_t mutex;   /* short critical sections only */
+    task_t **buf;            /* ring buffer of tasks         */
+    unsigned int cap;        /* capacity, power of 2         */
+    unsigned int top;        /* index of oldest task         */
+    unsigned int len;        /* tasks in deque, peeked racily */
+} deque_t;
+
+/* Bounded lock-free MPMC ring
+ *
+ * Each cell carries a sequence number telling producers and consumers whose
+ * turn it is, so both sides only CAS their own position counter.
+ */
+typedef struct ring_cell {
+    atomic_size_t seq;
+    task_t *task;
+} ring_cell_t;
+
+typedef struct ring {
+    ring_cell_t *cells;
+    size_t mask;                                    /* capacity - 1 */
+    _Alignas(CACHELINE) atomic_size_t enqueue_pos;
+    _Alignas(CACHELINE) atomic_size_t dequeue_pos;
+} ring_t;
+
+/* Task queue
+ *
+ * Front end shared by all workers: tasks live in the per-worker deques or in
+ * the shared ring, this keeps the counters and the sleep/wakeup state of idle
+ * workers.
+ */
+struct task_queue {
+    struct thpool_ *thpool_p;   /* owning pool                     */
+    thpool_queue_type_t type;   /* where tasks are stored          */
+    ring_t ring[TASK_PRIO_MAX]; /* THPOOL_QUEUE_RING only, per lane */
+    atomic_int len[TASK_PRIO_MAX]; /* number of tasks per lane     */
+    atomic_uint next;           /* round-robin cursor for pushes   */
+    atomic_int background_running; /* workers on background tasks  */
+    int background_max;         /* limit for them, 0 is unlimited  */
+    atomic_int num_sleeping;    /* workers blocked on has_tasks    */
+    pthread_mutex_t sleep_lock; /* protects has_tasks waits        */
+    pthread_cond_t has_tasks;   /* signalled when tasks arrive     */
+};
+
+/* Task slab
+ *
+ * Tasks are carved out of chunks that live as long as the pool. Free tasks
+ * are linked through their prev pointer. Workers keep a private cache in
+ * front of the shared free list so that the free after each task, and the
+ * allocations of tasks they submit, only take the slab lock once per batch.
+ */
+typedef struct slab_chunk {
+    struct slab_chunk *next;
+    task_t tasks[SLAB_CHUNK_TASKS];
+} slab_chunk_t;
+
+typedef struct task_slab {
+    pthread_mutex_t mutex;      /* protects everything but the counters */
+    task_t *free_list;          /* free slab tasks                      */
+    slab_chunk_t *chunks;       /* all chunks, freed on destroy         */
+    size_t num_chunks;
+    size_t max_chunks;
+    atomic_ulong hits;          /* tasks served by the slab             */
+    atomic_ulong fallbacks;     /* tasks malloc'ed, slab exhausted      */
+} task_slab_t;
+
+/* Timer
+ *
+ * A timer is referenced by the wheel while pending and by the caller until
+ * thpool_timer_cancel() or thpool_timer_release(). One-shot timers queue
+ * their task when they fire, periodic ones queue a copy of it.
+ */
+enum timer_state {
+    TIMER_PENDING,
+    TIMER_FIRED,
+    TIMER_CANCELLED,
+};
+
+struct thpool_timer {
+    struct list_head list;      /* slot of the wheel            */
+    uint64_t expires;           /* tick to fire at              */
+    unsigned int period;        /* ms between fires, 0 one-shot */
+    task_t *task;               /* task to queue or to copy     */
+    enum timer_state state;
+    int refs;                   /* protected by the wheel mutex */
+    struct timer_wheel *wheel;
+};
+
+/* Hierarchical timer wheel
+ *
+ * Level 0 has one slot per 1ms tick, each higher level one slot per full
+ * turn of the level below. Slots of a higher level are cascaded down when
+ * the level below wraps, so timers are only touched a handful of times.
+ * The wheel thread sleeps until the next non-empty level 0 slot or the next
+ * cascade, and does not run at all until the first timer is scheduled.
+ */
+typedef struct timer_wheel {
+    struct thpool_ *thpool_p;
     pthread_mutex_t mutex;
-    pthread_cond_t cond;
-    int v;
-} bsem;
+    pthread_cond_t cond;        /* CLOCK_MONOTONIC based        */
+    pthread_t pthread;
+    int started;                /* thread running               */
+    int keepalive;
+    uint64_t now;               /* last tick processed          */
+    struct timespec epoch;      /* time of tick 0               */
+    int count;                  /* pending timers               */
+    struct list_head slots[WHEEL_LEVELS][WHEEL_SIZE];
+    void (*monitor)(struct thpool_ *thpool_p); /* run periodically  */
+    unsigned int monitor_period;               /* in ticks          */
+    uint64_t monitor_next;
+} timer_wheel_t;
+
+/* Completion of a submitted task
+ *
+ * Shared by the submitter and the task, freed with the last reference.
+ * Threads in task_wait_any() hang a waiter on every future they wait for.
+ */
+struct task_future {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;        /* CLOCK_MONOTONIC based        */
+    task_status_t status;
+    atomic_int refs;
+    atomic_int run_state;       /* FUTURE_*, claimed by a worker */
+    struct list_head waiters;   /* future_link_t                */
+    unsigned long long key;     /* dedup key, 0 for none        */
+    int submitters;             /* attached, not cancelled, by
+                                   the dedup mutex if keyed     */
+    const task_group_t *group;  /* of the keyed task, compared only */
+    struct thpool_ *dedup_p;    /* pool whose table holds it    */
+    struct list_head dedup;     /* on dedup_table_t bucket      */
+};
 
-/* Task queue */
-struct task_queue {
-    pthread_mutex_t rwmutex; /* used for queue r/w access */
-    task_t *front;           /* pointer to front of queue */
-    task_t *rear;            /* pointer to rear  of queue */
-    bsem *has_tasks;         /* flag as binary semaphore  */
-    int len;                 /* number of tasks in queue   */
+enum future_run_state {
+    FUTURE_QUEUED,
+    FUTURE_RUNNING,             /* a worker took the task       */
+    FUTURE_CANCELLED,           /* task_cancel() won the race   */
+};
+
+/* Futures of keyed tasks that are queued or running */
+typedef struct dedup_table {
+    pthread_mutex_t mutex;
+    struct list_head buckets[DEDUP_BUCKETS];
+} dedup_table_t;
+
+/* Tasks submitted together, waited for together
+ *
+ * Only the task that drains the group touches the mutex.
+ */
+struct task_group {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;        /* CLOCK_MONOTONIC based        */
+    atomic_long pending;        /* queued, running or deferred  */
+    atomic_ulong submitted;
+    atomic_ulong completed;     /* ran their handler            */
+    atomic_ulong cancelled;     /* dropped or cancelled         */
 };
 
+typedef struct future_waiter {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int signalled;
+} future_waiter_t;
+
+typedef struct future_link {
+    struct list_head list;      /* on task_future.waiters       */
+    future_waiter_t *waiter;
+} future_link_t;
+
+/* Log-linear latency histogram in ns, HDR style
+ *
+ * Values below HIST_SUB get a bucket each, every power of 2 above is split
+ * into HIST_SUB linear buckets, so a bucket is at most 1/HIST_SUB wide
+ * relative to its value.
+ */
+typedef struct histogram {
+    unsigned long counts[HIST_BUCKETS];
+    uint64_t max;
+} histogram_t;
+
+/* Counters of one worker
+ *
+ * Only the owning worker writes them, with relaxed atomic stores, so
+ * updates take no lock and snapshots read them racily.
+ */
+typedef struct thread_stats {
+    unsigned long tasks;
+    uint64_t busy_ns;         /* running tasks             */
+    uint64_t idle_ns;         /* looking for or awaiting one */
+    uint64_t idle_since;      /* 0 while running a task    */
+    histogram_t wait;         /* queued until started      */
+    histogram_t run;          /* started until done        */
+} thread_stats_t;
+
 /* Thread */
 typedef struct thread {
     int id;                   /* friendly id               */
     pthread_t pthread;        /* pointer to actual thread  */
     struct thpool_ *thpool_p; /* access to thpool          */
+    deque_t deque[TASK_PRIO_MAX]; /* tasks owned, per lane */
+    task_t *cache;            /* free slab tasks, private  */
+    int cache_len;
+    unsigned int pulls;       /* tasks taken, read racily  */
+    int state;                /* THREAD_*, set by thcount_lock */
+    int cpu;                  /* last cpu seen, read racily */
+    int node;                 /* NUMA node of that cpu     */
+    unsigned long migrations; /* cpu changes between tasks */
+    thread_stats_t *stats;    /* NULL unless collect_stats */
 } thread_t;
 
-/* Threadpool */
+enum thread_state {
+    THREAD_FREE,              /* no pthread in the slot    */
+    THREAD_RUNNING,
+    THREAD_EXITED,            /* retired, must be joined   */
+};
+
+/* Tasks whose callbacks run on the thread that drains the queue
+ *
+ * Workers append TASK_F_DEFERRED tasks once their handler has returned and
+ * bump the eventfd, which becomes readable for poll/epoll loops.
+ */
+typedef struct completion_queue {
+    pthread_mutex_t mutex;
+    task_t *head;               /* oldest, linked through prev  */
+    task_t *tail;
+    atomic_int fd;              /* eventfd, -1 until requested  */
+} completion_queue_t;
+
+#if defined(__linux__)
+/* Stack and context of a TASK_F_COROUTINE task
+ *
+ * A coroutine that awaits an fd switches back to the worker that resumed
+ * it. The worker then parks it in the reactor, which queues the task again
+ * once the fd is ready, so any worker may resume it.
+ */
+typedef struct task_coro {
+    ucontext_t ctx;             /* coroutine side               */
+    ucontext_t caller;          /* worker that resumed it       */
+    void *stack;                /* mmap'ed, guard page first    */
+    size_t stack_size;
+    task_t *task;
+    int done;                   /* handler returned             */
+    int wait_fd;                /* fd awaited                   */
+    int reg_fd;                 /* in epoll, a dup if needed    */
+    unsigned int events;        /* POLL* awaited                */
+    int revents;                /* POLL* ready, -1 on error     */
+    struct list_head list;      /* on reactor.parked            */
+} task_coro_t;
+#endif
+
+/* Waits on fds for parked coroutines, started with the first await */
+typedef struct reactor {
+    struct thpool_ *thpool_p;
+    pthread_mutex_t mutex;
+    pthread_t pthread;
+    int started;
+    atomic_int keepalive;
+    int epfd;
+    int wakefd;                 /* eventfd, stops the thread    */
+    size_t stack_size;          /* of new coroutines            */
+    struct list_head parked;    /* task_coro_t                  */
+} reactor_t;
+
+/* Threadpool
+ *
+ * An elastic pool allocates slots for max_threads workers up front and
+ * starts or retires pthreads in them. Tasks from outside the pool only go
+ * to running slots, the few that race with a retiring worker stay in its
+ * deque, which the other workers steal from.
+ */
 struct thpool_ {
     thread_t **threads;               /* pointer to threads        */
-    volatile int num_threads_alive;   /* threads currently alive   */
-    volatile int num_threads_working; /* threads currently working */
+    int num_slots;                    /* deques, at least one      */
+    atomic_int slots_used;            /* up to the last running    */
+    atomic_int keepalive;             /* workers keep serving      */
+    atomic_int paused;                /* set by thpool_pause()     */
+    int num_threads_alive;            /* threads currently alive   */
+    int num_threads_started;          /* slots running, by lock    */
+    int min_threads;                  /* elastic bounds, equal for */
+    int max_threads;                  /* a fixed pool              */
+    uint64_t grow_wait_ns;            /* queue wait to grow        */
+    unsigned int idle_timeout_ms;     /* idle time to retire       */
+    unsigned long num_grown;          /* resize stats, by lock     */
+    unsigned long num_shrunk;
+    int peak_threads;
+    thpool_cpuset_t *cpusets;         /* worker placement, copied  */
+    int num_cpusets;                  /* from the options          */
+    size_t stack_size;
+    int sched_policy;
+    int sched_priority;
+    int collect_stats;                /* stamp and time every task */
+    uint64_t stall_since;             /* monitor state, wheel only */
+    unsigned long stall_pulls;
+    atomic_int num_threads_working;   /* threads currently working */
+    atomic_int num_tasks_pending;     /* queued plus running tasks */
     pthread_mutex_t thcount_lock;     /* used for thread count etc */
     pthread_cond_t threads_all_idle;  /* signal to thpool_wait     */
+    pthread_cond_t threads_alive;     /* signal to thpool_init     */
     task_queue_t task_queue;          /* task queue                 */
+    task_slab_t slab;                 /* task allocator             */
+    timer_wheel_t wheel;              /* delayed and periodic tasks */
+    completion_queue_t completion;    /* deferred callbacks         */
+    reactor_t reactor;                /* fds awaited by coroutines  */
+    dedup_table_t dedup;              /* keyed in-flight tasks      */
 };
 
 /* ========================== PROTOTYPES ============================ */
 
 static int thread_init(thpool_t *thpool_p, struct thread **thread_p, int id);
+static int thread_start(struct thread *thread_p);
+static int thread_retire(struct thread *thread_p);
+static void thread_placement(struct thread *thread_p);
+static void thread_stats_task(thread_stats_t *stats, uint64_t enqueued,
+                              uint64_t start, uint64_t end);
+static void stats_fill(thpool_stats_t *out, const thread_stats_t *stats, uint64_t now);
+static int thpool_grow(thpool_t *thpool_p);
+static void thpool_monitor(thpool_t *thpool_p);
+static uint64_t now_ns(void);
+static void deadline_init(struct timespec *ts, int timeout_ms);
 static void *thread_do(struct thread *thread_p);
-static void thread_hold(int sig_id);
 static void thread_destroy(struct thread *thread_p);
+static task_t *thread_steal(struct thread *thread_p, int lane);
 
-static int task_queue_init(task_queue_t *task_queue_p);
+static int task_queue_init(thpool_t *thpool_p, task_queue_t *task_queue_p,
+                           const thpool_options_t *opts);
 static void task_queue_clear(task_queue_t *task_queue_p);
-static struct task *task_queue_pull(task_queue_t *task_queue_p);
+static struct task *task_queue_pull(struct thread *thread_p, int *retire);
+static void task_queue_done(task_queue_t *task_queue_p, int lane);
+static int task_queue_has_work(task_queue_t *task_queue_p);
+static void task_queue_wakeup(task_queue_t *task_queue_p, int count);
+static int task_queue_requeue(task_queue_t *task_queue_p, task_t *task_p);
 static void task_queue_destroy(task_queue_t *task_queue_p);
 
-static void bsem_init(struct bsem *bsem_p, int value);
-static void bsem_reset(struct bsem *bsem_p);
-static void bsem_post(struct bsem *bsem_p);
-static void bsem_post_all(struct bsem *bsem_p);
-static void bsem_wait(struct bsem *bsem_p);
+static int deque_init(deque_t *deque_p);
+static int deque_push_bottom(deque_t *deque_p, task_t *task_p);
+static int deque_push_top(deque_t *deque_p, task_t *task_p);
+static task_t *deque_pop_bottom(deque_t *deque_p);
+static task_t *deque_steal_top(deque_t *deque_p);
+static void deque_destroy(deque_t *deque_p);
+
+static void slab_init(task_slab_t *slab_p, size_t max_tasks);
+static task_t *slab_alloc(thpool_t *thpool_p);
+static void slab_free(thpool_t *thpool_p, task_t *task_p);
+static void slab_destroy(task_slab_t *slab_p);
+static void task_release(task_t *task_p);
+static void task_drop(task_t *task_p);
+static void task_finish(task_t *task_p, int embedded, task_handler_t result_cb,
+                        task_handler_t cleanup_cb, task_future_t *future,
+                        task_group_t *group);
+static int task_group_enter(task_t *task_p);
+static void task_group_leave(task_group_t *group, int cancelled);
+
+static void future_complete(task_future_t *future, task_status_t status);
+static void future_put(task_future_t *future);
+static int future_claim(task_future_t *future);
+static void dedup_init(dedup_table_t *dedup_p);
+static void dedup_destroy(dedup_table_t *dedup_p);
+static void task_discard(task_t *task_p, int embedded, task_handler_t cleanup_cb,
+                         task_future_t *future, task_group_t *group);
+
+static void reactor_init(thpool_t *thpool_p, reactor_t *reactor_p, size_t stack_size);
+static int coro_resume(thpool_t *thpool_p, task_t *task_p);
+static void coro_free(task_t *task_p);
+static void reactor_destroy(reactor_t *reactor_p);
+
+static void completion_init(completion_queue_t *completion_p);
+static int completion_push(completion_queue_t *completion_p, task_t *task_p);
+static void completion_destroy(thpool_t *thpool_p);
+
+static void wheel_init(thpool_t *thpool_p, timer_wheel_t *wheel_p);
+static int wheel_start(timer_wheel_t *wheel_p);
+static int wheel_set_monitor(timer_wheel_t *wheel_p, void (*monitor)(thpool_t *),
+                             unsigned int period);
+static void wheel_destroy(timer_wheel_t *wheel_p);
+
+static int ring_init(ring_t *ring_p, size_t capacity);
+static int ring_push(ring_t *ring_p, task_t *task_p);
+static task_t *ring_pop(ring_t *ring_p);
+static void ring_destroy(ring_t *ring_p);
 
 /* ========================== THREADPOOL ============================ */
 
+/* Fill options with the defaults used by thpool_init() */
+void thpool_options_init(thpool_options_t *opts)
+{
+    opts->num_threads = 0;
+    opts->queue_type = THPOOL_QUEUE_DEQUE;
+    opts->queue_capacity = RING_DEFAULT_CAP;
+    opts->task_slab_max = SLAB_DEFAULT_MAX;
+    opts->background_max_threads = 0;
+    opts->max_threads = 0;
+    opts->grow_wait_ms = GROW_DEFAULT_WAIT_MS;
+    opts->idle_timeout_ms = IDLE_DEFAULT_TIMEOUT_MS;
+    opts->cpusets = NULL;
+    opts->num_cpusets = 0;
+    opts->stack_size = 0;
+    opts->sched_policy = THPOOL_SCHED_INHERIT;
+    opts->sched_priority = 0;
+    opts->collect_stats = 0;
+    opts->coroutine_stack_size = CORO_DEFAULT_STACK;
+}
+
 /* Initialise thread pool */
 struct thpool_ *thpool_init(int num_threads) {
+    thpool_options_t opts;
+
+    thpool_options_init(&opts);
+    opts.num_threads = num_threads;
+
+    return thpool_init_opts(&opts);
+}
+
+/* Initialise thread pool with options */
+struct thpool_ *thpool_init_opts(const thpool_options_t *opts) {
 
-    threads_on_hold = 0;
-    threads_keepalive = 1;
+    int num_threads = opts->num_threads;
 
     if (num_threads < 0) {
         num_threads = 0;
     }
+    int max_threads = opts->max_threads;
+    if (max_threads > num_threads) {
+        /* An elastic pool always keeps one worker to run what it queued */
+        if (num_threads == 0)
+            num_threads = 1;
+    } else {
+        max_threads = num_threads;
+    }
 
     /* Make new thread pool */
     thpool_t *thpool_p;
@@ -105,48 +516,129 @@ struct thpool_ *thpool_init(int num_threads) {
         err("thpool_init(): Could not allocate memory for thread pool\n");
         return NULL;
     }
+    atomic_init(&thpool_p->keepalive, 1);
+    atomic_init(&thpool_p->paused, 0);
     thpool_p->num_threads_alive = 0;
-    thpool_p->num_threads_working = 0;
+    thpool_p->num_threads_started = 0;
+    thpool_p->min_threads = num_threads;
+    thpool_p->max_threads = max_threads;
+    thpool_p->grow_wait_ns = (uint64_t)opts->grow_wait_ms * 1000000;
+    thpool_p->idle_timeout_ms = opts->idle_timeout_ms > 0 ? opts->idle_timeout_ms : 1;
+    thpool_p->num_grown = 0;
+    thpool_p->num_shrunk = 0;
+    thpool_p->peak_threads = num_threads;
+    thpool_p->stall_since = 0;
+    thpool_p->stall_pulls = 0;
+    thpool_p->cpusets = NULL;
+    thpool_p->num_cpusets = 0;
+    thpool_p->stack_size = opts->stack_size;
+    thpool_p->sched_policy = opts->sched_policy;
+    thpool_p->sched_priority = opts->sched_priority;
+    thpool_p->collect_stats = opts->collect_stats;
+    if (opts->cpusets != NULL && opts->num_cpusets > 0) {
+        thpool_p->cpusets = (thpool_cpuset_t *)malloc(opts->num_cpusets * sizeof(thpool_cpuset_t));
+        if (thpool_p->cpusets == NULL) {
+            err("thpool_init(): Could not allocate memory for cpu sets\n");
+            goto fail_cpusets;
+        }
+        memcpy(thpool_p->cpusets, opts->cpusets, opts->num_cpusets * sizeof(thpool_cpuset_t));
+        thpool_p->num_cpusets = opts->num_cpusets;
+    }
+    atomic_init(&thpool_p->slots_used, num_threads > 0 ? num_threads : 1);
+    atomic_init(&thpool_p->num_threads_working, 0);
+    atomic_init(&thpool_p->num_tasks_pending, 0);
+    slab_init(&thpool_p->slab, opts->task_slab_max);
+    wheel_init(thpool_p, &thpool_p->wheel);
+    completion_init(&thpool_p->completion);
+    reactor_init(thpool_p, &thpool_p->reactor, opts->coroutine_stack_size);
+    dedup_init(&thpool_p->dedup);
 
     /* Initialise the task queue */
-    if (task_queue_init(&thpool_p->task_queue) == -1) {
+    if (task_queue_init(thpool_p, &thpool_p->task_queue, opts) == -1) {
         err("thpool_init(): Could not allocate memory for task queue\n");
-        free(thpool_p);
-        return NULL;
+        goto fail_queue;
     }
 
-    /* Make threads in pool */
-    thpool_p->threads = (struct thread **)malloc(num_threads * sizeof(struct thread *));
+    /* Make threads in pool, a pool without threads still owns one deque */
+    thpool_p->num_slots = max_threads > 0 ? max_threads : 1;
+    thpool_p->threads = (struct thread **)calloc(thpool_p->num_slots, sizeof(struct thread *));
     if (thpool_p->threads == NULL) {
         err("thpool_init(): Could not allocate memory for threads\n");
-        task_queue_destroy(&thpool_p->task_queue);
-        free(thpool_p);
-        return NULL;
+        goto fail_threads;
     }
 
     pthread_mutex_init(&(thpool_p->thcount_lock), NULL);
     pthread_cond_init(&thpool_p->threads_all_idle, NULL);
+    pthread_cond_init(&thpool_p->threads_alive, NULL);
 
-    /* Thread init */
+    /* Thread init, every deque must exist before any worker starts stealing */
     int n;
+    for (n = 0; n < thpool_p->num_slots; n++) {
+        if (thread_init(thpool_p, &thpool_p->threads[n], n) == -1) {
+            while (--n >= 0)
+                thread_destroy(thpool_p->threads[n]);
+            goto fail_thread;
+        }
+    }
     for (n = 0; n < num_threads; n++) {
-        thread_init(thpool_p, &thpool_p->threads[n], n);
+        if (thread_start(thpool_p->threads[n]) == 0) {
+            /* Workers already started may look at the count to retire */
+            pthread_mutex_lock(&thpool_p->thcount_lock);
+            __atomic_store_n(&thpool_p->threads[n]->state, THREAD_RUNNING, __ATOMIC_RELEASE);
+            thpool_p->num_threads_started++;
+            pthread_mutex_unlock(&thpool_p->thcount_lock);
+        }
 #if THPOOL_DEBUG
         printf("THPOOL_DEBUG: Created thread %d in pool \n", n);
 #endif
     }
 
     /* Wait for threads to initialize */
-    while (thpool_p->num_threads_alive != num_threads) {
+    pthread_mutex_lock(&thpool_p->thcount_lock);
+    while (thpool_p->num_threads_alive != thpool_p->num_threads_started) {
+        pthread_cond_wait(&thpool_p->threads_alive, &thpool_p->thcount_lock);
+    }
+    pthread_mutex_unlock(&thpool_p->thcount_lock);
+
+    /* A placement that cannot be honoured fails the pool, not just a worker */
+    if (thpool_p->num_threads_started < num_threads) {
+        err("thpool_init(): Could not start all threads\n");
+        thpool_destroy(thpool_p);
+        return NULL;
+    }
+
+    /* Let the timer thread watch the queue of an elastic pool */
+    if (max_threads > num_threads) {
+        unsigned int period = opts->grow_wait_ms / 4;
+        wheel_set_monitor(&thpool_p->wheel, thpool_monitor, period > 0 ? period : 1);
     }
 
     return thpool_p;
+
+    /* Nothing was started yet, undo the initialisation in reverse order */
+fail_thread:
+    pthread_cond_destroy(&thpool_p->threads_alive);
+    pthread_cond_destroy(&thpool_p->threads_all_idle);
+    pthread_mutex_destroy(&thpool_p->thcount_lock);
+    free(thpool_p->threads);
+fail_threads:
+    task_queue_destroy(&thpool_p->task_queue);
+fail_queue:
+    dedup_destroy(&thpool_p->dedup);
+    reactor_destroy(&thpool_p->reactor);
+    completion_destroy(thpool_p);
+    wheel_destroy(&thpool_p->wheel);
+    slab_destroy(&thpool_p->slab);
+    free(thpool_p->cpusets);
+fail_cpusets:
+    free(thpool_p);
+    return NULL;
 }
 
 /* Wait until all tasks have finished */
 void thpool_wait(thpool_t *thpool_p) {
     pthread_mutex_lock(&thpool_p->thcount_lock);
-    while (thpool_p->task_queue.len || thpool_p->num_threads_working) {
+    while (atomic_load(&thpool_p->num_tasks_pending)) {
         pthread_cond_wait(&thpool_p->threads_all_idle, &thpool_p->thcount_lock);
     }
     pthread_mutex_unlock(&thpool_p->thcount_lock);
@@ -158,62 +650,244 @@ void thpool_destroy(thpool_t *thpool_p) {
     if (thpool_p == NULL)
         return;
 
-    volatile int threads_total = thpool_p->num_threads_alive;
+    /* No more timer fires from here on */
+    wheel_destroy(&thpool_p->wheel);
 
-    /* End each thread 's infinite loop */
-    threads_keepalive = 0;
+    /* End each thread 's infinite loop, sleeping ones re-check it under sleep_lock.
+     * Taking thcount_lock makes sure no worker is being started meanwhile. */
+    pthread_mutex_lock(&thpool_p->thcount_lock);
+    atomic_store(&thpool_p->keepalive, 0);
+    pthread_mutex_unlock(&thpool_p->thcount_lock);
+    task_queue_wakeup(&thpool_p->task_queue, -1);
 
-    /* Give one second to kill idle threads */
-    double TIMEOUT = 1.0;
-    time_t start, end;
-    double tpassed = 0.0;
-    time(&start);
-    while (tpassed < TIMEOUT && thpool_p->num_threads_alive) {
-        bsem_post_all(thpool_p->task_queue.has_tasks);
-        time(&end);
-        tpassed = difftime(end, start);
+    /* Join running and retired threads, no slot changes state anymore */
+    int n;
+    for (n = 0; n < thpool_p->num_slots; n++) {
+        if (thpool_p->threads[n]->state != THREAD_FREE)
+            pthread_join(thpool_p->threads[n]->pthread, NULL);
     }
 
-    /* Poll remaining threads */
-    while (thpool_p->num_threads_alive) {
-        bsem_post_all(thpool_p->task_queue.has_tasks);
-        sleep(1);
-    }
+    /* Parked coroutines are dropped, so are the ones queued again */
+    reactor_destroy(&thpool_p->reactor);
 
     /* Task queue cleanup */
+    task_queue_clear(&thpool_p->task_queue);
     task_queue_destroy(&thpool_p->task_queue);
+    completion_destroy(thpool_p);
     /* Deallocs */
-    int n;
-    for (n = 0; n < threads_total; n++) {
+    for (n = 0; n < thpool_p->num_slots; n++) {
         thread_destroy(thpool_p->threads[n]);
     }
     free(thpool_p->threads);
+    slab_destroy(&thpool_p->slab);
+    dedup_destroy(&thpool_p->dedup);
+    pthread_mutex_destroy(&thpool_p->thcount_lock);
+    pthread_cond_destroy(&thpool_p->threads_all_idle);
+    pthread_cond_destroy(&thpool_p->threads_alive);
+    free(thpool_p->cpusets);
     free(thpool_p);
 }
 
-/* Pause all threads in threadpool */
+/* Pause all threads in threadpool
+ *
+ * Takes effect at task boundaries: running tasks complete, then workers
+ * sleep as if the queue was empty until thpool_resume(). Other pools are
+ * not affected.
+ */
 void thpool_pause(thpool_t *thpool_p) 
 {
-    int n;
-    for (n = 0; n < thpool_p->num_threads_alive; n++) {
-        pthread_kill(thpool_p->threads[n]->pthread, SIGUSR1);
-    }
+    atomic_store(&thpool_p->paused, 1);
 }
 
 /* Resume all threads in threadpool */
 void thpool_resume(thpool_t *thpool_p) 
 {
-    // resuming a single threadpool hasn't been
-    // implemented yet, meanwhile this suppresses
-    // the warnings
-    (void)thpool_p;
+    atomic_store(&thpool_p->paused, 0);
+    task_queue_wakeup(&thpool_p->task_queue, -1);
+}
+
+/* Read the task allocator counters */
+void thpool_task_stats(thpool_t *thpool_p, thpool_task_stats_t *stats)
+{
+    stats->slab_hits = atomic_load(&thpool_p->slab.hits);
+    stats->fallback_allocs = atomic_load(&thpool_p->slab.fallbacks);
+    pthread_mutex_lock(&thpool_p->slab.mutex);
+    stats->slab_capacity = thpool_p->slab.num_chunks * SLAB_CHUNK_TASKS;
+    pthread_mutex_unlock(&thpool_p->slab.mutex);
+}
+
+/* Read how the pool was resized so far */
+void thpool_resize_stats(thpool_t *thpool_p, thpool_resize_stats_t *stats)
+{
+    pthread_mutex_lock(&thpool_p->thcount_lock);
+    stats->num_threads = thpool_p->num_threads_started;
+    stats->min_threads = thpool_p->min_threads;
+    stats->max_threads = thpool_p->max_threads;
+    stats->peak_threads = thpool_p->peak_threads;
+    stats->grown = thpool_p->num_grown;
+    stats->shrunk = thpool_p->num_shrunk;
+    pthread_mutex_unlock(&thpool_p->thcount_lock);
+}
+
+/* Report where each worker slot runs
+ *
+ * @param info          filled for up to max slots
+ * @return number of entries filled
+ */
+int thpool_worker_placement(thpool_t *thpool_p, thpool_worker_info_t *info, int max)
+{
+    int n;
+
+    pthread_mutex_lock(&thpool_p->thcount_lock);
+    for (n = 0; n < thpool_p->num_slots && n < max; n++) {
+        thread_t *thread_p = thpool_p->threads[n];
+        info[n].id = thread_p->id;
+        info[n].running = thread_p->state == THREAD_RUNNING;
+        info[n].cpu = __atomic_load_n(&thread_p->cpu, __ATOMIC_RELAXED);
+        info[n].node = __atomic_load_n(&thread_p->node, __ATOMIC_RELAXED);
+        info[n].pinned = thpool_p->num_cpusets > 0;
+        info[n].migrations = __atomic_load_n(&thread_p->migrations, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&thpool_p->thcount_lock);
+
+    return n;
+}
+
+void thpool_cpuset_zero(thpool_cpuset_t *set)
+{
+    memset(set, 0, sizeof(*set));
+}
+
+int thpool_cpuset_add(thpool_cpuset_t *set, int cpu)
+{
+    if (cpu < 0 || cpu >= THPOOL_CPUSET_MAX)
+        return -1;
+    set->bits[cpu / THPOOL_CPUSET_BITS] |= 1UL << (cpu % THPOOL_CPUSET_BITS);
+    return 0;
+}
+
+int thpool_cpuset_isset(const thpool_cpuset_t *set, int cpu)
+{
+    if (cpu < 0 || cpu >= THPOOL_CPUSET_MAX)
+        return 0;
+    return (set->bits[cpu / THPOOL_CPUSET_BITS] >> (cpu % THPOOL_CPUSET_BITS)) & 1;
+}
+
+/* Add the cpus of a NUMA node, as listed in sysfs, e.g. "0-7,16-23"
+ *
+ * @return number of cpus added, -1 if the node does not exist
+ */
+int thpool_cpuset_add_node(thpool_cpuset_t *set, int node)
+{
+    char path[64];
+    FILE *fp;
+    int first, last, count = 0;
+    int sep;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+    while (fscanf(fp, "%d", &first) == 1) {
+        last = first;
+        sep = fgetc(fp);
+        if (sep == '-') {
+            if (fscanf(fp, "%d", &last) != 1)
+                break;
+            sep = fgetc(fp);
+        }
+        for (; first <= last; first++) {
+            if (thpool_cpuset_add(set, first) == 0)
+                count++;
+        }
+        if (sep != ',')
+            break;
+    }
+    fclose(fp);
+    return count;
+}
+
+/* Start one more worker in a free slot
+ *
+ * @return 0 on success, -1 if the pool is at max_threads or on error
+ */
+static int thpool_grow(thpool_t *thpool_p)
+{
+    int n, ret = -1;
+
+    pthread_mutex_lock(&thpool_p->thcount_lock);
+    if (atomic_load(&thpool_p->keepalive) && thpool_p->num_threads_started < thpool_p->max_threads) {
+        for (n = 0; n < thpool_p->num_slots; n++) {
+            if (thpool_p->threads[n]->state != THREAD_RUNNING)
+                break;
+        }
+        /* A retired thread has given up the slot, it is about to return */
+        if (n < thpool_p->num_slots && thpool_p->threads[n]->state == THREAD_EXITED) {
+            pthread_join(thpool_p->threads[n]->pthread, NULL);
+            __atomic_store_n(&thpool_p->threads[n]->state, THREAD_FREE, __ATOMIC_RELEASE);
+        }
+        if (n < thpool_p->num_slots && thread_start(thpool_p->threads[n]) == 0) {
+            __atomic_store_n(&thpool_p->threads[n]->state, THREAD_RUNNING, __ATOMIC_RELEASE);
+            thpool_p->num_threads_started++;
+            thpool_p->num_grown++;
+            if (thpool_p->num_threads_started > thpool_p->peak_threads)
+                thpool_p->peak_threads = thpool_p->num_threads_started;
+            if (n + 1 > atomic_load(&thpool_p->slots_used))
+                atomic_store(&thpool_p->slots_used, n + 1);
+            ret = 0;
+#if THPOOL_DEBUG
+            printf("THPOOL_DEBUG: Grew pool to %d threads\n", thpool_p->num_threads_started);
+#endif
+        }
+    }
+    pthread_mutex_unlock(&thpool_p->thcount_lock);
+
+    return ret;
+}
+
+/* Total number of tasks taken by workers, racy but monotonic enough */
+static unsigned long thpool_pulls(thpool_t *thpool_p)
+{
+    unsigned long pulls = 0;
+    int n;
+
+    for (n = 0; n < thpool_p->num_slots; n++)
+        pulls += __atomic_load_n(&thpool_p->threads[n]->pulls, __ATOMIC_RELAXED);
+    return pulls;
+}
+
+/* Grow the pool when queued work has been stuck behind busy workers
+ *
+ * Runs on the timer thread. The queue counts as stuck while tasks are
+ * waiting, no worker sleeps and no worker took a task for grow_wait.
+ */
+static void thpool_monitor(thpool_t *thpool_p)
+{
+    task_queue_t *task_queue_p = &thpool_p->task_queue;
+    unsigned long pulls;
+    uint64_t now;
+
+    if (!task_queue_has_work(task_queue_p) || atomic_load(&task_queue_p->num_sleeping) > 0) {
+        thpool_p->stall_since = 0;
+        return;
+    }
 
-    threads_on_hold = 0;
+    now = now_ns();
+    pulls = thpool_pulls(thpool_p);
+    if (thpool_p->stall_since == 0 || pulls != thpool_p->stall_pulls) {
+        thpool_p->stall_since = now;
+        thpool_p->stall_pulls = pulls;
+        return;
+    }
+    if (now - thpool_p->stall_since >= thpool_p->grow_wait_ns) {
+        thpool_grow(thpool_p);
+        thpool_p->stall_since = 0;
+    }
 }
 
 int thpool_num_threads_working(thpool_t *thpool_p) 
 {
-    return thpool_p->num_threads_working;
+    return atomic_load(&thpool_p->num_threads_working);
 }
 
 task_queue_t *thpool_taskqueue(thpool_t *thpool_p) 
@@ -240,20 +914,160 @@ static int thread_init(thpool_t *thpool_p, struct thread **thread_p, int id)
 
     (*thread_p)->thpool_p = thpool_p;
     (*thread_p)->id = id;
+    (*thread_p)->cache = NULL;
+    (*thread_p)->cache_len = 0;
+    (*thread_p)->pulls = 0;
+    (*thread_p)->state = THREAD_FREE;
+    (*thread_p)->cpu = -1;
+    (*thread_p)->node = -1;
+    (*thread_p)->migrations = 0;
+    (*thread_p)->stats = NULL;
+    if (thpool_p->collect_stats) {
+        (*thread_p)->stats = (thread_stats_t *)calloc(1, sizeof(thread_stats_t));
+        if ((*thread_p)->stats == NULL) {
+            err("thread_init(): Could not allocate memory for stats\n");
+            free(*thread_p);
+            return -1;
+        }
+    }
 
-    pthread_create(&(*thread_p)->pthread, NULL, (void *(*)(void *))thread_do, (*thread_p));
-    pthread_detach((*thread_p)->pthread);
+    int lane;
+    for (lane = 0; lane < TASK_PRIO_MAX; lane++) {
+        if (deque_init(&(*thread_p)->deque[lane]) == -1) {
+            err("thread_init(): Could not allocate memory for deque\n");
+            while (--lane >= 0)
+                deque_destroy(&(*thread_p)->deque[lane]);
+            free((*thread_p)->stats);
+            free(*thread_p);
+            return -1;
+        }
+    }
     return 0;
 }
 
-/* Sets the calling thread on hold */
-static void thread_hold(int sig_id) 
+/* Start the pthread of an initialized thread
+ *
+ * The stack size, scheduling and cpu set of the pool options are applied
+ * at creation, so the worker never runs a task outside its placement.
+ * Slot n uses cpu set n modulo the number of sets.
+ */
+static int thread_start(struct thread *thread_p)
+{
+    thpool_t *thpool_p = thread_p->thpool_p;
+    pthread_attr_t attr;
+    int ret = 0;
+
+    pthread_attr_init(&attr);
+    if (thpool_p->stack_size > 0 && pthread_attr_setstacksize(&attr, thpool_p->stack_size) != 0) {
+        err("thread_start(): Invalid stack size\n");
+        ret = -1;
+    }
+    if (ret == 0 && thpool_p->sched_policy != THPOOL_SCHED_INHERIT) {
+        struct sched_param param = { .sched_priority = thpool_p->sched_priority };
+        if (pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED) != 0 ||
+            pthread_attr_setschedpolicy(&attr, thpool_p->sched_policy) != 0 ||
+            pthread_attr_setschedparam(&attr, &param) != 0) {
+            err("thread_start(): Invalid scheduling policy or priority\n");
+            ret = -1;
+        }
+    }
+#if defined(__linux__)
+    if (ret == 0 && thpool_p->num_cpusets > 0) {
+        const thpool_cpuset_t *set = &thpool_p->cpusets[thread_p->id % thpool_p->num_cpusets];
+        cpu_set_t cpuset;
+        int cpu;
+
+        CPU_ZERO(&cpuset);
+        for (cpu = 0; cpu < THPOOL_CPUSET_MAX && cpu < CPU_SETSIZE; cpu++) {
+            if (thpool_cpuset_isset(set, cpu))
+                CPU_SET(cpu, &cpuset);
+        }
+        if (pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset) != 0) {
+            err("thread_start(): Invalid cpu set\n");
+            ret = -1;
+        }
+    }
+#endif
+    if (ret == 0 && pthread_create(&thread_p->pthread, &attr, (void *(*)(void *))thread_do, thread_p) != 0) {
+        err("thread_start(): Could not create thread\n");
+        ret = -1;
+    }
+    pthread_attr_destroy(&attr);
+    return ret;
+}
+
+/* Record the cpu the worker runs on, counting moves since the last look */
+static void thread_placement(struct thread *thread_p)
+{
+#if defined(__linux__)
+    unsigned int cpu, node;
+
+    if (getcpu(&cpu, &node) != 0)
+        return;
+    if (thread_p->cpu != -1 && thread_p->cpu != (int)cpu)
+        __atomic_store_n(&thread_p->migrations, thread_p->migrations + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&thread_p->cpu, (int)cpu, __ATOMIC_RELAXED);
+    __atomic_store_n(&thread_p->node, (int)node, __ATOMIC_RELAXED);
+#else
+    (void)thread_p;
+#endif
+}
+
+/* Give up the slot of an idle worker above min_threads
+ *
+ * The slot is marked exited right away, so thpool_grow() may join and
+ * reuse it while the caller is still on its way out. The caller must not
+ * touch the slot or thcount_lock anymore once told to exit.
+ *
+ * @return 1 if the calling worker must exit, 0 otherwise
+ */
+static int thread_retire(struct thread *thread_p)
+{
+    thpool_t *thpool_p = thread_p->thpool_p;
+    int lane, used, retire = 0;
+
+    /* Tasks pushed to this deque meanwhile keep the worker around */
+    for (lane = 0; lane < TASK_PRIO_MAX; lane++) {
+        if (__atomic_load_n(&thread_p->deque[lane].len, __ATOMIC_RELAXED))
+            return 0;
+    }
+
+    pthread_mutex_lock(&thpool_p->thcount_lock);
+    if (thpool_p->num_threads_started > thpool_p->min_threads) {
+        thpool_p->num_threads_started--;
+        thpool_p->num_threads_alive--;
+        thpool_p->num_shrunk++;
+        __atomic_store_n(&thread_p->state, THREAD_EXITED, __ATOMIC_RELEASE);
+
+        /* Round-robin stores stop at the last running slot */
+        used = atomic_load(&thpool_p->slots_used);
+        while (used > 1 && thpool_p->threads[used - 1]->state != THREAD_RUNNING)
+            used--;
+        atomic_store(&thpool_p->slots_used, used);
+        retire = 1;
+    }
+    pthread_mutex_unlock(&thpool_p->thcount_lock);
+
+    return retire;
+}
+
+/* Steal the oldest task of one lane of another thread's deques
+ *
+ * Victims are visited starting right after the thief so that concurrent
+ * thieves spread over different deques.
+ */
+static task_t *thread_steal(struct thread *thread_p, int lane)
 {
-    (void)sig_id;
-    threads_on_hold = 1;
-    while (threads_on_hold) {
-        sleep(1);
+    thpool_t *thpool_p = thread_p->thpool_p;
+    task_t *task_p;
+    int n;
+
+    for (n = 1; n < thpool_p->num_slots; n++) {
+        thread_t *victim = thpool_p->threads[(thread_p->id + n) % thpool_p->num_slots];
+        if ((task_p = deque_steal_top(&victim->deque[lane])) != NULL)
+            return task_p;
     }
+    return NULL;
 }
 
 /* What each thread is doing
@@ -282,209 +1096,2294 @@ static void *thread_do(struct thread *thread_p)
 
     /* Assure all threads have been created before starting serving */
     thpool_t *thpool_p = thread_p->thpool_p;
-
-    /* Register signal handler */
-    struct sigaction act;
-    sigemptyset(&act.sa_mask);
-    act.sa_flags = 0;
-    act.sa_handler = thread_hold;
-    if (sigaction(SIGUSR1, &act, NULL) == -1) {
-        err("thread_do(): cannot handle SIGUSR1");
-    }
+    thread_self = thread_p;
+    thread_placement(thread_p);
 
     /* Mark thread as alive (initialized) */
     pthread_mutex_lock(&thpool_p->thcount_lock);
     thpool_p->num_threads_alive += 1;
+    pthread_cond_signal(&thpool_p->threads_alive);
     pthread_mutex_unlock(&thpool_p->thcount_lock);
 
-    while (threads_keepalive) {
+    thread_stats_t *stats = thread_p->stats;
+    uint64_t start = 0, end;
+    if (stats)
+        __atomic_store_n(&stats->idle_since, now_ns(), __ATOMIC_RELAXED);
 
-        bsem_wait(thpool_p->task_queue.has_tasks);
+    int retire = 0;
+    while (atomic_load(&thpool_p->keepalive) && !retire) {
 
-        if (threads_keepalive) {
+        /* Read task from own deque or steal one, sleep when there is none */
+        task_t *task_p = task_queue_pull(thread_p, &retire);
+        if (task_p == NULL)
+            continue;
 
-            pthread_mutex_lock(&thpool_p->thcount_lock);
-            thpool_p->num_threads_working++;
-            pthread_mutex_unlock(&thpool_p->thcount_lock);
+        atomic_fetch_add(&thpool_p->num_threads_working, 1);
 
-            /* Read task from queue and execute it */
-            task_t *task_p = task_queue_pull(&thpool_p->task_queue);
-            if (task_p) {
-                if (task_p->handler) {
-                    task_p->handler(task_p);
+        uint64_t enqueued = task_p->enqueue_ns;
+        if (stats) {
+            start = now_ns();
+            __atomic_store_n(&stats->idle_ns, stats->idle_ns + (start - stats->idle_since),
+                             __ATOMIC_RELAXED);
+            __atomic_store_n(&stats->idle_since, 0, __ATOMIC_RELAXED);
+        }
+
+        /* An embedded task may be gone once its last callback returned */
+        int embedded = task_p->flags & TASK_F_EMBEDDED;
+        int deferred = task_p->flags & TASK_F_DEFERRED;
+        int lane = task_p->priority;
+        task_handler_t result_cb = task_p->result_cb;
+        task_handler_t cleanup_cb = task_p->cleanup_cb;
+        task_future_t *future = task_p->future;
+        task_group_t *group = task_p->flags & TASK_F_GROUPED ? task_p->group : NULL;
+        if (future && !future_claim(future)) {
+            /* Cancelled while queued, task_cancel() completed the future */
+            task_discard(task_p, embedded, cleanup_cb, future, group);
+        } else {
+            if (task_p->flags & TASK_F_COROUTINE) {
+                /* Parked in the reactor, the task stays pending until it returns */
+                if (coro_resume(thpool_p, task_p) == 0) {
+                    if (stats) {
+                        end = now_ns();
+                        __atomic_store_n(&stats->busy_ns, stats->busy_ns + (end - start),
+                                         __ATOMIC_RELAXED);
+                        __atomic_store_n(&stats->idle_since, end, __ATOMIC_RELAXED);
+                    }
+                    atomic_fetch_sub(&thpool_p->num_threads_working, 1);
+                    task_queue_done(&thpool_p->task_queue, lane);
+                    continue;
                 }
-                free(task_p);
+            } else if (task_p->handler) {
+                task_p->handler(task_p);
             }
+            /* Once queued for completion the draining thread owns the task */
+            if (!deferred || completion_push(&thpool_p->completion, task_p) == -1)
+                task_finish(task_p, embedded, result_cb, cleanup_cb, future, group);
+        }
+
+        if (stats) {
+            end = now_ns();
+            thread_stats_task(stats, enqueued, start, end);
+            __atomic_store_n(&stats->idle_since, end, __ATOMIC_RELAXED);
+        }
+
+        atomic_fetch_sub(&thpool_p->num_threads_working, 1);
+        task_queue_done(&thpool_p->task_queue, lane);
+        thread_placement(thread_p);
 
+        /* Only the task that drains the pool touches thcount_lock */
+        if (atomic_fetch_sub(&thpool_p->num_tasks_pending, 1) == 1) {
             pthread_mutex_lock(&thpool_p->thcount_lock);
-            thpool_p->num_threads_working--;
-            if (!thpool_p->num_threads_working) {
-                pthread_cond_signal(&thpool_p->threads_all_idle);
-            }
+            pthread_cond_broadcast(&thpool_p->threads_all_idle);
             pthread_mutex_unlock(&thpool_p->thcount_lock);
         }
     }
-    pthread_mutex_lock(&thpool_p->thcount_lock);
-    thpool_p->num_threads_alive--;
-    pthread_mutex_unlock(&thpool_p->thcount_lock);
+    /* A retired worker gave up its slot in thread_retire() already */
+    if (!retire) {
+        pthread_mutex_lock(&thpool_p->thcount_lock);
+        thpool_p->num_threads_alive--;
+        pthread_mutex_unlock(&thpool_p->thcount_lock);
+    }
 
     return NULL;
 }
 
 /* Frees a thread  */
 static void thread_destroy(thread_t *thread_p) {
+    int lane;
+    for (lane = 0; lane < TASK_PRIO_MAX; lane++)
+        deque_destroy(&thread_p->deque[lane]);
+    free(thread_p->stats);
     free(thread_p);
 }
 
-/* ============================ JOB QUEUE =========================== */
+/* ============================= STATS ============================== */
 
-/* Initialize queue */
-static int task_queue_init(task_queue_t *task_queue_p) 
+/* Bucket of a value, see histogram_t */
+static int hist_bucket(uint64_t value)
 {
-    task_queue_p->len = 0;
-    task_queue_p->front = NULL;
-    task_queue_p->rear = NULL;
-
-    task_queue_p->has_tasks = (struct bsem *)malloc(sizeof(struct bsem));
-    if (task_queue_p->has_tasks == NULL) {
-        return -1;
-    }
-
-    pthread_mutex_init(&(task_queue_p->rwmutex), NULL);
-    bsem_init(task_queue_p->has_tasks, 0);
+    int msb;
 
-    return 0;
+    if (value < HIST_SUB)
+        return (int)value;
+    msb = 63 - __builtin_clzll(value);
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+           (int)((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
 }
 
-/* Clear the queue */
-static void task_queue_clear(task_queue_t *task_queue_p) 
+/* Largest value that falls into a bucket */
+static uint64_t hist_bucket_max(int bucket)
 {
-
-    while (task_queue_p->len) {
-        free(task_queue_pull(task_queue_p));
-    }
-
-    task_queue_p->front = NULL;
-    task_queue_p->rear = NULL;
-    bsem_reset(task_queue_p->has_tasks);
-    task_queue_p->len = 0;
+    int shift;
+
+    if (bucket < HIST_SUB)
+        return (uint64_t)bucket;
+    shift = bucket / HIST_SUB - 1;
+    if (bucket + 1 == HIST_BUCKETS)
+        return UINT64_MAX;
+    return (((uint64_t)HIST_SUB + bucket % HIST_SUB + 1) << shift) - 1;
 }
 
-/* Add (allocated) task to queue
- */
-int task_queue_push(task_queue_t *task_queue_p, task_t *newtask) 
+/* Record a value, by the owning worker only */
+static void hist_record(histogram_t *hist, uint64_t value)
 {
+    int bucket = hist_bucket(value);
 
-    if (newtask->handler == NULL)
-        return -1;
-
-    pthread_mutex_lock(&task_queue_p->rwmutex);
-    newtask->prev = NULL;
+    __atomic_store_n(&hist->counts[bucket], hist->counts[bucket] + 1, __ATOMIC_RELAXED);
+    if (value > hist->max)
+        __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+}
 
-    switch (task_queue_p->len) {
+/* Account for one task a worker ran from start to end */
+static void thread_stats_task(thread_stats_t *stats, uint64_t enqueued,
+                              uint64_t start, uint64_t end)
+{
+    __atomic_store_n(&stats->tasks, stats->tasks + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->busy_ns, stats->busy_ns + (end - start), __ATOMIC_RELAXED);
+    hist_record(&stats->wait, enqueued && start > enqueued ? start - enqueued : 0);
+    hist_record(&stats->run, end - start);
+}
 
-    case 0: /* if no tasks in queue */
-        task_queue_p->front = newtask;
-        task_queue_p->rear = newtask;
-        break;
+/* Percentiles of a histogram, bucket precision and never above max */
+static void hist_latency(thpool_latency_t *out, const unsigned long *counts, uint64_t max)
+{
+    unsigned long total = 0, seen = 0;
+    unsigned long p50, p99;
+    int bucket;
+
+    for (bucket = 0; bucket < HIST_BUCKETS; bucket++)
+        total += counts[bucket];
+    out->count = total;
+    out->max_ns = max;
+    out->p50_ns = out->p99_ns = 0;
+    if (total == 0)
+        return;
 
-    default: /* if tasks in queue */
-        task_queue_p->rear->prev = newtask;
-        task_queue_p->rear = newtask;
+    /* Ranks are 1-based, rounded up */
+    p50 = (total * 50 + 99) / 100;
+    p99 = (total * 99 + 99) / 100;
+    for (bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+        seen += counts[bucket];
+        if (out->p50_ns == 0 && seen >= p50)
+            out->p50_ns = hist_bucket_max(bucket);
+        if (seen >= p99) {
+            out->p99_ns = hist_bucket_max(bucket);
+            break;
+        }
     }
-    task_queue_p->len++;
+    if (out->p50_ns > max)
+        out->p50_ns = max;
+    if (out->p99_ns > max)
+        out->p99_ns = max;
+}
 
-    bsem_post(task_queue_p->has_tasks);
-    pthread_mutex_unlock(&task_queue_p->rwmutex);
+/* Racy copy of a worker's histogram, merged into counts */
+static uint64_t hist_merge(unsigned long *counts, const histogram_t *hist)
+{
+    int bucket;
 
-    return 0;
+    for (bucket = 0; bucket < HIST_BUCKETS; bucket++)
+        counts[bucket] += __atomic_load_n(&hist->counts[bucket], __ATOMIC_RELAXED);
+    return __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
 }
 
-/* Get first task from queue(removes it from queue)
- * Notice: Caller MUST hold a mutex
- */
-static struct task *task_queue_pull(task_queue_t *task_queue_p) 
+/* Fill one snapshot entry from the counters of one worker */
+static void stats_fill(thpool_stats_t *out, const thread_stats_t *stats, uint64_t now)
 {
+    unsigned long counts[HIST_BUCKETS];
+    uint64_t idle_since, max;
+
+    out->tasks = __atomic_load_n(&stats->tasks, __ATOMIC_RELAXED);
+    out->busy_ns = __atomic_load_n(&stats->busy_ns, __ATOMIC_RELAXED);
+    out->idle_ns = __atomic_load_n(&stats->idle_ns, __ATOMIC_RELAXED);
+    idle_since = __atomic_load_n(&stats->idle_since, __ATOMIC_RELAXED);
+    if (idle_since && now > idle_since)
+        out->idle_ns += now - idle_since;
+
+    memset(counts, 0, sizeof(counts));
+    max = hist_merge(counts, &stats->wait);
+    hist_latency(&out->wait, counts, max);
+    memset(counts, 0, sizeof(counts));
+    max = hist_merge(counts, &stats->run);
+    hist_latency(&out->run, counts, max);
+}
+
+/* Snapshot the per-worker counters of a pool opened with collect_stats
+ *
+ * Counters are read without stopping the workers, so a snapshot taken while
+ * tasks complete may be off by the tasks in flight.
+ *
+ * @param total         sums and percentiles over all workers, may be NULL
+ * @param workers       one entry per worker slot, may be NULL
+ * @param max_workers   entries available in workers
+ * @return number of worker entries filled, -1 if stats are not collected
+ */
+int thpool_stats_snapshot(thpool_t *thpool_p, thpool_stats_t *total,
+                          thpool_stats_t *workers, int max_workers)
+{
+    unsigned long wait[HIST_BUCKETS], run[HIST_BUCKETS];
+    uint64_t wait_max = 0, run_max = 0, max, now;
+    int n, filled = 0;
+
+    if (!thpool_p->collect_stats)
+        return -1;
+
+    now = now_ns();
+    memset(wait, 0, sizeof(wait));
+    memset(run, 0, sizeof(run));
+    if (total) {
+        memset(total, 0, sizeof(*total));
+        total->id = -1;
+    }
+
+    for (n = 0; n < thpool_p->num_slots; n++) {
+        thread_t *thread_p = thpool_p->threads[n];
+        thread_stats_t *stats = thread_p->stats;
+
+        if (workers && n < max_workers) {
+            workers[n].id = thread_p->id;
+            stats_fill(&workers[n], stats, now);
+            filled++;
+        }
+        if (total) {
+            total->tasks += __atomic_load_n(&stats->tasks, __ATOMIC_RELAXED);
+            total->busy_ns += __atomic_load_n(&stats->busy_ns, __ATOMIC_RELAXED);
+            total->idle_ns += __atomic_load_n(&stats->idle_ns, __ATOMIC_RELAXED);
+            uint64_t idle_since = __atomic_load_n(&stats->idle_since, __ATOMIC_RELAXED);
+            if (idle_since && now > idle_since)
+                total->idle_ns += now - idle_since;
+            if ((max = hist_merge(wait, &stats->wait)) > wait_max)
+                wait_max = max;
+            if ((max = hist_merge(run, &stats->run)) > run_max)
+                run_max = max;
+        }
+    }
+    if (total) {
+        hist_latency(&total->wait, wait, wait_max);
+        hist_latency(&total->run, run, run_max);
+    }
+
+    return filled;
+}
+
+/* ============================ JOB QUEUE =========================== */
+
+/* Initialize queue */
+static int task_queue_init(thpool_t *thpool_p, task_queue_t *task_queue_p,
+                           const thpool_options_t *opts) 
+{
+    int lane;
+
+    task_queue_p->thpool_p = thpool_p;
+    task_queue_p->type = opts->queue_type;
+    for (lane = 0; lane < TASK_PRIO_MAX; lane++) {
+        if (task_queue_p->type == THPOOL_QUEUE_RING &&
+            ring_init(&task_queue_p->ring[lane], opts->queue_capacity) == -1) {
+            while (--lane >= 0)
+                ring_destroy(&task_queue_p->ring[lane]);
+            return -1;
+        }
+        atomic_init(&task_queue_p->len[lane], 0);
+    }
+    atomic_init(&task_queue_p->next, 0);
+    atomic_init(&task_queue_p->background_running, 0);
+    task_queue_p->background_max = opts->background_max_threads > 0 ? opts->background_max_threads : 0;
+    atomic_init(&task_queue_p->num_sleeping, 0);
+
+    pthread_mutex_init(&(task_queue_p->sleep_lock), NULL);
+    pthread_cond_init(&(task_queue_p->has_tasks), NULL);
+
+    return 0;
+}
+
+/* Clear the queue */
+static void task_queue_clear(task_queue_t *task_queue_p) 
+{
+    thpool_t *thpool_p = task_queue_p->thpool_p;
+    task_t *task_p;
+    int n, lane;
+
+    for (lane = 0; lane < TASK_PRIO_MAX; lane++) {
+        if (task_queue_p->type == THPOOL_QUEUE_RING) {
+            while ((task_p = ring_pop(&task_queue_p->ring[lane])) != NULL) {
+                task_drop(task_p);
+            }
+        }
+        for (n = 0; n < thpool_p->num_slots; n++) {
+            while ((task_p = deque_pop_bottom(&thpool_p->threads[n]->deque[lane])) != NULL) {
+                task_drop(task_p);
+            }
+        }
+        atomic_store(&task_queue_p->len[lane], 0);
+    }
+    atomic_store(&thpool_p->num_tasks_pending, 0);
+}
+
+/* Store tasks without waking anyone up
+ *
+ * Each task goes to the lane of its priority. A worker of the pool pushes
+ * onto its own deque, any other thread spreads its tasks over the workers
+ * round-robin. With the ring the tasks simply go to the lane's shared ring.
+ *
+ * @return number of tasks stored, less than count if the ring is full or
+ *         memory ran out
+ */
+static size_t task_queue_store(task_queue_t *task_queue_p, task_t **tasks, size_t count)
+{
+    thpool_t *thpool_p = task_queue_p->thpool_p;
+    uint64_t stamp = thpool_p->max_threads > thpool_p->min_threads || thpool_p->collect_stats ?
+                     now_ns() : 0;
+    size_t n;
+
+    atomic_fetch_add(&thpool_p->num_tasks_pending, (int)count);
+
+    for (n = 0; n < count; n++) {
+        task_t *task_p = tasks[n];
+        int ret;
+
+        if ((unsigned int)task_p->priority >= TASK_PRIO_MAX)
+            task_p->priority = TASK_PRIO_NORMAL;
+        int lane = task_p->priority;
+
+        task_p->prev = NULL;
+        task_p->enqueue_ns = stamp;
+        if (task_queue_p->type == THPOOL_QUEUE_RING) {
+            ret = ring_push(&task_queue_p->ring[lane], task_p);
+        } else if (thread_self && thread_self->thpool_p == thpool_p) {
+            ret = deque_push_bottom(&thread_self->deque[lane], task_p);
+        } else {
+            unsigned int slot = atomic_fetch_add_explicit(&task_queue_p->next, 1, memory_order_relaxed);
+            unsigned int used = (unsigned int)atomic_load_explicit(&thpool_p->slots_used,
+                                                                   memory_order_relaxed);
+            unsigned int probe;
+
+            /* Skip slots whose worker retired, their deques are only stolen from */
+            slot %= used;
+            for (probe = 0; probe < used; probe++) {
+                if (__atomic_load_n(&thpool_p->threads[(slot + probe) % used]->state,
+                                    __ATOMIC_ACQUIRE) == THREAD_RUNNING) {
+                    slot = (slot + probe) % used;
+                    break;
+                }
+            }
+            ret = deque_push_top(&thpool_p->threads[slot]->deque[lane], task_p);
+        }
+        if (ret == -1)
+            break;
+        atomic_fetch_add(&task_queue_p->len[lane], 1);
+    }
+
+    atomic_fetch_sub(&thpool_p->num_tasks_pending, (int)(count - n));
+
+    return n;
+}
+
+/* Add (allocated) task to queue
+ */
+int task_queue_push(task_queue_t *task_queue_p, task_t *newtask) 
+{
+
+    if (newtask->handler == NULL)
+        return -1;
+
+    int grouped = task_group_enter(newtask);
+    if (task_queue_store(task_queue_p, &newtask, 1) != 1) {
+        err("task_queue_push(): Task queue is full\n");
+        if (grouped)
+            task_group_leave(newtask->group, -1);
+        newtask->flags &= ~TASK_F_GROUPED;
+        return -1;
+    }
+    task_queue_wakeup(task_queue_p, 1);
+
+    return 0;
+}
+
+/* Add (allocated) task to queue with the given priority
+ */
+int task_queue_push_prio(task_queue_t *task_queue_p, task_t *newtask, task_prio_t prio)
+{
+    newtask->priority = prio;
+    return task_queue_push(task_queue_p, newtask);
+}
+
+/* Add several (allocated) tasks to queue with a single wakeup
+ *
+ * Tasks are queued in order until one has no handler or the queue is full.
+ *
+ * @return number of tasks queued, the remaining ones still belong to the caller
+ */
+size_t task_queue_push_batch(task_queue_t *task_queue_p, task_t **tasks, size_t count)
+{
+    size_t n, queued;
+
+    for (n = 0; n < count; n++) {
+        if (tasks[n]->handler == NULL)
+            break;
+        task_group_enter(tasks[n]);
+    }
+
+    queued = task_queue_store(task_queue_p, tasks, n);
+    for (; n > queued; n--) {
+        if (tasks[n - 1]->flags & TASK_F_GROUPED)
+            task_group_leave(tasks[n - 1]->group, -1);
+        tasks[n - 1]->flags &= ~TASK_F_GROUPED;
+    }
+    if (queued)
+        task_queue_wakeup(task_queue_p, (int)queued);
+
+    return queued;
+}
+
+/* Queue a task again that is still counted as pending, e.g. a coroutine
+ *
+ * @return 0 on success, -1 if the pool is going away
+ */
+static int task_queue_requeue(task_queue_t *task_queue_p, task_t *task_p)
+{
+    thpool_t *thpool_p = task_queue_p->thpool_p;
+
+    /* A full ring empties as workers run, unless they are gone */
+    while (task_queue_store(task_queue_p, &task_p, 1) != 1) {
+        if (!atomic_load(&thpool_p->keepalive))
+            return -1;
+        sched_yield();
+    }
+    atomic_fetch_sub(&thpool_p->num_tasks_pending, 1);
+    task_queue_wakeup(task_queue_p, 1);
+
+    return 0;
+}
+
+/* Reserve a worker slot for a background task, 0 if the limit is reached */
+static int task_queue_admit_background(task_queue_t *task_queue_p)
+{
+    int running = atomic_load(&task_queue_p->background_running);
+
+    do {
+        if (task_queue_p->background_max && running >= task_queue_p->background_max)
+            return 0;
+    } while (!atomic_compare_exchange_weak(&task_queue_p->background_running, &running, running + 1));
+
+    return 1;
+}
+
+/* Whether a worker could take a task right now, never while paused */
+static int task_queue_has_work(task_queue_t *task_queue_p)
+{
+    int lane;
+
+    if (atomic_load(&task_queue_p->thpool_p->paused))
+        return 0;
+
+    for (lane = 0; lane < TASK_PRIO_BACKGROUND; lane++) {
+        if (atomic_load(&task_queue_p->len[lane]) > 0)
+            return 1;
+    }
+    if (atomic_load(&task_queue_p->len[TASK_PRIO_BACKGROUND]) <= 0)
+        return 0;
+
+    return !task_queue_p->background_max ||
+           atomic_load(&task_queue_p->background_running) < task_queue_p->background_max;
+}
+
+/* Take a task of one lane */
+static task_t *task_queue_take(struct thread *thread_p, int lane)
+{
+    task_queue_t *task_queue_p = &thread_p->thpool_p->task_queue;
+    task_t *task_p;
+
+    if (atomic_load(&task_queue_p->len[lane]) <= 0)
+        return NULL;
+    if (lane == TASK_PRIO_BACKGROUND && !task_queue_admit_background(task_queue_p))
+        return NULL;
+
+    if (task_queue_p->type == THPOOL_QUEUE_RING) {
+        task_p = ring_pop(&task_queue_p->ring[lane]);
+    } else {
+        task_p = deque_pop_bottom(&thread_p->deque[lane]);
+        if (task_p == NULL)
+            task_p = thread_steal(thread_p, lane);
+    }
+
+    if (task_p)
+        atomic_fetch_sub(&task_queue_p->len[lane], 1);
+    else if (lane == TASK_PRIO_BACKGROUND)
+        atomic_fetch_sub(&task_queue_p->background_running, 1);
+
+    return task_p;
+}
+
+/* Get a task for a thread(removes it from queue)
+ *
+ * Lanes are served from high to background priority. To keep the lower
+ * lanes from starving, every PRIO_STARVE_INTERVAL-th task is looked for from
+ * background to high instead. Within a lane the thread pops the newest task
+ * of its own deque, then tries to steal the oldest task of another thread,
+ * or takes the oldest task of the ring.
+ *
+ * Returns NULL once the thread has slept without finding work, the caller
+ * re-checks keepalive. In an elastic pool a worker that stayed idle
+ * for idle_timeout may be told to retire, a task that waited longer than
+ * grow_wait with no idle worker left makes the pool grow.
+ */
+static struct task *task_queue_pull(struct thread *thread_p, int *retire) 
+{
+    thpool_t *thpool_p = thread_p->thpool_p;
+    task_queue_t *task_queue_p = &thpool_p->task_queue;
+    int elastic = thpool_p->max_threads > thpool_p->min_threads;
+    task_t *task_p;
+    int round, n;
+
+    for (round = 0; round < STEAL_SPIN_ROUNDS && !atomic_load(&thpool_p->paused); round++) {
+        int reverse = (thread_p->pulls % PRIO_STARVE_INTERVAL) == PRIO_STARVE_INTERVAL - 1;
+
+        for (n = 0; n < TASK_PRIO_MAX; n++) {
+            task_p = task_queue_take(thread_p, reverse ? TASK_PRIO_MAX - 1 - n : n);
+            if (task_p) {
+                __atomic_store_n(&thread_p->pulls, thread_p->pulls + 1, __ATOMIC_RELAXED);
+                if (elastic && atomic_load(&task_queue_p->num_sleeping) == 0 &&
+                    now_ns() - task_p->enqueue_ns > thpool_p->grow_wait_ns &&
+                    task_queue_has_work(task_queue_p)) {
+                    thpool_grow(thpool_p);
+                }
+                return task_p;
+            }
+        }
+        if (!task_queue_has_work(task_queue_p))
+            break;
+    }
+
+    /* Publish the sleeper before re-checking len, pairs with task_queue_wakeup */
+    pthread_mutex_lock(&task_queue_p->sleep_lock);
+    atomic_fetch_add(&task_queue_p->num_sleeping, 1);
+    if (!task_queue_has_work(task_queue_p) && atomic_load(&thpool_p->keepalive)) {
+        if (!elastic) {
+            pthread_cond_wait(&task_queue_p->has_tasks, &task_queue_p->sleep_lock);
+        } else {
+            struct timespec deadline;
+            deadline_init(&deadline, (int)thpool_p->idle_timeout_ms);
+            if (pthread_cond_timedwait(&task_queue_p->has_tasks, &task_queue_p->sleep_lock,
+                                       &deadline) == ETIMEDOUT &&
+                !task_queue_has_work(task_queue_p) && !atomic_load(&thpool_p->paused)) {
+                *retire = thread_retire(thread_p);
+            }
+        }
+    }
+    atomic_fetch_sub(&task_queue_p->num_sleeping, 1);
+    pthread_mutex_unlock(&task_queue_p->sleep_lock);
+
+    return NULL;
+}
+
+/* Account for a finished task of the given lane
+ *
+ * A finished background task may unblock background tasks that were held
+ * back by background_max_threads.
+ */
+static void task_queue_done(task_queue_t *task_queue_p, int lane)
+{
+    if (lane != TASK_PRIO_BACKGROUND)
+        return;
+
+    atomic_fetch_sub(&task_queue_p->background_running, 1);
+    if (atomic_load(&task_queue_p->len[TASK_PRIO_BACKGROUND]) > 0)
+        task_queue_wakeup(task_queue_p, 1);
+}
+
+/* Wake up to count sleeping threads, all of them if count is negative */
+static void task_queue_wakeup(task_queue_t *task_queue_p, int count)
+{
+    if (count >= 0 && atomic_load(&task_queue_p->num_sleeping) == 0)
+        return;
+
+    pthread_mutex_lock(&task_queue_p->sleep_lock);
+    if (count < 0 || count > 1)
+        pthread_cond_broadcast(&task_queue_p->has_tasks);
+    else
+        pthread_cond_signal(&task_queue_p->has_tasks);
+    pthread_mutex_unlock(&task_queue_p->sleep_lock);
+}
+
+/* Free all queue resources back to the system */
+static void task_queue_destroy(task_queue_t *task_queue_p) 
+{
+    int lane;
+
+    for (lane = 0; lane < TASK_PRIO_MAX; lane++) {
+        if (task_queue_p->type == THPOOL_QUEUE_RING)
+            ring_destroy(&task_queue_p->ring[lane]);
+    }
+    pthread_mutex_destroy(&task_queue_p->sleep_lock);
+    pthread_cond_destroy(&task_queue_p->has_tasks);
+}
+
+/* ============================= DEQUE ============================== */
+
+/* Initialize deque */
+static int deque_init(deque_t *deque_p)
+{
+    deque_p->buf = (task_t **)malloc(DEQUE_INIT_CAP * sizeof(task_t *));
+    if (deque_p->buf == NULL)
+        return -1;
+
+    deque_p->cap = DEQUE_INIT_CAP;
+    deque_p->top = 0;
+    deque_p->len = 0;
+    pthread_mutex_init(&deque_p->mutex, NULL);
+
+    return 0;
+}
+
+/* Double the ring buffer, unrolling it so that top starts at 0
+ * Notice: Caller MUST hold the deque mutex
+ */
+static int deque_grow(deque_t *deque_p)
+{
+    unsigned int n;
+    task_t **buf = (task_t **)malloc(2 * deque_p->cap * sizeof(task_t *));
+    if (buf == NULL)
+        return -1;
+
+    for (n = 0; n < deque_p->len; n++)
+        buf[n] = deque_p->buf[(deque_p->top + n) & (deque_p->cap - 1)];
+
+    free(deque_p->buf);
+    deque_p->buf = buf;
+    deque_p->cap *= 2;
+    deque_p->top = 0;
+
+    return 0;
+}
+
+/* Push task as the newest one, owner side */
+static int deque_push_bottom(deque_t *deque_p, task_t *task_p)
+{
+    pthread_mutex_lock(&deque_p->mutex);
+    if (deque_p->len == deque_p->cap && deque_grow(deque_p) == -1) {
+        pthread_mutex_unlock(&deque_p->mutex);
+        return -1;
+    }
+    deque_p->buf[(deque_p->top + deque_p->len) & (deque_p->cap - 1)] = task_p;
+    __atomic_store_n(&deque_p->len, deque_p->len + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&deque_p->mutex);
+
+    return 0;
+}
+
+/* Push task as the oldest one, used for submissions from outside the pool */
+static int deque_push_top(deque_t *deque_p, task_t *task_p)
+{
+    pthread_mutex_lock(&deque_p->mutex);
+    if (deque_p->len == deque_p->cap && deque_grow(deque_p) == -1) {
+        pthread_mutex_unlock(&deque_p->mutex);
+        return -1;
+    }
+    deque_p->top = (deque_p->top - 1) & (deque_p->cap - 1);
+    deque_p->buf[deque_p->top] = task_p;
+    __atomic_store_n(&deque_p->len, deque_p->len + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&deque_p->mutex);
+
+    return 0;
+}
+
+/* Pop the newest task, owner side */
+static task_t *deque_pop_bottom(deque_t *deque_p)
+{
+    task_t *task_p = NULL;
+
+    pthread_mutex_lock(&deque_p->mutex);
+    if (deque_p->len) {
+        __atomic_store_n(&deque_p->len, deque_p->len - 1, __ATOMIC_RELAXED);
+        task_p = deque_p->buf[(deque_p->top + deque_p->len) & (deque_p->cap - 1)];
+    }
+    pthread_mutex_unlock(&deque_p->mutex);
+
+    return task_p;
+}
+
+/* Steal the oldest task, thief side */
+static task_t *deque_steal_top(deque_t *deque_p)
+{
+    task_t *task_p = NULL;
+
+    /* Cheap racy peek so thieves skip empty deques without locking */
+    if (__atomic_load_n(&deque_p->len, __ATOMIC_RELAXED) == 0)
+        return NULL;
+
+    pthread_mutex_lock(&deque_p->mutex);
+    if (deque_p->len) {
+        task_p = deque_p->buf[deque_p->top];
+        deque_p->top = (deque_p->top + 1) & (deque_p->cap - 1);
+        __atomic_store_n(&deque_p->len, deque_p->len - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&deque_p->mutex);
+
+    return task_p;
+}
+
+/* Free deque resources, tasks still queued must have been cleared */
+static void deque_destroy(deque_t *deque_p)
+{
+    pthread_mutex_destroy(&deque_p->mutex);
+    free(deque_p->buf);
+}
+
+/* ============================ TASK SLAB =========================== */
+
+/* Initialize slab, chunks are only allocated on demand */
+static void slab_init(task_slab_t *slab_p, size_t max_tasks)
+{
+    pthread_mutex_init(&slab_p->mutex, NULL);
+    slab_p->free_list = NULL;
+    slab_p->chunks = NULL;
+    slab_p->num_chunks = 0;
+    slab_p->max_chunks = (max_tasks + SLAB_CHUNK_TASKS - 1) / SLAB_CHUNK_TASKS;
+    atomic_init(&slab_p->hits, 0);
+    atomic_init(&slab_p->fallbacks, 0);
+}
+
+/* Take up to count tasks off the shared free list, growing the slab if needed
+ * Notice: Caller MUST hold the slab mutex
+ */
+static task_t *slab_take(task_slab_t *slab_p, int count, int *taken)
+{
+    task_t *head, *tail;
+    int n;
+
+    if (slab_p->free_list == NULL && slab_p->num_chunks < slab_p->max_chunks) {
+        slab_chunk_t *chunk = (slab_chunk_t *)malloc(sizeof(slab_chunk_t));
+        if (chunk) {
+            for (n = 0; n < SLAB_CHUNK_TASKS; n++) {
+                chunk->tasks[n].prev = slab_p->free_list;
+                slab_p->free_list = &chunk->tasks[n];
+            }
+            chunk->next = slab_p->chunks;
+            slab_p->chunks = chunk;
+            slab_p->num_chunks++;
+        }
+    }
+
+    head = tail = slab_p->free_list;
+    if (head == NULL) {
+        *taken = 0;
+        return NULL;
+    }
+    for (n = 1; n < count && tail->prev; n++)
+        tail = tail->prev;
+    slab_p->free_list = tail->prev;
+    tail->prev = NULL;
+    *taken = n;
+
+    return head;
+}
+
+/* Get a task from the slab, malloc one when the slab is exhausted */
+static task_t *slab_alloc(thpool_t *thpool_p)
+{
+    task_slab_t *slab_p = &thpool_p->slab;
+    thread_t *self = thread_self;
+    task_t *task_p;
+    int taken;
+
+    if (self && self->thpool_p == thpool_p) {
+        if (self->cache == NULL) {
+            pthread_mutex_lock(&slab_p->mutex);
+            self->cache = slab_take(slab_p, TASK_CACHE_BATCH, &taken);
+            pthread_mutex_unlock(&slab_p->mutex);
+            self->cache_len = taken;
+        }
+        task_p = self->cache;
+        if (task_p) {
+            self->cache = task_p->prev;
+            self->cache_len--;
+        }
+    } else {
+        pthread_mutex_lock(&slab_p->mutex);
+        task_p = slab_take(slab_p, 1, &taken);
+        pthread_mutex_unlock(&slab_p->mutex);
+    }
+
+    if (task_p) {
+        atomic_fetch_add_explicit(&slab_p->hits, 1, memory_order_relaxed);
+        task_p->flags = TASK_F_SLAB;
+        task_p->owner = thpool_p;
+        return task_p;
+    }
+
+    atomic_fetch_add_explicit(&slab_p->fallbacks, 1, memory_order_relaxed);
+    return task_init();
+}
+
+/* Give a slab task back, through the thread cache when run by a worker */
+static void slab_free(thpool_t *thpool_p, task_t *task_p)
+{
+    task_slab_t *slab_p = &thpool_p->slab;
+    thread_t *self = thread_self;
+
+    if (self && self->thpool_p == thpool_p) {
+        task_p->prev = self->cache;
+        self->cache = task_p;
+        if (++self->cache_len < 2 * TASK_CACHE_BATCH)
+            return;
+
+        /* Keep one batch, hand the rest back in one go */
+        task_t *tail = self->cache;
+        int n;
+        for (n = 1; n < TASK_CACHE_BATCH; n++)
+            tail = tail->prev;
+        task_p = tail->prev;
+        tail->prev = NULL;
+        self->cache_len = TASK_CACHE_BATCH;
+
+        for (tail = task_p; tail->prev; tail = tail->prev) {
+        }
+        pthread_mutex_lock(&slab_p->mutex);
+        tail->prev = slab_p->free_list;
+        slab_p->free_list = task_p;
+        pthread_mutex_unlock(&slab_p->mutex);
+        return;
+    }
+
+    pthread_mutex_lock(&slab_p->mutex);
+    task_p->prev = slab_p->free_list;
+    slab_p->free_list = task_p;
+    pthread_mutex_unlock(&slab_p->mutex);
+}
+
+/* Free all chunks, tasks still cached by threads go with them */
+static void slab_destroy(task_slab_t *slab_p)
+{
+    while (slab_p->chunks) {
+        slab_chunk_t *chunk = slab_p->chunks;
+        slab_p->chunks = chunk->next;
+        free(chunk);
+    }
+    pthread_mutex_destroy(&slab_p->mutex);
+}
+
+/* =========================== TIMER WHEEL ========================== */
+
+/* Milliseconds elapsed since the wheel epoch */
+static uint64_t wheel_tick(timer_wheel_t *wheel_p)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec - wheel_p->epoch.tv_sec) * 1000 +
+           (ts.tv_nsec - wheel_p->epoch.tv_nsec) / 1000000;
+}
+
+/* Initialize wheel, its thread is started with the first timer */
+static void wheel_init(thpool_t *thpool_p, timer_wheel_t *wheel_p)
+{
+    pthread_condattr_t attr;
+    int level, slot;
+
+    wheel_p->thpool_p = thpool_p;
+    pthread_mutex_init(&wheel_p->mutex, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wheel_p->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    wheel_p->started = 0;
+    wheel_p->keepalive = 1;
+    wheel_p->now = 0;
+    wheel_p->count = 0;
+    wheel_p->monitor = NULL;
+    wheel_p->monitor_period = 0;
+    wheel_p->monitor_next = 0;
+    clock_gettime(CLOCK_MONOTONIC, &wheel_p->epoch);
+
+    for (level = 0; level < WHEEL_LEVELS; level++)
+        for (slot = 0; slot < WHEEL_SIZE; slot++)
+            INIT_LIST_HEAD(&wheel_p->slots[level][slot]);
+}
+
+/* Put a timer in the slot matching its distance from now
+ * Notice: Caller MUST hold the wheel mutex
+ */
+static void wheel_insert(timer_wheel_t *wheel_p, struct thpool_timer *timer_p)
+{
+    uint64_t expires = timer_p->expires;
+    uint64_t delta;
+    int level;
+
+    /* Overdue timers go to the slot being processed */
+    if (expires < wheel_p->now)
+        expires = timer_p->expires = wheel_p->now;
+
+    /* Beyond the range of the top level, park in its farthest slot */
+    delta = expires - wheel_p->now;
+    if (delta >= (uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+        expires = wheel_p->now + ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+    for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+        if (delta < (uint64_t)1 << (WHEEL_BITS * (level + 1)))
+            break;
+    }
+    list_add_tail(&timer_p->list,
+                  &wheel_p->slots[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK]);
+}
+
+/* Drop a reference, the last one frees the timer
+ * Notice: Caller MUST hold the wheel mutex
+ */
+static void timer_put(struct thpool_timer *timer_p)
+{
+    if (--timer_p->refs == 0)
+        free(timer_p);
+}
+
+/* Advance the wheel up to tick, moving due tasks to the fired list
+ * Notice: Caller MUST hold the wheel mutex
+ */
+static void wheel_advance(timer_wheel_t *wheel_p, uint64_t tick, task_t **fired)
+{
+    struct thpool_timer *timer_p, *tmp;
+    int level;
+
+    if (wheel_p->count == 0) {
+        wheel_p->now = tick;
+        return;
+    }
+
+    while (wheel_p->now < tick) {
+        uint64_t now = ++wheel_p->now;
+
+        /* Cascade higher levels whose slot boundary was crossed */
+        for (level = 1; level < WHEEL_LEVELS; level++) {
+            if ((now >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK)
+                break;
+            struct list_head *slot = &wheel_p->slots[level][(now >> (WHEEL_BITS * level)) & WHEEL_MASK];
+            LIST_HEAD(cascade);
+            list_splice_init(slot, &cascade);
+            list_for_each_entry_safe(timer_p, tmp, &cascade, list) {
+                list_del(&timer_p->list);
+                wheel_insert(wheel_p, timer_p);
+            }
+        }
+
+        list_for_each_entry_safe(timer_p, tmp, &wheel_p->slots[0][now & WHEEL_MASK], list) {
+            task_t *task_p;
+
+            list_del(&timer_p->list);
+            if (timer_p->period) {
+                task_p = thpool_task_init(wheel_p->thpool_p);
+                /* The template keeps cleanup_cb, it runs once when the timer goes */
+                if (task_p) {
+                    task_p->handler = timer_p->task->handler;
+                    task_p->result_cb = timer_p->task->result_cb;
+                    task_p->user_data = timer_p->task->user_data;
+                    task_p->priority = timer_p->task->priority;
+                    task_p->flags |= timer_p->task->flags & (TASK_F_DEFERRED | TASK_F_COROUTINE);
+                    task_p->dedup_key = timer_p->task->dedup_key;
+                    task_p->group = timer_p->task->group;
+                }
+                timer_p->expires += timer_p->period;
+                wheel_insert(wheel_p, timer_p);
+            } else {
+                task_p = timer_p->task;
+                timer_p->task = NULL;
+                timer_p->state = TIMER_FIRED;
+                wheel_p->count--;
+                timer_put(timer_p);
+            }
+            if (task_p) {
+                task_p->prev = *fired;
+                *fired = task_p;
+            }
+        }
+    }
+}
+
+/* Ticks until the wheel has work to do, -1 if nothing is pending
+ * Notice: Caller MUST hold the wheel mutex
+ */
+static int64_t wheel_next(timer_wheel_t *wheel_p)
+{
+    int64_t next = -1;
+    uint64_t n;
+
+    if (wheel_p->monitor) {
+        next = wheel_p->monitor_next > wheel_p->now ? (int64_t)(wheel_p->monitor_next - wheel_p->now) : 0;
+    }
+    if (wheel_p->count == 0)
+        return next;
+
+    /* Sleep no further than the next cascade */
+    for (n = 1; n <= WHEEL_SIZE; n++) {
+        uint64_t tick = wheel_p->now + n;
+        if (!list_empty(&wheel_p->slots[0][tick & WHEEL_MASK]) || (tick & WHEEL_MASK) == 0)
+            break;
+    }
+    if (n > WHEEL_SIZE)
+        n = WHEEL_SIZE;
+
+    return next >= 0 && next < (int64_t)n ? next : (int64_t)n;
+}
+
+/* What the wheel thread is doing */
+static void *wheel_do(timer_wheel_t *wheel_p)
+{
+    task_queue_t *task_queue_p = &wheel_p->thpool_p->task_queue;
+
+#if defined(__linux__)
+    prctl(PR_SET_NAME, "thpool-timer");
+#endif
+
+    pthread_mutex_lock(&wheel_p->mutex);
+    while (wheel_p->keepalive) {
+        task_t *fired = NULL;
+
+        wheel_advance(wheel_p, wheel_tick(wheel_p), &fired);
+
+        if (wheel_p->monitor && wheel_p->now >= wheel_p->monitor_next) {
+            wheel_p->monitor_next = wheel_p->now + wheel_p->monitor_period;
+            pthread_mutex_unlock(&wheel_p->mutex);
+            wheel_p->monitor(wheel_p->thpool_p);
+            pthread_mutex_lock(&wheel_p->mutex);
+        }
+
+        /* Queue outside of the lock, in firing order */
+        if (fired) {
+            task_t *task_p, *order = NULL;
+
+            pthread_mutex_unlock(&wheel_p->mutex);
+            while ((task_p = fired) != NULL) {
+                fired = task_p->prev;
+                task_p->prev = order;
+                order = task_p;
+            }
+            while ((task_p = order) != NULL) {
+                order = task_p->prev;
+                /* A keyed task still in flight absorbs the new fire */
+                if (task_p->dedup_key) {
+                    task_future_t *future = task_queue_submit(task_queue_p, task_p);
+                    if (future == NULL)
+                        task_drop(task_p);
+                    task_future_release(future);
+                } else if (task_queue_push(task_queue_p, task_p) == -1) {
+                    task_drop(task_p);
+                }
+            }
+            pthread_mutex_lock(&wheel_p->mutex);
+            continue;
+        }
+
+        int64_t ticks = wheel_next(wheel_p);
+        if (ticks < 0) {
+            pthread_cond_wait(&wheel_p->cond, &wheel_p->mutex);
+        } else if (ticks > 0) {
+            uint64_t deadline = wheel_p->now + ticks;
+            struct timespec ts = wheel_p->epoch;
+            ts.tv_sec += deadline / 1000;
+            ts.tv_nsec += (deadline % 1000) * 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&wheel_p->cond, &wheel_p->mutex, &ts);
+        }
+    }
+    pthread_mutex_unlock(&wheel_p->mutex);
+
+    return NULL;
+}
+
+/* Start the wheel thread unless it runs already
+ * Notice: Caller MUST hold the wheel mutex
+ */
+static int wheel_start(timer_wheel_t *wheel_p)
+{
+    if (wheel_p->started)
+        return 0;
+
+    if (pthread_create(&wheel_p->pthread, NULL, (void *(*)(void *))wheel_do, wheel_p) != 0) {
+        err("wheel_start(): Could not create timer thread\n");
+        return -1;
+    }
+    wheel_p->started = 1;
+
+    return 0;
+}
+
+/* Have the wheel thread call monitor every period ticks */
+static int wheel_set_monitor(timer_wheel_t *wheel_p, void (*monitor)(thpool_t *),
+                             unsigned int period)
+{
+    int ret;
+
+    pthread_mutex_lock(&wheel_p->mutex);
+    wheel_p->monitor = monitor;
+    wheel_p->monitor_period = period;
+    wheel_p->monitor_next = wheel_tick(wheel_p) + period;
+    ret = wheel_start(wheel_p);
+    pthread_cond_signal(&wheel_p->cond);
+    pthread_mutex_unlock(&wheel_p->mutex);
+
+    return ret;
+}
+
+/* Arm a new timer for task
+ *
+ * The first fire happens ms milliseconds from now, periodic timers then
+ * fire every period milliseconds.
+ */
+static struct thpool_timer *wheel_schedule(thpool_t *thpool_p, task_t *task,
+                                           unsigned int ms, unsigned int period)
+{
+    timer_wheel_t *wheel_p = &thpool_p->wheel;
+    struct thpool_timer *timer_p;
+
+    if (task == NULL || task->handler == NULL)
+        return NULL;
+
+    timer_p = (struct thpool_timer *)malloc(sizeof(struct thpool_timer));
+    if (timer_p == NULL) {
+        err("thpool_schedule(): Could not allocate memory for timer\n");
+        return NULL;
+    }
+    timer_p->period = period;
+    timer_p->task = task;
+    timer_p->state = TIMER_PENDING;
+    timer_p->refs = 2;              /* caller and wheel */
+    timer_p->wheel = wheel_p;
+
+    pthread_mutex_lock(&wheel_p->mutex);
+    if (wheel_start(wheel_p) == -1) {
+        pthread_mutex_unlock(&wheel_p->mutex);
+        free(timer_p);
+        return NULL;
+    }
+
+    /* Catch up first so the timer is placed relative to the current tick */
+    uint64_t tick = wheel_tick(wheel_p);
+    if (wheel_p->count == 0)
+        wheel_p->now = tick;
+    timer_p->expires = tick + ms;
+    if (timer_p->expires <= wheel_p->now)
+        timer_p->expires = wheel_p->now + 1;
+    wheel_insert(wheel_p, timer_p);
+    wheel_p->count++;
+    pthread_cond_signal(&wheel_p->cond);
+    pthread_mutex_unlock(&wheel_p->mutex);
+
+    return timer_p;
+}
+
+/* Stop the wheel thread and drop all pending timers with their tasks */
+static void wheel_destroy(timer_wheel_t *wheel_p)
+{
+    struct thpool_timer *timer_p, *tmp;
+    int level, slot;
+
+    pthread_mutex_lock(&wheel_p->mutex);
+    wheel_p->keepalive = 0;
+    pthread_cond_signal(&wheel_p->cond);
+    pthread_mutex_unlock(&wheel_p->mutex);
+    if (wheel_p->started)
+        pthread_join(wheel_p->pthread, NULL);
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        for (slot = 0; slot < WHEEL_SIZE; slot++) {
+            list_for_each_entry_safe(timer_p, tmp, &wheel_p->slots[level][slot], list) {
+                list_del(&timer_p->list);
+                task_drop(timer_p->task);
+                free(timer_p);
+            }
+        }
+    }
+    pthread_mutex_destroy(&wheel_p->mutex);
+    pthread_cond_destroy(&wheel_p->cond);
+}
+
+/* Queue task once, ms milliseconds from now */
+thpool_timer_t *thpool_schedule_after(thpool_t *thpool_p, task_t *task, unsigned int ms)
+{
+    return wheel_schedule(thpool_p, task, ms, 0);
+}
+
+/* Queue a copy of task every ms milliseconds, the first one ms from now */
+thpool_timer_t *thpool_schedule_every(thpool_t *thpool_p, task_t *task, unsigned int ms)
+{
+    return wheel_schedule(thpool_p, task, ms, ms > 0 ? ms : 1);
+}
+
+/* Cancel a timer and release the caller's handle
+ *
+ * @return 0 if the timer was still pending, -1 if a one-shot timer already fired
+ */
+int thpool_timer_cancel(thpool_timer_t *timer)
+{
+    timer_wheel_t *wheel_p = timer->wheel;
+    task_t *task_p = NULL;
+
+    pthread_mutex_lock(&wheel_p->mutex);
+    if (timer->state == TIMER_PENDING) {
+        list_del(&timer->list);
+        timer->state = TIMER_CANCELLED;
+        wheel_p->count--;
+        task_p = timer->task;
+        timer->task = NULL;
+        timer->refs--;              /* wheel reference */
+    }
+    timer_put(timer);
+    pthread_mutex_unlock(&wheel_p->mutex);
+
+    /* The cleanup callback may use timers itself */
+    if (task_p == NULL)
+        return -1;
+    task_drop(task_p);
+    return 0;
+}
+
+/* Release the caller's handle, the timer itself keeps running */
+void thpool_timer_release(thpool_timer_t *timer)
+{
+    timer_wheel_t *wheel_p = timer->wheel;
+
+    pthread_mutex_lock(&wheel_p->mutex);
+    timer_put(timer);
+    pthread_mutex_unlock(&wheel_p->mutex);
+}
+
+/* ============================= FUTURE ============================= */
+
+/* CLOCK_MONOTONIC in nanoseconds */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Absolute CLOCK_MONOTONIC deadline timeout_ms from now */
+static void deadline_init(struct timespec *ts, int timeout_ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += timeout_ms / 1000;
+    ts->tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static void monotonic_cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static task_future_t *future_new(void)
+{
+    task_future_t *future = (task_future_t *)malloc(sizeof(task_future_t));
+    if (future == NULL)
+        return NULL;
+
+    pthread_mutex_init(&future->mutex, NULL);
+    monotonic_cond_init(&future->cond);
+    future->status = TASK_STATUS_PENDING;
+    atomic_init(&future->refs, 1);
+    atomic_init(&future->run_state, FUTURE_QUEUED);
+    INIT_LIST_HEAD(&future->waiters);
+    future->key = 0;
+    future->submitters = 1;
+    future->group = NULL;
+    future->dedup_p = NULL;
+    INIT_LIST_HEAD(&future->dedup);
+
+    return future;
+}
+
+static void future_put(task_future_t *future)
+{
+    if (atomic_fetch_sub(&future->refs, 1) == 1) {
+        pthread_mutex_destroy(&future->mutex);
+        pthread_cond_destroy(&future->cond);
+        free(future);
+    }
+}
+
+/* Publish the final status, wake all waiters and drop the task's reference */
+static void future_complete(task_future_t *future, task_status_t status)
+{
+    future_link_t *link;
+
+    /* Later submissions with the key start a new task */
+    if (future->dedup_p) {
+        pthread_mutex_lock(&future->dedup_p->dedup.mutex);
+        list_del_init(&future->dedup);
+        pthread_mutex_unlock(&future->dedup_p->dedup.mutex);
+    }
+
+    pthread_mutex_lock(&future->mutex);
+    future->status = status;
+    pthread_cond_broadcast(&future->cond);
+    list_for_each_entry(link, &future->waiters, list) {
+        pthread_mutex_lock(&link->waiter->mutex);
+        link->waiter->signalled = 1;
+        pthread_cond_signal(&link->waiter->cond);
+        pthread_mutex_unlock(&link->waiter->mutex);
+    }
+    pthread_mutex_unlock(&future->mutex);
+
+    future_put(future);
+}
+
+/* Add (allocated) task to queue and get a handle to wait for its completion
+ *
+ * A task with a dedup_key that matches a queued or running task of the pool
+ * is not queued: its cleanup_cb runs, it is freed, and the handle of the
+ * matching task is returned instead. Only tasks of the same group match, so
+ * task_group_wait() always covers the work a submission attached to.
+ *
+ * @return future to release with task_future_release(), NULL if the task could
+ *         not be queued and still belongs to the caller
+ */
+task_future_t *task_queue_submit(task_queue_t *task_queue_p, task_t *newtask)
+{
+    thpool_t *thpool_p = task_queue_p->thpool_p;
+    dedup_table_t *dedup_p = &thpool_p->dedup;
+    struct list_head *bucket = NULL;
+    task_future_t *future;
+
+    if (newtask->handler == NULL)
+        return NULL;
+
+    if (newtask->dedup_key) {
+        bucket = &dedup_p->buckets[(newtask->dedup_key * 0x9E3779B97F4A7C15ULL) >> (64 - DEDUP_BITS)];
+        pthread_mutex_lock(&dedup_p->mutex);
+        list_for_each_entry(future, bucket, dedup) {
+            if (future->key == newtask->dedup_key && future->group == newtask->group) {
+                atomic_fetch_add(&future->refs, 1);
+                future->submitters++;
+                pthread_mutex_unlock(&dedup_p->mutex);
+                task_discard(newtask, newtask->flags & TASK_F_EMBEDDED, newtask->cleanup_cb,
+                             NULL, NULL);
+                return future;
+            }
+        }
+    }
+
+    future = future_new();
+    if (future == NULL) {
+        if (bucket)
+            pthread_mutex_unlock(&dedup_p->mutex);
+        err("task_queue_submit(): Could not allocate memory for future\n");
+        return NULL;
+    }
+    if (bucket) {
+        future->key = newtask->dedup_key;
+        future->group = newtask->group;
+        future->dedup_p = thpool_p;
+        list_add_tail(&future->dedup, bucket);
+        pthread_mutex_unlock(&dedup_p->mutex);
+    }
+
+    atomic_fetch_add(&future->refs, 1);     /* task reference */
+    newtask->future = future;
+    if (task_queue_push(task_queue_p, newtask) == -1) {
+        newtask->future = NULL;
+        if (bucket) {
+            pthread_mutex_lock(&dedup_p->mutex);
+            list_del_init(&future->dedup);
+            pthread_mutex_unlock(&dedup_p->mutex);
+        }
+        future_put(future);
+        future_put(future);
+        return NULL;
+    }
+
+    return future;
+}
+
+/* Take a task for running, fails once it was cancelled */
+static int future_claim(task_future_t *future)
+{
+    int state = FUTURE_QUEUED;
+
+    if (atomic_compare_exchange_strong(&future->run_state, &state, FUTURE_RUNNING))
+        return 1;
+    /* A resumed coroutine was claimed before */
+    return state == FUTURE_RUNNING;
+}
+
+/* Cancel a task that is still queued
+ *
+ * With other submitters still attached by the dedup key, only the caller's
+ * submission is dropped: the task stays queued and the shared future
+ * completes with it. The last submitter to cancel cancels the task, the
+ * future then completes as cancelled right away. The task stays in the
+ * queue until a worker takes it, the worker then only runs its cleanup_cb.
+ *
+ * @return 0 if the submission was cancelled, -1 if the task already runs or ran
+ */
+int task_cancel(task_future_t *future)
+{
+    dedup_table_t *dedup_p = future->dedup_p ? &future->dedup_p->dedup : NULL;
+    int state = FUTURE_QUEUED;
+
+    /* No submission can attach while the last one cancels */
+    if (dedup_p)
+        pthread_mutex_lock(&dedup_p->mutex);
+    if (atomic_load(&future->run_state) == FUTURE_QUEUED && future->submitters > 1) {
+        future->submitters--;
+        pthread_mutex_unlock(&dedup_p->mutex);
+        return 0;
+    }
+    if (!atomic_compare_exchange_strong(&future->run_state, &state, FUTURE_CANCELLED)) {
+        if (dedup_p)
+            pthread_mutex_unlock(&dedup_p->mutex);
+        return -1;
+    }
+    if (dedup_p) {
+        list_del_init(&future->dedup);
+        pthread_mutex_unlock(&dedup_p->mutex);
+    }
+
+    /* Completes on behalf of the task, which keeps its reference */
+    atomic_fetch_add(&future->refs, 1);
+    future_complete(future, TASK_STATUS_CANCELLED);
+    return 0;
+}
+
+static void dedup_init(dedup_table_t *dedup_p)
+{
+    int n;
+
+    pthread_mutex_init(&dedup_p->mutex, NULL);
+    for (n = 0; n < DEDUP_BUCKETS; n++)
+        INIT_LIST_HEAD(&dedup_p->buckets[n]);
+}
+
+/* Futures outliving the pool must not unlink from the table anymore */
+static void dedup_destroy(dedup_table_t *dedup_p)
+{
+    task_future_t *future, *tmp;
+    int n;
+
+    pthread_mutex_lock(&dedup_p->mutex);
+    for (n = 0; n < DEDUP_BUCKETS; n++) {
+        list_for_each_entry_safe(future, tmp, &dedup_p->buckets[n], dedup) {
+            list_del_init(&future->dedup);
+            future->dedup_p = NULL;
+        }
+    }
+    pthread_mutex_unlock(&dedup_p->mutex);
+    pthread_mutex_destroy(&dedup_p->mutex);
+}
+
+task_status_t task_future_status(task_future_t *future)
+{
+    task_status_t status;
+
+    pthread_mutex_lock(&future->mutex);
+    status = future->status;
+    pthread_mutex_unlock(&future->mutex);
+
+    return status;
+}
+
+void task_future_release(task_future_t *future)
+{
+    if (future)
+        future_put(future);
+}
+
+/* Wait for a task to complete
+ *
+ * @param timeout_ms    milliseconds to wait at most, negative waits forever
+ * @return 0 once the task completed or was dropped, -1 on timeout
+ */
+int task_wait(task_future_t *future, int timeout_ms)
+{
+    struct timespec deadline;
+    int ret = 0;
+
+    if (timeout_ms >= 0)
+        deadline_init(&deadline, timeout_ms);
+
+    pthread_mutex_lock(&future->mutex);
+    while (future->status == TASK_STATUS_PENDING && ret == 0) {
+        if (timeout_ms < 0)
+            pthread_cond_wait(&future->cond, &future->mutex);
+        else
+            ret = pthread_cond_timedwait(&future->cond, &future->mutex, &deadline);
+    }
+    ret = future->status == TASK_STATUS_PENDING ? -1 : 0;
+    pthread_mutex_unlock(&future->mutex);
+
+    return ret;
+}
+
+/* Wait for the first of several tasks to complete
+ *
+ * @return index of a completed task, -1 on timeout
+ */
+int task_wait_any(task_future_t **futures, size_t count, int timeout_ms)
+{
+    future_waiter_t waiter;
+    future_link_t *links;
+    struct timespec deadline;
+    int found = -1, ret = 0;
+    size_t n, registered;
+
+    if (count == 0)
+        return -1;
 
-    pthread_mutex_lock(&task_queue_p->rwmutex);
-    task_t *task_p = task_queue_p->front;
+    links = (future_link_t *)malloc(count * sizeof(future_link_t));
+    if (links == NULL) {
+        err("task_wait_any(): Could not allocate memory for waiters\n");
+        return -1;
+    }
+    if (timeout_ms >= 0)
+        deadline_init(&deadline, timeout_ms);
 
-    switch (task_queue_p->len) {
+    pthread_mutex_init(&waiter.mutex, NULL);
+    monotonic_cond_init(&waiter.cond);
+    waiter.signalled = 0;
 
-    case 0: /* if no tasks in queue */
-        break;
+    /* Link the waiter to each future, unless one is already complete */
+    for (registered = 0; registered < count; registered++) {
+        task_future_t *future = futures[registered];
 
-    case 1: /* if one task in queue */
-        task_queue_p->front = NULL;
-        task_queue_p->rear = NULL;
-        task_queue_p->len = 0;
-        break;
+        pthread_mutex_lock(&future->mutex);
+        if (future->status != TASK_STATUS_PENDING) {
+            pthread_mutex_unlock(&future->mutex);
+            break;
+        }
+        links[registered].waiter = &waiter;
+        list_add_tail(&links[registered].list, &future->waiters);
+        pthread_mutex_unlock(&future->mutex);
+    }
 
-    default: /* if >1 tasks in queue */
-        task_queue_p->front = task_p->prev;
-        task_queue_p->len--;
-        /* more than one task in queue -> post it */
-        bsem_post(task_queue_p->has_tasks);
+    if (registered == count) {
+        pthread_mutex_lock(&waiter.mutex);
+        while (!waiter.signalled && ret == 0) {
+            if (timeout_ms < 0)
+                pthread_cond_wait(&waiter.cond, &waiter.mutex);
+            else
+                ret = pthread_cond_timedwait(&waiter.cond, &waiter.mutex, &deadline);
+        }
+        pthread_mutex_unlock(&waiter.mutex);
     }
 
-    pthread_mutex_unlock(&task_queue_p->rwmutex);
-    return task_p;
+    for (n = 0; n < registered; n++) {
+        pthread_mutex_lock(&futures[n]->mutex);
+        list_del(&links[n].list);
+        pthread_mutex_unlock(&futures[n]->mutex);
+    }
+    for (n = 0; n < count && found < 0; n++) {
+        if (task_future_status(futures[n]) != TASK_STATUS_PENDING)
+            found = (int)n;
+    }
+
+    pthread_mutex_destroy(&waiter.mutex);
+    pthread_cond_destroy(&waiter.cond);
+    free(links);
+
+    return found;
 }
 
-/* Free all queue resources back to the system */
-static void task_queue_destroy(task_queue_t *task_queue_p) 
+/* Wait for all of several tasks to complete
+ *
+ * @return 0 once all tasks completed or were dropped, -1 on timeout
+ */
+int task_wait_all(task_future_t **futures, size_t count, int timeout_ms)
+{
+    struct timespec deadline, now;
+    size_t n;
+
+    if (timeout_ms >= 0)
+        deadline_init(&deadline, timeout_ms);
+
+    for (n = 0; n < count; n++) {
+        int left = -1;
+
+        if (timeout_ms >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long ms = (deadline.tv_sec - now.tv_sec) * 1000 +
+                      (deadline.tv_nsec - now.tv_nsec) / 1000000;
+            left = ms > 0 ? (int)ms : 0;
+        }
+        if (task_wait(futures[n], left) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* =========================== COROUTINE ============================ */
+
+static void reactor_init(thpool_t *thpool_p, reactor_t *reactor_p, size_t stack_size)
+{
+    reactor_p->thpool_p = thpool_p;
+    pthread_mutex_init(&reactor_p->mutex, NULL);
+    reactor_p->started = 0;
+    atomic_init(&reactor_p->keepalive, 1);
+    reactor_p->epfd = -1;
+    reactor_p->wakefd = -1;
+    reactor_p->stack_size = stack_size > 0 ? stack_size : CORO_DEFAULT_STACK;
+    INIT_LIST_HEAD(&reactor_p->parked);
+}
+
+#if defined(__linux__)
+
+/* Run the handler of the coroutine being resumed, then switch back for good */
+static void coro_entry(void)
+{
+    task_coro_t *coro = coro_self;
+
+    coro->task->handler(coro->task);
+    coro->done = 1;
+    setcontext(&coro->caller);
+}
+
+static task_coro_t *coro_new(reactor_t *reactor_p, task_t *task_p)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (reactor_p->stack_size + page - 1) / page * page + page;
+    task_coro_t *volatile coro;     /* getcontext() returns twice, like setjmp() */
+
+    coro = (task_coro_t *)malloc(sizeof(task_coro_t));
+    if (coro == NULL)
+        return NULL;
+    coro->stack = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (coro->stack == MAP_FAILED) {
+        free(coro);
+        return NULL;
+    }
+    /* Overflowing the stack faults instead of corrupting the heap */
+    mprotect(coro->stack, page, PROT_NONE);
+    coro->stack_size = size;
+    coro->task = task_p;
+    coro->done = 0;
+    coro->wait_fd = -1;
+    coro->reg_fd = -1;
+    INIT_LIST_HEAD(&coro->list);
+
+    getcontext(&coro->ctx);
+    coro->ctx.uc_stack.ss_sp = coro->stack;
+    coro->ctx.uc_stack.ss_size = size;
+    coro->ctx.uc_link = NULL;
+    makecontext(&coro->ctx, coro_entry, 0);
+
+    return coro;
+}
+
+static void coro_free(task_t *task_p)
+{
+    task_coro_t *coro = task_p->coro;
+
+    munmap(coro->stack, coro->stack_size);
+    free(coro);
+    task_p->coro = NULL;
+}
+
+static void *reactor_do(reactor_t *reactor_p);
+
+/* Start the reactor thread with the first await
+ * Notice: Caller MUST hold the reactor mutex
+ */
+static int reactor_start(reactor_t *reactor_p)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+
+    if (reactor_p->started)
+        return 0;
+
+    reactor_p->epfd = epoll_create1(EPOLL_CLOEXEC);
+    reactor_p->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor_p->epfd < 0 || reactor_p->wakefd < 0 ||
+        epoll_ctl(reactor_p->epfd, EPOLL_CTL_ADD, reactor_p->wakefd, &ev) != 0) {
+        err("reactor_start(): Could not create epoll instance\n");
+        goto fail;
+    }
+    if (pthread_create(&reactor_p->pthread, NULL, (void *(*)(void *))reactor_do, reactor_p) != 0) {
+        err("reactor_start(): Could not create reactor thread\n");
+        goto fail;
+    }
+    reactor_p->started = 1;
+    return 0;
+
+fail:
+    if (reactor_p->epfd >= 0)
+        close(reactor_p->epfd);
+    if (reactor_p->wakefd >= 0)
+        close(reactor_p->wakefd);
+    reactor_p->epfd = reactor_p->wakefd = -1;
+    return -1;
+}
+
+/* Watch the fd a coroutine awaits
+ *
+ * @return 0 once parked, -1 if the fd cannot be watched, revents is set and
+ *         the task must be queued again right away
+ */
+static int reactor_park(reactor_t *reactor_p, task_coro_t *coro)
+{
+    struct epoll_event ev = { .events = coro->events | EPOLLONESHOT, .data.ptr = coro };
+    int ret = -1;
+
+    pthread_mutex_lock(&reactor_p->mutex);
+    if (atomic_load(&reactor_p->keepalive) && reactor_start(reactor_p) == 0) {
+        list_add_tail(&coro->list, &reactor_p->parked);
+        coro->reg_fd = coro->wait_fd;
+        ret = epoll_ctl(reactor_p->epfd, EPOLL_CTL_ADD, coro->reg_fd, &ev);
+        /* Another coroutine awaits the same fd, watch a duplicate of it */
+        if (ret != 0 && errno == EEXIST) {
+            coro->reg_fd = fcntl(coro->wait_fd, F_DUPFD_CLOEXEC, 0);
+            ret = coro->reg_fd < 0 ? -1 : epoll_ctl(reactor_p->epfd, EPOLL_CTL_ADD, coro->reg_fd, &ev);
+        }
+        if (ret != 0) {
+            /* Regular files cannot be watched and are always ready */
+            coro->revents = errno == EPERM ? (int)coro->events : -1;
+            if (coro->reg_fd >= 0 && coro->reg_fd != coro->wait_fd)
+                close(coro->reg_fd);
+            coro->reg_fd = -1;
+            list_del_init(&coro->list);
+        }
+    } else {
+        coro->revents = -1;
+    }
+    pthread_mutex_unlock(&reactor_p->mutex);
+
+    return ret == 0 ? 0 : -1;
+}
+
+/* Queue coroutines again whose fd became ready */
+static void *reactor_do(reactor_t *reactor_p)
+{
+    task_queue_t *task_queue_p = &reactor_p->thpool_p->task_queue;
+    struct epoll_event events[REACTOR_EVENTS];
+    int n, count;
+
+    prctl(PR_SET_NAME, "thpool-reactor");
+
+    while (atomic_load(&reactor_p->keepalive)) {
+        count = epoll_wait(reactor_p->epfd, events, REACTOR_EVENTS, -1);
+        for (n = 0; n < count; n++) {
+            task_coro_t *coro = events[n].data.ptr;
+            if (coro == NULL)
+                continue;
+
+            pthread_mutex_lock(&reactor_p->mutex);
+            epoll_ctl(reactor_p->epfd, EPOLL_CTL_DEL, coro->reg_fd, NULL);
+            if (coro->reg_fd != coro->wait_fd)
+                close(coro->reg_fd);
+            coro->reg_fd = -1;
+            coro->revents = (int)(events[n].events & (EPOLLIN | EPOLLOUT | EPOLLPRI |
+                                                      EPOLLERR | EPOLLHUP));
+            list_del_init(&coro->list);
+            pthread_mutex_unlock(&reactor_p->mutex);
+
+            if (task_queue_requeue(task_queue_p, coro->task) == -1)
+                task_drop(coro->task);
+        }
+    }
+    return NULL;
+}
+
+/* Switch to a coroutine task until it returns or awaits
+ *
+ * The first resume sets the coroutine up, if that fails the handler runs
+ * on the worker's stack like a plain task.
+ *
+ * @return 1 once the handler returned, 0 if the task was parked and belongs
+ *         to the reactor now
+ */
+static int coro_resume(thpool_t *thpool_p, task_t *task_p)
+{
+    task_coro_t *coro = task_p->coro;
+
+    if (coro == NULL) {
+        coro = coro_new(&thpool_p->reactor, task_p);
+        if (coro == NULL) {
+            err("coro_resume(): Could not allocate coroutine, running inline\n");
+            if (task_p->handler)
+                task_p->handler(task_p);
+            return 1;
+        }
+        task_p->coro = coro;
+    }
+
+    for (;;) {
+        coro->wait_fd = -1;
+        coro_self = coro;
+        swapcontext(&coro->caller, &coro->ctx);
+        coro_self = NULL;
+
+        if (coro->done) {
+            coro_free(task_p);
+            return 1;
+        }
+        if (reactor_park(&thpool_p->reactor, coro) == 0)
+            return 0;
+        /* Not watchable, resume it with revents set by reactor_park() */
+    }
+}
+
+/* Stop the reactor, parked coroutines are dropped without resuming them */
+static void reactor_destroy(reactor_t *reactor_p)
+{
+    task_coro_t *coro, *tmp;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&reactor_p->mutex);
+    atomic_store(&reactor_p->keepalive, 0);
+    pthread_mutex_unlock(&reactor_p->mutex);
+    if (reactor_p->started) {
+        if (write(reactor_p->wakefd, &one, sizeof(one)) < 0)
+            err("reactor_destroy(): Could not wake reactor\n");
+        pthread_join(reactor_p->pthread, NULL);
+    }
+
+    list_for_each_entry_safe(coro, tmp, &reactor_p->parked, list) {
+        list_del(&coro->list);
+        if (coro->reg_fd >= 0 && coro->reg_fd != coro->wait_fd)
+            close(coro->reg_fd);
+        task_drop(coro->task);
+    }
+    if (reactor_p->started) {
+        close(reactor_p->epfd);
+        close(reactor_p->wakefd);
+    }
+    pthread_mutex_destroy(&reactor_p->mutex);
+}
+
+/* Wait for events on an fd, yielding the worker in a coroutine task
+ *
+ * Outside of a coroutine this blocks in poll(). A coroutine may continue on
+ * another worker, so errno and other thread locals read before the await
+ * are not to be trusted after it.
+ *
+ * @param events        POLLIN, POLLOUT or POLLPRI
+ * @return the POLL* events ready, -1 on error
+ */
+int task_await_fd(int fd, int events)
+{
+    task_coro_t *coro = coro_self;
+
+    if (coro == NULL) {
+        struct pollfd pfd = { .fd = fd, .events = (short)events, .revents = 0 };
+        int ret;
+
+        while ((ret = poll(&pfd, 1, -1)) < 0 && errno == EINTR)
+            ;
+        return ret < 0 ? -1 : pfd.revents;
+    }
+
+    coro->wait_fd = fd;
+    coro->events = (unsigned int)events;
+    swapcontext(&coro->ctx, &coro->caller);
+
+    return coro->revents;
+}
+
+/* Wait for a child to exit and reap it, yielding in a coroutine task
+ *
+ * Uses a pidfd, on kernels without pidfd_open() it blocks in waitpid().
+ *
+ * @param status        as set by waitpid(), may be NULL
+ * @return 0 on success, -1 on error
+ */
+int task_await_child(pid_t pid, int *status)
+{
+#if defined(SYS_pidfd_open)
+    int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd >= 0) {
+        task_await_fd(pidfd, POLLIN);
+        close(pidfd);
+    }
+#endif
+    while (waitpid(pid, status, 0) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+#else
+
+static int coro_resume(thpool_t *thpool_p, task_t *task_p)
+{
+    if (task_p->handler)
+        task_p->handler(task_p);
+    return 1;
+}
+
+static void coro_free(task_t *task_p)
+{
+    task_p->coro = NULL;
+}
+
+static void reactor_destroy(reactor_t *reactor_p)
+{
+    pthread_mutex_destroy(&reactor_p->mutex);
+}
+
+int task_await_fd(int fd, int events)
+{
+    struct pollfd pfd = { .fd = fd, .events = (short)events, .revents = 0 };
+    int ret;
+
+    while ((ret = poll(&pfd, 1, -1)) < 0 && errno == EINTR)
+        ;
+    return ret < 0 ? -1 : pfd.revents;
+}
+
+int task_await_child(pid_t pid, int *status)
+{
+    while (waitpid(pid, status, 0) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+#endif
+
+/* =========================== COMPLETION =========================== */
+
+static void completion_init(completion_queue_t *completion_p)
+{
+    pthread_mutex_init(&completion_p->mutex, NULL);
+    completion_p->head = NULL;
+    completion_p->tail = NULL;
+    atomic_init(&completion_p->fd, -1);
+}
+
+/* Queue a task whose handler returned for thpool_completion_drain()
+ *
+ * @return 0 if queued, -1 if nobody asked for the completion fd, the
+ *         worker then runs the callbacks itself
+ */
+static int completion_push(completion_queue_t *completion_p, task_t *task_p)
+{
+    int fd = atomic_load(&completion_p->fd);
+    uint64_t one = 1;
+
+    if (fd < 0)
+        return -1;
+
+    task_p->prev = NULL;
+    pthread_mutex_lock(&completion_p->mutex);
+    if (completion_p->tail)
+        completion_p->tail->prev = task_p;
+    else
+        completion_p->head = task_p;
+    completion_p->tail = task_p;
+    pthread_mutex_unlock(&completion_p->mutex);
+
+    /* Can only fail once the counter is near overflow, still readable then */
+    if (write(fd, &one, sizeof(one)) < 0) {
+        err("completion_push(): Could not signal eventfd\n");
+    }
+    return 0;
+}
+
+/* Pollable fd that is readable while deferred tasks wait to be drained
+ *
+ * Created on the first call, before that TASK_F_DEFERRED tasks complete on
+ * the worker as usual. thpool_wait() returns once the handlers ran, not
+ * the deferred callbacks. The pool owns the fd, thpool_destroy() completes
+ * what is left on the calling thread and closes it.
+ *
+ * @return the fd, -1 on error
+ */
+int thpool_completion_fd(thpool_t *thpool_p)
+{
+    completion_queue_t *completion_p = &thpool_p->completion;
+    int fd;
+
+    pthread_mutex_lock(&completion_p->mutex);
+    fd = atomic_load(&completion_p->fd);
+#if defined(__linux__)
+    if (fd < 0) {
+        fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd < 0)
+            err("thpool_completion_fd(): Could not create eventfd\n");
+        else
+            atomic_store(&completion_p->fd, fd);
+    }
+#else
+    if (fd < 0)
+        err("thpool_completion_fd(): eventfd is not supported on this system\n");
+#endif
+    pthread_mutex_unlock(&completion_p->mutex);
+
+    return fd;
+}
+
+/* Run result_cb, cleanup_cb and the future of finished deferred tasks
+ *
+ * Runs on the calling thread, in completion order. Call it when the
+ * completion fd polls readable, it is reset here.
+ *
+ * @param max           tasks to complete at most, 0 for all
+ * @return number of tasks completed
+ */
+int thpool_completion_drain(thpool_t *thpool_p, int max)
+{
+    completion_queue_t *completion_p = &thpool_p->completion;
+    int fd = atomic_load(&completion_p->fd);
+    uint64_t count;
+    int n = 0;
+
+    /* Reset before taking tasks, so a task queued after this wakes the poller */
+    if (fd >= 0 && read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        err("thpool_completion_drain(): Could not read eventfd\n");
+
+    while (max <= 0 || n < max) {
+        pthread_mutex_lock(&completion_p->mutex);
+        task_t *task_p = completion_p->head;
+        if (task_p) {
+            completion_p->head = task_p->prev;
+            if (completion_p->head == NULL)
+                completion_p->tail = NULL;
+        }
+        pthread_mutex_unlock(&completion_p->mutex);
+        if (task_p == NULL)
+            break;
+
+        task_finish(task_p, task_p->flags & TASK_F_EMBEDDED, task_p->result_cb,
+                    task_p->cleanup_cb, task_p->future,
+                    task_p->flags & TASK_F_GROUPED ? task_p->group : NULL);
+        n++;
+    }
+
+    /* Leftovers keep the fd readable */
+    if (max > 0 && n == max && fd >= 0) {
+        pthread_mutex_lock(&completion_p->mutex);
+        int more = completion_p->head != NULL;
+        pthread_mutex_unlock(&completion_p->mutex);
+        count = 1;
+        if (more && write(fd, &count, sizeof(count)) < 0)
+            err("thpool_completion_drain(): Could not signal eventfd\n");
+    }
+    return n;
+}
+
+/* Complete what was never drained on the destroying thread, close the fd */
+static void completion_destroy(thpool_t *thpool_p)
+{
+    completion_queue_t *completion_p = &thpool_p->completion;
+    int fd;
+
+    thpool_completion_drain(thpool_p, 0);
+    fd = atomic_load(&completion_p->fd);
+    if (fd >= 0)
+        close(fd);
+    pthread_mutex_destroy(&completion_p->mutex);
+}
+
+/* ============================== GROUP ============================= */
+
+task_group_t *task_group_new(void)
+{
+    task_group_t *group = (task_group_t *)malloc(sizeof(task_group_t));
+    if (group == NULL) {
+        err("task_group_new(): Could not allocate memory for task group\n");
+        return NULL;
+    }
+
+    pthread_mutex_init(&group->mutex, NULL);
+    monotonic_cond_init(&group->cond);
+    atomic_init(&group->pending, 0);
+    atomic_init(&group->submitted, 0);
+    atomic_init(&group->completed, 0);
+    atomic_init(&group->cancelled, 0);
+
+    return group;
+}
+
+/* Free a group, none of its tasks may be pending anymore */
+void task_group_free(task_group_t *group)
+{
+    if (group == NULL)
+        return;
+    pthread_mutex_destroy(&group->mutex);
+    pthread_cond_destroy(&group->cond);
+    free(group);
+}
+
+/* Count a task that is about to be queued in its group
+ *
+ * @return 1 if the task has a group, 0 otherwise
+ */
+static int task_group_enter(task_t *task_p)
 {
-    task_queue_clear(task_queue_p);
-    free(task_queue_p->has_tasks);
+    task_p->flags &= ~TASK_F_GROUPED;
+    if (task_p->group == NULL)
+        return 0;
+
+    task_p->flags |= TASK_F_GROUPED;
+    atomic_fetch_add(&task_p->group->pending, 1);
+    atomic_fetch_add_explicit(&task_p->group->submitted, 1, memory_order_relaxed);
+    return 1;
 }
 
-/* ======================== SYNCHRONISATION ========================= */
+/* Account for a task of the group that is done with
+ *
+ * @param cancelled     1 if dropped or cancelled, -1 if it was never queued
+ */
+static void task_group_leave(task_group_t *group, int cancelled)
+{
+    if (cancelled > 0)
+        atomic_fetch_add_explicit(&group->cancelled, 1, memory_order_relaxed);
+    else if (cancelled == 0)
+        atomic_fetch_add_explicit(&group->completed, 1, memory_order_relaxed);
+    else
+        atomic_fetch_sub_explicit(&group->submitted, 1, memory_order_relaxed);
+
+    /* Others only count down, the group stays alive while any is left */
+    long pending = atomic_load(&group->pending);
+    while (pending > 1) {
+        if (atomic_compare_exchange_weak(&group->pending, &pending, pending - 1))
+            return;
+    }
+
+    /* A waiter that sees 0 may free the group right away, so the last one
+     * counts down and broadcasts under the mutex the waiter checks with */
+    pthread_mutex_lock(&group->mutex);
+    if (atomic_fetch_sub(&group->pending, 1) == 1)
+        pthread_cond_broadcast(&group->cond);
+    pthread_mutex_unlock(&group->mutex);
+}
 
-/* Init semaphore to 1 or 0 */
-static void bsem_init(bsem *bsem_p, int value) 
+/* Wait until every task of the group completed, other tasks of the pool
+ * are not waited for
+ *
+ * Callbacks of TASK_F_DEFERRED tasks count, they must be drained meanwhile.
+ *
+ * @param timeout_ms    milliseconds to wait at most, negative waits forever
+ * @return 0 once the group is idle, -1 on timeout
+ */
+int task_group_wait(task_group_t *group, int timeout_ms)
 {
-    if (value < 0 || value > 1) {
-        err("bsem_init(): Binary semaphore can take only values 1 or 0");
-        exit(1);
+    struct timespec deadline;
+    int ret = 0;
+
+    /* No lock-free shortcut, the last task may still hold the mutex */
+    if (timeout_ms >= 0)
+        deadline_init(&deadline, timeout_ms);
+
+    pthread_mutex_lock(&group->mutex);
+    while (atomic_load(&group->pending) > 0 && ret == 0) {
+        if (timeout_ms < 0)
+            pthread_cond_wait(&group->cond, &group->mutex);
+        else if (pthread_cond_timedwait(&group->cond, &group->mutex, &deadline) == ETIMEDOUT)
+            ret = atomic_load(&group->pending) > 0 ? -1 : 0;
     }
-    pthread_mutex_init(&(bsem_p->mutex), NULL);
-    pthread_cond_init(&(bsem_p->cond), NULL);
-    bsem_p->v = value;
+    pthread_mutex_unlock(&group->mutex);
+
+    return ret;
 }
 
-/* Reset semaphore to 0 */
-static void bsem_reset(bsem *bsem_p) 
+/* Read the group's counters, racy while tasks complete */
+void task_group_stats(task_group_t *group, task_group_stats_t *stats)
 {
-    bsem_init(bsem_p, 0);
+    stats->submitted = atomic_load_explicit(&group->submitted, memory_order_relaxed);
+    stats->completed = atomic_load_explicit(&group->completed, memory_order_relaxed);
+    stats->cancelled = atomic_load_explicit(&group->cancelled, memory_order_relaxed);
+    stats->pending = atomic_load(&group->pending);
 }
 
-/* Post to at least one thread */
-static void bsem_post(bsem *bsem_p) 
+/* ============================== RING ============================== */
+
+/* Initialize ring, capacity is rounded up to a power of 2 */
+static int ring_init(ring_t *ring_p, size_t capacity)
 {
-    pthread_mutex_lock(&bsem_p->mutex);
-    bsem_p->v = 1;
-    pthread_cond_signal(&bsem_p->cond);
-    pthread_mutex_unlock(&bsem_p->mutex);
+    size_t cap = 2, n;
+
+    /* Rounding up must neither wrap nor overflow the allocation size */
+    if (capacity > SIZE_MAX / 2 / sizeof(ring_cell_t))
+        return -1;
+    while (cap < capacity)
+        cap <<= 1;
+
+    ring_p->cells = (ring_cell_t *)malloc(cap * sizeof(ring_cell_t));
+    if (ring_p->cells == NULL)
+        return -1;
+
+    for (n = 0; n < cap; n++)
+        atomic_init(&ring_p->cells[n].seq, n);
+    ring_p->mask = cap - 1;
+    atomic_init(&ring_p->enqueue_pos, 0);
+    atomic_init(&ring_p->dequeue_pos, 0);
+
+    return 0;
 }
 
-/* Post to all threads */
-static void bsem_post_all(bsem *bsem_p) 
+/* Push task, -1 if the ring is full */
+static int ring_push(ring_t *ring_p, task_t *task_p)
 {
-    pthread_mutex_lock(&bsem_p->mutex);
-    bsem_p->v = 1;
-    pthread_cond_broadcast(&bsem_p->cond);
-    pthread_mutex_unlock(&bsem_p->mutex);
+    ring_cell_t *cell;
+    size_t pos = atomic_load_explicit(&ring_p->enqueue_pos, memory_order_relaxed);
+
+    for (;;) {
+        cell = &ring_p->cells[pos & ring_p->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring_p->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&ring_p->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    cell->task = task_p;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+    return 0;
 }
 
-/* Wait on semaphore until semaphore has value 0 */
-static void bsem_wait(bsem *bsem_p) 
+/* Pop the oldest task, NULL if the ring is empty */
+static task_t *ring_pop(ring_t *ring_p)
 {
-    pthread_mutex_lock(&bsem_p->mutex);
-    while (bsem_p->v != 1) {
-        pthread_cond_wait(&bsem_p->cond, &bsem_p->mutex);
+    ring_cell_t *cell;
+    task_t *task_p;
+    size_t pos = atomic_load_explicit(&ring_p->dequeue_pos, memory_order_relaxed);
+
+    for (;;) {
+        cell = &ring_p->cells[pos & ring_p->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring_p->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&ring_p->dequeue_pos, memory_order_relaxed);
+        }
     }
-    bsem_p->v = 0;
-    pthread_mutex_unlock(&bsem_p->mutex);
+
+    task_p = cell->task;
+    atomic_store_explicit(&cell->seq, pos + ring_p->mask + 1, memory_order_release);
+
+    return task_p;
+}
+
+/* Free ring resources, tasks still queued must have been cleared */
+static void ring_destroy(ring_t *ring_p)
+{
+    free(ring_p->cells);
 }
 
 /* ======================== JOB ========================= */
@@ -502,6 +3401,134 @@ task_t *task_init(void)
     newtask->handler = NULL;
     newtask->result_cb = NULL;
     newtask->cleanup_cb = NULL;
+    newtask->priority = TASK_PRIO_NORMAL;
+    newtask->future = NULL;
+    newtask->flags = 0;
+    newtask->owner = NULL;
+    newtask->coro = NULL;
+    newtask->dedup_key = 0;
+    newtask->group = NULL;
+
+    return newtask;
+}
+
+/* Get a task from the pool's slab, the task must be pushed to that pool */
+task_t *thpool_task_init(thpool_t *thpool_p)
+{
+    task_t *newtask = slab_alloc(thpool_p);
+    if (newtask == NULL)
+        return NULL;
+
+    newtask->handler = NULL;
+    newtask->result_cb = NULL;
+    newtask->cleanup_cb = NULL;
+    newtask->priority = TASK_PRIO_NORMAL;
+    newtask->future = NULL;
+    newtask->coro = NULL;
+    newtask->dedup_key = 0;
+    newtask->group = NULL;
 
     return newtask;
+}
+
+/* Prepare a task embedded in caller-owned memory
+ *
+ * The pool never frees such a task and does not touch it anymore once its
+ * last callback has returned, so that callback may release the enclosing
+ * struct.
+ */
+void task_init_embedded(task_t *task)
+{
+    task->handler = NULL;
+    task->result_cb = NULL;
+    task->cleanup_cb = NULL;
+    task->priority = TASK_PRIO_NORMAL;
+    task->future = NULL;
+    task->flags = TASK_F_EMBEDDED;
+    task->owner = NULL;
+    task->coro = NULL;
+    task->dedup_key = 0;
+    task->group = NULL;
+}
+
+/* Give a task back to where it came from */
+static void task_release(task_t *task_p)
+{
+    if (task_p->flags & TASK_F_SLAB)
+        slab_free(task_p->owner, task_p);
+    else
+        free(task_p);
+}
+
+/* Run the callbacks of a task whose handler has returned, then release it
+ *
+ * The caller reads the task's fields before the handler runs, an embedded
+ * task may be gone once its last callback returned.
+ */
+static void task_finish(task_t *task_p, int embedded, task_handler_t result_cb,
+                        task_handler_t cleanup_cb, task_future_t *future,
+                        task_group_t *group)
+{
+    if (result_cb) {
+        result_cb(task_p);
+    }
+    if (cleanup_cb) {
+        cleanup_cb(task_p);
+    }
+    if (future) {
+        future_complete(future, TASK_STATUS_DONE);
+    }
+    if (!embedded)
+        task_release(task_p);
+    if (group)
+        task_group_leave(group, 0);
+}
+
+/* Discard a task that will never run
+ *
+ * cleanup_cb still runs so the task's resources are not leaked, and its
+ * future completes as cancelled.
+ */
+static void task_drop(task_t *task_p)
+{
+    int embedded = task_p->flags & TASK_F_EMBEDDED;
+    task_future_t *future = task_p->future;
+    task_group_t *group = task_p->flags & TASK_F_GROUPED ? task_p->group : NULL;
+
+    if (task_p->coro)
+        coro_free(task_p);
+    if (task_p->cleanup_cb)
+        task_p->cleanup_cb(task_p);
+    if (future)
+        future_complete(future, TASK_STATUS_CANCELLED);
+    if (!embedded)
+        task_release(task_p);
+    if (group)
+        task_group_leave(group, 1);
+}
+
+/* Release a task that will not run, without completing its future
+ *
+ * For a cancelled task, whose future task_cancel() completed already, and
+ * for a duplicate that never got one.
+ */
+static void task_discard(task_t *task_p, int embedded, task_handler_t cleanup_cb,
+                         task_future_t *future, task_group_t *group)
+{
+    if (cleanup_cb)
+        cleanup_cb(task_p);
+    if (future)
+        future_put(future);
+    if (!embedded)
+        task_release(task_p);
+    if (group)
+        task_group_leave(group, 1);
+}
+
+/* Free a task that was not (or could not be) queued */
+void task_free(task_t *task)
+{
+    if (task == NULL || (task->flags & TASK_F_EMBEDDED))
+        return;
+    task_release(task);
 }
\ No newline at end of file
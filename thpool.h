@@ -8,35 +8,214 @@ extern "C" {
 /* =================================== API ======================================= */
 
 
+#include <stddef.h>
+#include <sys/types.h>
+
 typedef struct thpool_ thpool_t;
 typedef struct task_queue task_queue_t;
 
+/* Where queued tasks are stored */
+typedef enum {
+    THPOOL_QUEUE_DEQUE = 0,     /* per-worker work-stealing deques, unbounded */
+    THPOOL_QUEUE_RING,          /* shared lock-free MPMC ring, bounded        */
+} thpool_queue_type_t;
+
+/* Set of cpus a worker may run on, see thpool_cpuset_add() */
+#define THPOOL_CPUSET_MAX   1024
+#define THPOOL_CPUSET_BITS  (8 * sizeof(unsigned long))
+typedef struct thpool_cpuset {
+    unsigned long bits[THPOOL_CPUSET_MAX / (8 * sizeof(unsigned long))];
+} thpool_cpuset_t;
+
+#define THPOOL_SCHED_INHERIT (-1)   /* keep the creator's scheduling */
+
+typedef struct thpool_options {
+    int num_threads;
+    thpool_queue_type_t queue_type;
+    size_t queue_capacity;      /* ring size, rounded up to a power of 2 */
+    size_t task_slab_max;       /* tasks in the slab before falling back to malloc */
+    int background_max_threads; /* workers allowed on background tasks, 0 for all */
+    int max_threads;            /* grow up to this, > num_threads makes the pool elastic */
+    unsigned int grow_wait_ms;  /* queue wait that makes an elastic pool grow */
+    unsigned int idle_timeout_ms; /* idle time before a worker above num_threads retires */
+    const thpool_cpuset_t *cpusets; /* worker n runs on cpusets[n % num_cpusets], NULL for any */
+    int num_cpusets;
+    size_t stack_size;          /* worker stack, 0 for the system default */
+    int sched_policy;           /* SCHED_* or THPOOL_SCHED_INHERIT */
+    int sched_priority;         /* for SCHED_FIFO and SCHED_RR */
+    int collect_stats;          /* time every task for thpool_stats_snapshot() */
+    size_t coroutine_stack_size; /* stack of each TASK_F_COROUTINE task */
+} thpool_options_t;
+
+typedef struct thpool_resize_stats {
+    int num_threads;            /* workers running now             */
+    int min_threads;
+    int max_threads;
+    int peak_threads;           /* most workers running at once    */
+    unsigned long grown;        /* workers started after init      */
+    unsigned long shrunk;       /* workers retired after idling    */
+} thpool_resize_stats_t;
+
+typedef struct thpool_worker_info {
+    int id;                     /* slot, as in the thread name     */
+    int running;                /* a worker runs in the slot       */
+    int cpu;                    /* last cpu seen, -1 if never ran  */
+    int node;                   /* NUMA node of that cpu           */
+    int pinned;                 /* started with a cpu set          */
+    unsigned long migrations;   /* cpu changes seen between tasks  */
+} thpool_worker_info_t;
+
+typedef struct thpool_latency {
+    unsigned long count;        /* samples                         */
+    unsigned long long p50_ns;  /* within 1/8 of the true value    */
+    unsigned long long p99_ns;
+    unsigned long long max_ns;  /* exact                           */
+} thpool_latency_t;
+
+typedef struct thpool_stats {
+    int id;                     /* worker slot, -1 for the pool    */
+    unsigned long tasks;        /* tasks run                       */
+    unsigned long long busy_ns; /* running tasks                   */
+    unsigned long long idle_ns; /* looking for or waiting on tasks */
+    thpool_latency_t wait;      /* queued until started            */
+    thpool_latency_t run;       /* handler and callbacks           */
+} thpool_stats_t;
+
+typedef struct thpool_task_stats {
+    unsigned long slab_hits;        /* tasks served by the slab            */
+    unsigned long fallback_allocs;  /* tasks malloc'ed, slab exhausted      */
+    size_t slab_capacity;           /* tasks carved out of slab chunks     */
+} thpool_task_stats_t;
+
+void thpool_options_init(thpool_options_t *opts);
 thpool_t* thpool_init(int num_threads);
+thpool_t* thpool_init_opts(const thpool_options_t *opts);
 void thpool_wait(thpool_t*);
 void thpool_pause(thpool_t*);
 void thpool_resume(thpool_t*);
 void thpool_destroy(thpool_t*);
 int thpool_num_threads_working(thpool_t*);
 task_queue_t* thpool_taskqueue(thpool_t *thpool_p);
+void thpool_task_stats(thpool_t *thpool_p, thpool_task_stats_t *stats);
+void thpool_resize_stats(thpool_t *thpool_p, thpool_resize_stats_t *stats);
+int thpool_worker_placement(thpool_t *thpool_p, thpool_worker_info_t *info, int max);
+int thpool_stats_snapshot(thpool_t *thpool_p, thpool_stats_t *total,
+                          thpool_stats_t *workers, int max_workers);
+
+void thpool_cpuset_zero(thpool_cpuset_t *set);
+int thpool_cpuset_add(thpool_cpuset_t *set, int cpu);
+int thpool_cpuset_isset(const thpool_cpuset_t *set, int cpu);
+int thpool_cpuset_add_node(thpool_cpuset_t *set, int node);
 
 /* Task */
+typedef enum {
+    TASK_PRIO_HIGH = 0,         /* interactive operations, e.g. connect */
+    TASK_PRIO_NORMAL,           /* default                              */
+    TASK_PRIO_BACKGROUND,       /* bulk work, e.g. periodic scans       */
+    TASK_PRIO_MAX,
+} task_prio_t;
+
+typedef enum {
+    TASK_STATUS_PENDING = 0,    /* queued or running                  */
+    TASK_STATUS_DONE,           /* handler and callbacks have run     */
+    TASK_STATUS_CANCELLED,      /* dropped before it could run        */
+} task_status_t;
+
 typedef struct task task_t;
+typedef struct task_future task_future_t;
+typedef struct task_group task_group_t;
 typedef void (*task_handler_t)(task_t* task);
 struct task
 {
     struct task *prev;           /* pointer to previous task   */
  
     task_handler_t handler;
-    task_handler_t result_cb;
-    task_handler_t cleanup_cb;
+    task_handler_t result_cb;    /* run after handler              */
+    task_handler_t cleanup_cb;   /* run last, even if dropped      */
 
     void *user_data;
 
+    task_prio_t priority;        /* lane the task is queued in     */
+    task_future_t *future;       /* set by task_queue_submit()     */
+    unsigned long long enqueue_ns; /* when the task was queued     */
+    unsigned int flags;          /* TASK_F_*                       */
+    thpool_t *owner;             /* pool of a slab task            */
+    struct task_coro *coro;      /* private, set while suspended   */
+    unsigned long long dedup_key; /* task_queue_submit() attaches to
+                                     an in-flight task with the same
+                                     key and group, 0 for none. All
+                                     attached submitters share one
+                                     future, task_cancel() it once
+                                     per submission: the task is
+                                     cancelled with the last one   */
+    task_group_t *group;         /* counted in it while queued     */
 };
 
+#define TASK_F_SLAB     (1u << 0)  /* from thpool_task_init()    */
+#define TASK_F_EMBEDDED (1u << 1)  /* from task_init_embedded()  */
+#define TASK_F_DEFERRED (1u << 2)  /* set by the caller: result_cb and
+                                      cleanup_cb run in
+                                      thpool_completion_drain()   */
+#define TASK_F_COROUTINE (1u << 3) /* set by the caller: handler runs
+                                      on its own stack and may
+                                      task_await_*()              */
+
 task_t* task_init(void);
+task_t* thpool_task_init(thpool_t *thpool_p);
+void task_init_embedded(task_t *task);
+void task_free(task_t *task);
 int task_queue_push(task_queue_t *task_queue_p, task_t* newtask);
+int task_queue_push_prio(task_queue_t *task_queue_p, task_t* newtask, task_prio_t prio);
+size_t task_queue_push_batch(task_queue_t *task_queue_p, task_t **tasks, size_t count);
+
+/* Completion */
+task_future_t* task_queue_submit(task_queue_t *task_queue_p, task_t *newtask);
+int task_cancel(task_future_t *future);
+task_status_t task_future_status(task_future_t *future);
+void task_future_release(task_future_t *future);
+int task_wait(task_future_t *future, int timeout_ms);
+int task_wait_any(task_future_t **futures, size_t count, int timeout_ms);
+int task_wait_all(task_future_t **futures, size_t count, int timeout_ms);
+int thpool_completion_fd(thpool_t *thpool_p);
+int thpool_completion_drain(thpool_t *thpool_p, int max);
+
+/* Group
+ *
+ * Set task->group before queueing, then wait for just those tasks.
+ */
+typedef struct task_group_stats {
+    unsigned long submitted;
+    unsigned long completed;        /* handler and callbacks ran   */
+    unsigned long cancelled;        /* dropped or cancelled        */
+    long pending;
+} task_group_stats_t;
+
+task_group_t* task_group_new(void);
+void task_group_free(task_group_t *group);
+int task_group_wait(task_group_t *group, int timeout_ms);
+void task_group_stats(task_group_t *group, task_group_stats_t *stats);
+
+/* Coroutine
+ *
+ * In a TASK_F_COROUTINE handler these give the worker to other tasks until
+ * the fd is ready or the child exited, anywhere else they block.
+ */
+int task_await_fd(int fd, int events);
+int task_await_child(pid_t pid, int *status);
+
+/* Timer
+ *
+ * The pool takes ownership of the task. Handles must be cancelled or
+ * released before thpool_destroy(), which drops all pending timers.
+ * Periodic timers queue copies of the task without its cleanup_cb, which
+ * runs once when the timer is cancelled.
+ */
+typedef struct thpool_timer thpool_timer_t;
 
+thpool_timer_t* thpool_schedule_after(thpool_t *thpool_p, task_t *task, unsigned int ms);
+thpool_timer_t* thpool_schedule_every(thpool_t *thpool_p, task_t *task, unsigned int ms);
+int thpool_timer_cancel(thpool_timer_t *timer);
+void thpool_timer_release(thpool_timer_t *timer);
 
 #ifdef __cplusplus
 }
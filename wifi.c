@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -10,14 +11,33 @@ struct wifi_handle {
     const wifi_backend_t *backend;
     void *backend_handle;
 
+    wifi_event_cb event_cb;
+    void *event_arg;
+
+    /* Passwords by ssid, kept out of scan results */
+    pthread_mutex_t credentials_lock;
+    struct list_head credentials;
+
     struct {
         int c_errno;
         char errmsg[128];
     } error;
 };
 
+/* One entry of wifi->credentials */
+typedef struct wifi_credential {
+    struct list_head list;
+    char ssid[64];
+    char password[64];
+} wifi_credential_t;
+
+/* In order of preference when wifi_open() picks one */
 static const wifi_backend_t *wifi_backends[] = {
+#ifdef CONFIG_WIFI_NM_DBUS
+    &wifi_nm_dbus,
+#endif
     &wifi_nmcli,
+    &wifi_wpa,
     NULL,
 };
 
@@ -48,13 +68,86 @@ void wifi_scan(wifi_t *wifi)
     }
 }
 
-bool wifi_connect_ssid(wifi_t *wifi, wifi_network_info_t *network)
+/* Notice: Caller MUST hold credentials_lock */
+static wifi_credential_t *wifi_credential_find(wifi_t *wifi, const char *ssid)
 {
-    if (wifi && wifi->backend && wifi->backend->connect_ssid) {
-        return wifi->backend->connect_ssid(wifi->backend_handle, network);
+    wifi_credential_t *credential;
+
+    list_for_each_entry(credential, &wifi->credentials, list) {
+        if (!strcmp(credential->ssid, ssid))
+            return credential;
     }
-    
-    return false;
+    return NULL;
+}
+
+static void wifi_credential_free(wifi_credential_t *credential)
+{
+    explicit_bzero(credential->password, sizeof(credential->password));
+    free(credential);
+}
+
+/* Store the password wifi_connect_ssid() uses for ssid
+ * @return 0 on success, -1 if ssid or password do not fit or out of memory
+ */
+int wifi_credential_set(wifi_t *wifi, const char *ssid, const char *password)
+{
+    wifi_credential_t *credential;
+
+    if (!wifi || !ssid || !password ||
+        strlen(ssid) >= sizeof(credential->ssid) || strlen(password) >= sizeof(credential->password))
+        return -1;
+
+    pthread_mutex_lock(&wifi->credentials_lock);
+    credential = wifi_credential_find(wifi, ssid);
+    if (credential == NULL) {
+        credential = calloc(1, sizeof(wifi_credential_t));
+        if (credential == NULL) {
+            pthread_mutex_unlock(&wifi->credentials_lock);
+            return -1;
+        }
+        strcpy(credential->ssid, ssid);
+        list_add_tail(&credential->list, &wifi->credentials);
+    }
+    memset(credential->password, 0, sizeof(credential->password));
+    strcpy(credential->password, password);
+    pthread_mutex_unlock(&wifi->credentials_lock);
+
+    return 0;
+}
+
+void wifi_credential_remove(wifi_t *wifi, const char *ssid)
+{
+    wifi_credential_t *credential;
+
+    if (!wifi || !ssid)
+        return;
+    pthread_mutex_lock(&wifi->credentials_lock);
+    if ((credential = wifi_credential_find(wifi, ssid)) != NULL) {
+        list_del(&credential->list);
+        wifi_credential_free(credential);
+    }
+    pthread_mutex_unlock(&wifi->credentials_lock);
+}
+
+/* Connect with the stored password of the ssid, none for open networks */
+bool wifi_connect_ssid(wifi_t *wifi, wifi_network_info_t *network)
+{
+    wifi_credential_t *credential;
+    char password[64] = "";
+    bool ret;
+
+    if (!wifi || !wifi->backend || !wifi->backend->connect_ssid || !network)
+        return false;
+
+    pthread_mutex_lock(&wifi->credentials_lock);
+    if ((credential = wifi_credential_find(wifi, network->ssid)) != NULL)
+        memcpy(password, credential->password, sizeof(password));
+    pthread_mutex_unlock(&wifi->credentials_lock);
+
+    ret = wifi->backend->connect_ssid(wifi->backend_handle, network, password);
+    explicit_bzero(password, sizeof(password));
+
+    return ret;
 }
 
 bool wifi_disconnect_ssid(wifi_t *wifi, wifi_network_info_t *network)
@@ -66,6 +159,101 @@ bool wifi_disconnect_ssid(wifi_t *wifi, wifi_network_info_t *network)
     return false;
 }
 
+/* Latest published scan results, NULL before the first scan
+ *
+ * Takes no lock and never waits for a scan in progress.
+ */
+const wifi_scan_snapshot_t *wifi_scan_snapshot_acquire(wifi_t *wifi)
+{
+    if (wifi && wifi->backend && wifi->backend->results)
+        return wifi_snapshot_acquire(wifi->backend->results(wifi->backend_handle));
+
+    return NULL;
+}
+
+void wifi_scan_snapshot_release(const wifi_scan_snapshot_t *snapshot)
+{
+    wifi_snapshot_release(snapshot);
+}
+
+static void wifi_bss_copy(const wifi_scan_snapshot_t *snapshot, const wifi_bss_t *bss,
+                          wifi_network_info_t *network)
+{
+    memset(network, 0, sizeof(wifi_network_info_t));
+    strncpy(network->ssid, snapshot->ssids[bss->ssid_id], sizeof(network->ssid)-1);
+    memcpy(network->bssid, bss->bssid, sizeof(network->bssid));
+    network->freq = bss->freq;
+    network->signal = bss->signal;
+    network->connected = bss->flags & WIFI_BSS_CONNECTED;
+    network->secured = bss->flags & WIFI_BSS_SECURED;
+    INIT_LIST_HEAD(&network->list);
+}
+
+/* Copy out the strongest access point of ssid in the latest scan
+ * @return false if the latest scan did not see ssid
+ */
+bool wifi_find_network(wifi_t *wifi, const char *ssid, wifi_network_info_t *network)
+{
+    const wifi_scan_snapshot_t *snapshot = wifi_scan_snapshot_acquire(wifi);
+    const wifi_bss_t *found = wifi_scan_snapshot_find_network(snapshot, ssid);
+
+    if (found && network)
+        wifi_bss_copy(snapshot, found, network);
+    wifi_scan_snapshot_release(snapshot);
+
+    return found != NULL;
+}
+
+/* Copy out the access point with bssid, e.g. "00:11:22:aa:bb:cc" */
+bool wifi_find_bss(wifi_t *wifi, const char *bssid, wifi_network_info_t *network)
+{
+    const wifi_scan_snapshot_t *snapshot;
+    const wifi_bss_t *found;
+    uint8_t key[6];
+
+    if (!wifi_bssid_parse(bssid, key))
+        return false;
+    snapshot = wifi_scan_snapshot_acquire(wifi);
+    found = wifi_scan_snapshot_find_bss(snapshot, key);
+    if (found && network)
+        wifi_bss_copy(snapshot, found, network);
+    wifi_scan_snapshot_release(snapshot);
+
+    return found != NULL;
+}
+
+static void wifi_events_deliver(void *arg, const wifi_event_t *events, size_t count)
+{
+    wifi_t *wifi = (wifi_t *)arg;
+
+    wifi->event_cb(wifi, events, count, wifi->event_arg);
+}
+
+/* Report what changes from one scan to the next, NULL cb to stop
+ *
+ * @param signal_threshold  smallest signal change reported, against the
+ *                          value last reported for that network
+ * @return 0 on success, WIFI_ERROR_NOT_OPEN without a backend with results
+ */
+int wifi_set_event_callback(wifi_t *wifi, wifi_event_cb cb, uint8_t signal_threshold, void *arg)
+{
+    wifi_snapshot_pub_t *pub;
+
+    if (!wifi || !wifi->backend || !wifi->backend->results)
+        return WIFI_ERROR_NOT_OPEN;
+
+    pub = wifi->backend->results(wifi->backend_handle);
+    pthread_mutex_lock(&pub->lock);
+    wifi->event_cb = cb;
+    wifi->event_arg = arg;
+    pub->notify = cb ? wifi_events_deliver : NULL;
+    pub->notify_arg = wifi;
+    pub->signal_threshold = signal_threshold;
+    pthread_mutex_unlock(&pub->lock);
+
+    return 0;
+}
+
 bool wifi_connection_info(wifi_t *wifi, wifi_network_info_t *network)
 {
     if (wifi && wifi->backend && wifi->backend->connection_info)
@@ -79,12 +267,23 @@ wifi_t *wifi_new(void)
     wifi_t *wifi = calloc(1, sizeof(wifi_t));
     if (wifi == NULL)
         return NULL;
+    pthread_mutex_init(&wifi->credentials_lock, NULL);
+    INIT_LIST_HEAD(&wifi->credentials);
     
     return wifi;
 }
 
 void wifi_free(wifi_t *wifi)
 {
+    wifi_credential_t *credential, *tmp;
+
+    if (wifi == NULL)
+        return;
+    list_for_each_entry_safe(credential, tmp, &wifi->credentials, list) {
+        list_del(&credential->list);
+        wifi_credential_free(credential);
+    }
+    pthread_mutex_destroy(&wifi->credentials_lock);
     free(wifi);
 }
 
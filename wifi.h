@@ -6,23 +6,91 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include "list.h"
 
 enum wifi_error_code {
     WIFI_ERROR_OPEN  = -1,
+    WIFI_ERROR_NOT_OPEN = -2,
 };
 
+/* One access point, as passed to and from the backends
+ *
+ * Passwords are not part of it, see wifi_credential_set().
+ */
 typedef struct wifi_network_info {
     char ssid[64];
-    char password[64];
+    uint8_t bssid[6];               /* all zero if the backend has none */
+    uint16_t freq;                  /* MHz, 0 if unknown */
     bool connected;
+    bool secured;
     uint8_t signal;
     struct list_head list;
 } wifi_network_info_t;
 
+/* wifi_bss_t flags */
+#define WIFI_BSS_CONNECTED  (1 << 0)
+#define WIFI_BSS_SECURED    (1 << 1)
+
+/* Compact record of one access point in a scan snapshot, the ssid is
+ * interned once per snapshot
+ */
+typedef struct wifi_bss {
+    uint32_t ssid_id;               /* index of ssids and groups */
+    uint16_t freq;
+    uint8_t bssid[6];
+    uint8_t signal;
+    uint8_t flags;
+} wifi_bss_t;
+
+/* All access points seen for one ssid */
+typedef struct wifi_network_group {
+    const wifi_bss_t *best;         /* strongest signal */
+    size_t count;
+} wifi_network_group_t;
+
+/* Results of one scan, immutable once published
+ *
+ * Held from wifi_scan_snapshot_acquire() until wifi_scan_snapshot_release(),
+ * later scans publish new snapshots and leave this one alone.
+ */
+typedef struct wifi_scan_snapshot {
+    uint64_t generation;            /* grows with every published scan */
+    size_t count;
+    const wifi_bss_t *bss;          /* count records, in scan order    */
+    size_t ssid_count;              /* distinct ssids                  */
+    const char *const *ssids;       /* by ssid_id                      */
+    const wifi_network_group_t *groups; /* by ssid_id                  */
+    size_t bytes;                   /* memory of this generation: the
+                                     * backend's entries and the snapshot */
+} wifi_scan_snapshot_t;
+
+/* What changed between two published scans */
+typedef enum wifi_event_type {
+    WIFI_EVENT_ADDED,               /* network appeared              */
+    WIFI_EVENT_REMOVED,             /* network is gone               */
+    WIFI_EVENT_SIGNAL,              /* signal moved by the threshold */
+    WIFI_EVENT_CONNECTION,          /* connected flag flipped        */
+} wifi_event_type_t;
+
+typedef struct wifi_event {
+    wifi_event_type_t type;
+    uint64_t generation;            /* snapshot the change is in     */
+    char ssid[64];
+    uint8_t bssid[6];
+    uint8_t signal;
+    uint8_t old_signal;             /* last reported, for SIGNAL     */
+    bool connected;
+} wifi_event_t;
+
 typedef struct wifi_handle wifi_t;
 
+/* Called on the thread that published the scan, with the changes of one
+ * scan at once. It must not call wifi_scan() or any backend operation.
+ */
+typedef void (*wifi_event_cb)(wifi_t *wifi, const wifi_event_t *events, size_t count, void *arg);
+
 /* Primary Functions */
 wifi_t *wifi_new(void);
 void wifi_free(wifi_t *wifi);
@@ -32,6 +100,17 @@ bool wifi_connection_info(wifi_t *wifi, wifi_network_info_t *network);
 void wifi_scan(wifi_t *wifi);
 bool wifi_connect_ssid(wifi_t *wifi, wifi_network_info_t *network);
 bool wifi_disconnect_ssid(wifi_t *wifi, wifi_network_info_t *network);
+const wifi_scan_snapshot_t *wifi_scan_snapshot_acquire(wifi_t *wifi);
+void wifi_scan_snapshot_release(const wifi_scan_snapshot_t *snapshot);
+int wifi_set_event_callback(wifi_t *wifi, wifi_event_cb cb, uint8_t signal_threshold, void *arg);
+const wifi_bss_t *wifi_scan_snapshot_find_network(const wifi_scan_snapshot_t *snapshot,
+                                                  const char *ssid);
+const wifi_bss_t *wifi_scan_snapshot_find_bss(const wifi_scan_snapshot_t *snapshot,
+                                              const uint8_t bssid[6]);
+bool wifi_find_network(wifi_t *wifi, const char *ssid, wifi_network_info_t *network);
+bool wifi_find_bss(wifi_t *wifi, const char *bssid, wifi_network_info_t *network);
+int wifi_credential_set(wifi_t *wifi, const char *ssid, const char *password);
+void wifi_credential_remove(wifi_t *wifi, const char *ssid);
 const char *wifi_errmsg(wifi_t *wifi);
 
 #ifdef __cplusplus
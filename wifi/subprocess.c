@@ -0,0 +1,178 @@
+#define _GNU_SOURCE     /* pipe2() */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "subprocess.h"
+#include "thpool.h"
+
+#define SUBPROCESS_READ_SIZE    (16 * 1024)
+
+extern char **environ;
+
+/* Start argv[0], searched in PATH, without a shell
+ *
+ * stdin is /dev/null, stdout goes to a pipe read through proc->out_fd.
+ * Neither pipe end leaks into other children, both are O_CLOEXEC. The
+ * child starts with no signals blocked, whatever the caller blocked.
+ *
+ * @return 0 on success, -1 on error
+ */
+int subprocess_spawn(subprocess_t *proc, const char *const argv[], int flags)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t none;
+    int fds[2];
+    int ret;
+
+    proc->pid = -1;
+    proc->out_fd = -1;
+    if (pipe2(fds, O_CLOEXEC) != 0)
+        return -1;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    if (flags & SUBPROCESS_STDERR_STDOUT)
+        posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+    else
+        posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    sigemptyset(&none);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    /* glibc spawns with vfork semantics, no page tables are copied */
+    ret = posix_spawnp(&proc->pid, argv[0], &actions, &attr, (char *const *)argv, environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (ret != 0) {
+        close(fds[0]);
+        proc->pid = -1;
+        errno = ret;
+        return -1;
+    }
+
+    /* Only our end, the child keeps a blocking stdout */
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    proc->out_fd = fds[0];
+
+    return 0;
+}
+
+/* Read the child's stdout until it closes it
+ *
+ * In a coroutine task the worker is given to other tasks while no output
+ * is available.
+ *
+ * @param output        set to the NUL terminated output, to be freed
+ * @param skip_lines    leading lines dropped, e.g. 1 for a table header
+ * @return length of output, -1 on error
+ */
+ssize_t subprocess_read(subprocess_t *proc, char **output, size_t skip_lines)
+{
+    size_t len = 0, size = SUBPROCESS_READ_SIZE;
+    char *buf = malloc(size + 1);
+    char *start;
+
+    if (buf == NULL)
+        return -1;
+
+    for (;;) {
+        ssize_t n = read(proc->out_fd, buf + len, size - len);
+        if (n > 0) {
+            len += n;
+            if (size - len < SUBPROCESS_READ_SIZE / 4) {
+                char *grown = realloc(buf, size * 2 + 1);
+                if (grown == NULL)
+                    goto fail;
+                buf = grown;
+                size *= 2;
+            }
+        } else if (n == 0) {
+            break;
+        } else if (errno == EAGAIN) {
+            if (task_await_fd(proc->out_fd, POLLIN) < 0)
+                goto fail;
+        } else if (errno != EINTR) {
+            goto fail;
+        }
+    }
+    buf[len] = '\0';
+
+    start = buf;
+    while (skip_lines-- > 0 && start) {
+        start = strchr(start, '\n');
+        if (start)
+            start++;
+    }
+    if (start == NULL)
+        start = buf + len;
+    if (start != buf) {
+        len -= start - buf;
+        memmove(buf, start, len + 1);
+    }
+
+    *output = buf;
+    return (ssize_t)len;
+
+fail:
+    free(buf);
+    return -1;
+}
+
+/* Close the pipe and reap the child
+ *
+ * @return the wait status, -1 on error
+ */
+int subprocess_wait(subprocess_t *proc)
+{
+    int status = -1;
+
+    if (proc->out_fd >= 0) {
+        close(proc->out_fd);
+        proc->out_fd = -1;
+    }
+    if (proc->pid > 0) {
+        if (task_await_child(proc->pid, &status) != 0)
+            status = -1;
+        proc->pid = -1;
+    }
+    return status;
+}
+
+/* Run argv to completion
+ *
+ * @param output        set to the output minus skip_lines lines if not NULL,
+ *                      to be freed, discarded otherwise
+ * @return the wait status, -1 if the command could not run
+ */
+int subprocess_run(const char *const argv[], int flags, char **output, size_t skip_lines)
+{
+    subprocess_t proc;
+    char *buf = NULL;
+
+    if (output)
+        *output = NULL;
+    if (subprocess_spawn(&proc, argv, flags) != 0)
+        return -1;
+
+    /* Drain even unwanted output, the child must not block on a full pipe */
+    if (subprocess_read(&proc, &buf, skip_lines) < 0)
+        buf = NULL;
+    if (output)
+        *output = buf;
+    else
+        free(buf);
+
+    return subprocess_wait(&proc);
+}
@@ -0,0 +1,23 @@
+#ifndef __SUBPROCESS_H__
+#define __SUBPROCESS_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Where the child's stderr goes */
+enum subprocess_flags {
+    SUBPROCESS_STDERR_NULL   = 0,       /* discarded                 */
+    SUBPROCESS_STDERR_STDOUT = 1 << 0,  /* merged into the output    */
+};
+
+typedef struct subprocess {
+    pid_t pid;
+    int out_fd;         /* read end of the child's stdout, non-blocking */
+} subprocess_t;
+
+int subprocess_spawn(subprocess_t *proc, const char *const argv[], int flags);
+ssize_t subprocess_read(subprocess_t *proc, char **output, size_t skip_lines);
+int subprocess_wait(subprocess_t *proc);
+int subprocess_run(const char *const argv[], int flags, char **output, size_t skip_lines);
+
+#endif
@@ -0,0 +1,96 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wifi_internal.h"
+
+/* Bump allocator for the entries of one scan generation
+ *
+ * Nothing is freed on its own, wifi_arena_reset() drops everything at
+ * once when the generation retires. The chunks are kept, so a steady
+ * stream of scans allocates nothing after the first one.
+ */
+
+#define WIFI_ARENA_CHUNK        (16 * 1024)
+#define WIFI_ARENA_ALIGN        (_Alignof(max_align_t))
+
+struct wifi_arena_chunk {
+    struct wifi_arena_chunk *next;
+    size_t size;
+    size_t used;
+    _Alignas(max_align_t) char data[];
+};
+
+void wifi_arena_init(wifi_arena_t *arena)
+{
+    arena->chunks = NULL;
+    arena->used = 0;
+}
+
+void wifi_arena_destroy(wifi_arena_t *arena)
+{
+    wifi_arena_chunk_t *chunk;
+
+    while ((chunk = arena->chunks) != NULL) {
+        arena->chunks = chunk->next;
+        free(chunk);
+    }
+    arena->used = 0;
+}
+
+static wifi_arena_chunk_t *wifi_arena_chunk_new(size_t size)
+{
+    wifi_arena_chunk_t *chunk = malloc(sizeof(wifi_arena_chunk_t) + size);
+
+    if (chunk == NULL)
+        return NULL;
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+/* Zeroed memory valid until the next reset, NULL if out of memory */
+void *wifi_arena_alloc(wifi_arena_t *arena, size_t size)
+{
+    wifi_arena_chunk_t *chunk = arena->chunks;
+    void *ptr;
+
+    size = (size + WIFI_ARENA_ALIGN - 1) & ~(WIFI_ARENA_ALIGN - 1);
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t grow = chunk ? 2 * chunk->size : WIFI_ARENA_CHUNK;
+        chunk = wifi_arena_chunk_new(grow > size ? grow : size);
+        if (chunk == NULL)
+            return NULL;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+    ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->used += size;
+
+    return memset(ptr, 0, size);
+}
+
+/* Drop all allocations
+ *
+ * A generation that needed several chunks leaves one chunk as large as
+ * all of them, the next one of that size fits without growing.
+ */
+void wifi_arena_reset(wifi_arena_t *arena)
+{
+    wifi_arena_chunk_t *chunk = arena->chunks;
+    size_t total = 0;
+
+    arena->used = 0;
+    if (chunk == NULL)
+        return;
+    if (chunk->next == NULL) {
+        chunk->used = 0;
+        return;
+    }
+    for (; chunk; chunk = chunk->next)
+        total += chunk->size;
+    wifi_arena_destroy(arena);
+    arena->chunks = wifi_arena_chunk_new(total);
+}
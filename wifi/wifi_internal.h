@@ -1,10 +1,65 @@
 #ifndef __WIFI_INTERNAL_H__
 #define __WIFI_INTERNAL_H__
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 
 #include "wifi.h"
 
+/* Bump allocator for one scan generation, see wifi_arena.c */
+typedef struct wifi_arena_chunk wifi_arena_chunk_t;
+typedef struct wifi_arena {
+    wifi_arena_chunk_t *chunks;     /* newest first                 */
+    size_t used;                    /* bytes handed out since reset */
+} wifi_arena_t;
+
+void wifi_arena_init(wifi_arena_t *arena);
+void wifi_arena_destroy(wifi_arena_t *arena);
+void *wifi_arena_alloc(wifi_arena_t *arena, size_t size);
+void wifi_arena_reset(wifi_arena_t *arena);
+
+/* Open addressing slot, hash kept to skip most key compares */
+typedef struct wifi_index_slot {
+    uint32_t hash;
+    uint32_t index;                 /* + 1, 0 for an empty slot     */
+} wifi_index_slot_t;
+
+/* A published scan, see wifi_snapshot.c */
+typedef struct wifi_snapshot {
+    wifi_scan_snapshot_t pub;       /* what readers see             */
+    atomic_uint refs;               /* readers plus the publisher   */
+    uint32_t mask;                  /* slots per index - 1          */
+    const char **ssids;             /* into the string pool         */
+    wifi_network_group_t *groups;
+    wifi_index_slot_t *by_ssid;     /* into ssids and groups        */
+    wifi_index_slot_t *by_bssid;    /* into bss                     */
+    uint8_t *reported;              /* signal last reported, per bss */
+    wifi_bss_t bss[];
+} wifi_snapshot_t;
+
+/* Latest scan of one backend */
+typedef struct wifi_snapshot_pub {
+    _Atomic(wifi_snapshot_t *) current;
+    atomic_uint readers[2];         /* inside acquire, per phase    */
+    atomic_uint phase;              /* flipped by every publish     */
+    pthread_mutex_t lock;           /* serializes publishers        */
+    uint64_t generation;
+
+    /* Changes against the previous snapshot, under lock */
+    void (*notify)(void *arg, const wifi_event_t *events, size_t count);
+    void *notify_arg;
+    uint8_t signal_threshold;
+} wifi_snapshot_pub_t;
+
+void wifi_snapshot_pub_init(wifi_snapshot_pub_t *pub);
+void wifi_snapshot_pub_destroy(wifi_snapshot_pub_t *pub);
+void wifi_snapshot_publish_list(wifi_snapshot_pub_t *pub, struct list_head *networks,
+                                size_t backend_bytes);
+const wifi_scan_snapshot_t *wifi_snapshot_acquire(wifi_snapshot_pub_t *pub);
+void wifi_snapshot_release(const wifi_scan_snapshot_t *snapshot);
+bool wifi_bssid_parse(const char *str, uint8_t bssid[6]);
+
 typedef struct wifi_backend
 {
     void* (*init)(void);
@@ -13,11 +68,16 @@ typedef struct wifi_backend
     bool (*enable)(void *handle, bool enabled);
     bool (*connection_info)(void *handle, wifi_network_info_t *network);
     void (*scan)(void *handle);
-    bool (*connect_ssid)(void *handle, wifi_network_info_t *network);
+    bool (*connect_ssid)(void *handle, wifi_network_info_t *network, const char *password);
     bool (*disconnect_ssid)(void *handle, wifi_network_info_t *network);
+    wifi_snapshot_pub_t *(*results)(void *handle);
     const char *ident;
 } wifi_backend_t;
 
 extern wifi_backend_t wifi_nmcli;
+extern wifi_backend_t wifi_wpa;
+#ifdef CONFIG_WIFI_NM_DBUS
+extern wifi_backend_t wifi_nm_dbus;
+#endif
 
 #endif
\ No newline at end of file
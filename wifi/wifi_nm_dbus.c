@@ -0,0 +1,730 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <systemd/sd-bus.h>
+
+#include "wifi_internal.h"
+
+#define NM_DBUS_SERVICE         "org.freedesktop.NetworkManager"
+#define NM_DBUS_PATH            "/org/freedesktop/NetworkManager"
+#define NM_DBUS_IFACE           NM_DBUS_SERVICE
+#define NM_DBUS_IFACE_DEVICE    NM_DBUS_SERVICE ".Device"
+#define NM_DBUS_IFACE_WIRELESS  NM_DBUS_SERVICE ".Device.Wireless"
+#define NM_DBUS_IFACE_AP        NM_DBUS_SERVICE ".AccessPoint"
+#define DBUS_IFACE_PROPERTIES   "org.freedesktop.DBus.Properties"
+
+#define NM_DEVICE_TYPE_WIFI     (2)
+#define NM_DBUS_PATH_MAX        (128)
+#define NM_DBUS_CONNECT_MS      (30 * 1000)
+#define NM_DBUS_PUBLISH_MS      (200)   /* signals coalesce for at least this */
+
+/* One access point as last reported by NetworkManager */
+typedef struct nm_ap {
+    struct list_head list;
+    char path[NM_DBUS_PATH_MAX];
+    wifi_network_info_t info;
+    uint32_t flags, wpa_flags, rsn_flags;   /* info.secured comes from these */
+} nm_ap_t;
+
+typedef struct nm_dbus_handle {
+    pthread_mutex_t lock;           /* aps, active, wifi_network    */
+    pthread_cond_t active_changed;
+    struct list_head aps;
+    char active[NM_DBUS_PATH_MAX];  /* ActiveAccessPoint, "/" none  */
+    bool dirty;                     /* aps or active not published  */
+    struct list_head wifi_network;  /* results of the last scan     */
+    wifi_arena_t arena;             /* entries of wifi_network      */
+    wifi_snapshot_pub_t results;
+
+    char device[NM_DBUS_PATH_MAX];
+
+    /* An sd-bus connection is single threaded: one serves the API calls
+     * under call_lock, the other belongs to the signal thread.
+     */
+    pthread_mutex_t call_lock;
+    sd_bus *call_bus;
+    sd_bus *signal_bus;
+    pthread_t signal_thread;
+    bool signal_running;
+    int stop_fd;
+} nm_dbus_t;
+
+/* ====== Access point cache ====== */
+
+/* Notice: Caller MUST hold the lock */
+static nm_ap_t *nm_ap_find(nm_dbus_t *nm, const char *path)
+{
+    nm_ap_t *ap;
+
+    list_for_each_entry(ap, &nm->aps, list) {
+        if (!strcmp(ap->path, path))
+            return ap;
+    }
+    return NULL;
+}
+
+/* Strongest access point of a network
+ * Notice: Caller MUST hold the lock
+ */
+static nm_ap_t *nm_ap_find_ssid(nm_dbus_t *nm, const char *ssid)
+{
+    nm_ap_t *ap, *best = NULL;
+
+    list_for_each_entry(ap, &nm->aps, list) {
+        if (!strcmp(ap->info.ssid, ssid) && (!best || ap->info.signal > best->info.signal))
+            best = ap;
+    }
+    return best;
+}
+
+/* Apply an a{sv} of AccessPoint properties, from GetAll or PropertiesChanged
+ * Notice: Caller MUST hold the lock
+ */
+static int nm_ap_apply(nm_ap_t *ap, sd_bus_message *m)
+{
+    const char *key;
+    int r;
+
+    r = sd_bus_message_enter_container(m, 'a', "{sv}");
+    if (r < 0)
+        return r;
+    while ((r = sd_bus_message_enter_container(m, 'e', "sv")) > 0) {
+        r = sd_bus_message_read(m, "s", &key);
+        if (r < 0)
+            return r;
+        if (!strcmp(key, "Ssid")) {
+            const void *ssid;
+            size_t len;
+
+            r = sd_bus_message_enter_container(m, 'v', "ay");
+            if (r < 0)
+                return r;
+            r = sd_bus_message_read_array(m, 'y', &ssid, &len);
+            if (r < 0)
+                return r;
+            if (len > sizeof(ap->info.ssid) - 1)
+                len = sizeof(ap->info.ssid) - 1;
+            memset(ap->info.ssid, 0, sizeof(ap->info.ssid));
+            memcpy(ap->info.ssid, ssid, len);
+            r = sd_bus_message_exit_container(m);
+        } else if (!strcmp(key, "Strength")) {
+            r = sd_bus_message_read(m, "v", "y", &ap->info.signal);
+        } else if (!strcmp(key, "Frequency")) {
+            uint32_t freq;
+
+            r = sd_bus_message_read(m, "v", "u", &freq);
+            if (r >= 0)
+                ap->info.freq = freq;
+        } else if (!strcmp(key, "Flags")) {
+            r = sd_bus_message_read(m, "v", "u", &ap->flags);
+        } else if (!strcmp(key, "WpaFlags")) {
+            r = sd_bus_message_read(m, "v", "u", &ap->wpa_flags);
+        } else if (!strcmp(key, "RsnFlags")) {
+            r = sd_bus_message_read(m, "v", "u", &ap->rsn_flags);
+        } else if (!strcmp(key, "HwAddress")) {
+            const char *bssid;
+
+            r = sd_bus_message_read(m, "v", "s", &bssid);
+            if (r >= 0)
+                wifi_bssid_parse(bssid, ap->info.bssid);
+        } else {
+            r = sd_bus_message_skip(m, "v");
+        }
+        if (r < 0)
+            return r;
+        r = sd_bus_message_exit_container(m);
+        if (r < 0)
+            return r;
+    }
+    if (r < 0)
+        return r;
+    /* NM_802_11_AP_FLAGS_PRIVACY, or any WPA/RSN key management */
+    ap->info.secured = (ap->flags & 0x1) || ap->wpa_flags || ap->rsn_flags;
+    return sd_bus_message_exit_container(m);
+}
+
+/* Notice: Caller MUST hold the lock */
+static void nm_set_active(nm_dbus_t *nm, const char *path)
+{
+    memset(nm->active, 0, sizeof(nm->active));
+    strncpy(nm->active, path, sizeof(nm->active)-1);
+    nm->dirty = true;
+    pthread_cond_broadcast(&nm->active_changed);
+}
+
+/* Publish the cached access points as the latest scan
+ * Notice: Caller MUST hold the lock
+ */
+static void nm_publish(nm_dbus_t *nm)
+{
+    wifi_network_info_t *network;
+    nm_ap_t *ap;
+
+    INIT_LIST_HEAD(&nm->wifi_network);
+    wifi_arena_reset(&nm->arena);
+    list_for_each_entry(ap, &nm->aps, list) {
+        if (ap->info.ssid[0] == '\0')
+            continue;
+        network = wifi_arena_alloc(&nm->arena, sizeof(wifi_network_info_t));
+        if (network == NULL)
+            break;
+        *network = ap->info;
+        network->connected = !strcmp(ap->path, nm->active);
+        list_add_tail(&network->list, &nm->wifi_network);
+    }
+    wifi_snapshot_publish_list(&nm->results, &nm->wifi_network, nm->arena.used);
+    nm->dirty = false;
+}
+
+/* Fetch all properties of an access point into the cache, one round trip */
+static int nm_ap_load(nm_dbus_t *nm, sd_bus *bus, const char *path)
+{
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *reply = NULL;
+    nm_ap_t *ap;
+    int r;
+
+    r = sd_bus_call_method(bus, NM_DBUS_SERVICE, path, DBUS_IFACE_PROPERTIES, "GetAll",
+                           &error, &reply, "s", NM_DBUS_IFACE_AP);
+    sd_bus_error_free(&error);
+    if (r < 0)
+        return r;
+
+    pthread_mutex_lock(&nm->lock);
+    ap = nm_ap_find(nm, path);
+    if (ap == NULL) {
+        ap = calloc(1, sizeof(nm_ap_t));
+        if (ap == NULL) {
+            pthread_mutex_unlock(&nm->lock);
+            sd_bus_message_unref(reply);
+            return -ENOMEM;
+        }
+        strncpy(ap->path, path, sizeof(ap->path)-1);
+        list_add_tail(&ap->list, &nm->aps);
+    }
+    r = nm_ap_apply(ap, reply);
+    nm->dirty = true;
+    pthread_mutex_unlock(&nm->lock);
+    sd_bus_message_unref(reply);
+
+    return r;
+}
+
+static void free_ap_list(nm_dbus_t *nm)
+{
+    nm_ap_t *ap;
+
+    while (!list_empty(&nm->aps)) {
+        ap = list_first_entry(&nm->aps, nm_ap_t, list);
+        list_del(&ap->list);
+        free(ap);
+    }
+}
+
+/* ====== Signals ====== */
+
+static int nm_on_ap_added(sd_bus_message *m, void *userdata,
+                          sd_bus_error __attribute__((unused)) *ret_error)
+{
+    nm_dbus_t *nm = (nm_dbus_t *)userdata;
+    const char *path;
+
+    if (sd_bus_message_read(m, "o", &path) < 0)
+        return 0;
+    nm_ap_load(nm, sd_bus_message_get_bus(m), path);
+    return 0;
+}
+
+static int nm_on_ap_removed(sd_bus_message *m, void *userdata,
+                            sd_bus_error __attribute__((unused)) *ret_error)
+{
+    nm_dbus_t *nm = (nm_dbus_t *)userdata;
+    const char *path;
+    nm_ap_t *ap;
+
+    if (sd_bus_message_read(m, "o", &path) < 0)
+        return 0;
+    pthread_mutex_lock(&nm->lock);
+    if ((ap = nm_ap_find(nm, path)) != NULL) {
+        list_del(&ap->list);
+        free(ap);
+        nm->dirty = true;
+    }
+    pthread_mutex_unlock(&nm->lock);
+    return 0;
+}
+
+/* Strength of access points, ActiveAccessPoint of our device */
+static int nm_on_properties_changed(sd_bus_message *m, void *userdata,
+                                    sd_bus_error __attribute__((unused)) *ret_error)
+{
+    nm_dbus_t *nm = (nm_dbus_t *)userdata;
+    const char *path = sd_bus_message_get_path(m);
+    const char *iface, *key, *active;
+    nm_ap_t *ap;
+
+    if (path == NULL || sd_bus_message_read(m, "s", &iface) < 0)
+        return 0;
+
+    pthread_mutex_lock(&nm->lock);
+    if (!strcmp(iface, NM_DBUS_IFACE_AP)) {
+        if ((ap = nm_ap_find(nm, path)) != NULL && nm_ap_apply(ap, m) >= 0)
+            nm->dirty = true;
+    } else if (!strcmp(iface, NM_DBUS_IFACE_WIRELESS) && !strcmp(path, nm->device)) {
+        if (sd_bus_message_enter_container(m, 'a', "{sv}") < 0)
+            goto out;
+        while (sd_bus_message_enter_container(m, 'e', "sv") > 0) {
+            if (sd_bus_message_read(m, "s", &key) < 0)
+                break;
+            if (!strcmp(key, "ActiveAccessPoint")) {
+                if (sd_bus_message_read(m, "v", "o", &active) >= 0)
+                    nm_set_active(nm, active);
+            } else if (sd_bus_message_skip(m, "v") < 0) {
+                break;
+            }
+            if (sd_bus_message_exit_container(m) < 0)
+                break;
+        }
+    }
+out:
+    pthread_mutex_unlock(&nm->lock);
+    return 0;
+}
+
+/* Dispatch signals until nm_dbus_free() asks us to stop
+ *
+ * What the signals changed is published once the queue ran empty, a burst
+ * of them during a scan makes one snapshot per NM_DBUS_PUBLISH_MS at most.
+ */
+static void *nm_signal_do(void *arg)
+{
+    nm_dbus_t *nm = (nm_dbus_t *)arg;
+    sd_bus *bus = nm->signal_bus;
+    struct pollfd pfd[2];
+    struct timespec now;
+    uint64_t until, usec, published = 0;
+    int r, timeout;
+    bool dirty;
+
+    for (;;) {
+        r = sd_bus_process(bus, NULL);
+        if (r < 0)
+            break;
+        if (r > 0)
+            continue;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        usec = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+        timeout = -1;
+        if (sd_bus_get_timeout(bus, &until) >= 0 && until != UINT64_MAX)
+            timeout = until > usec ? (int)((until - usec + 999) / 1000) : 0;
+
+        pthread_mutex_lock(&nm->lock);
+        dirty = nm->dirty;
+        if (dirty && usec >= published + NM_DBUS_PUBLISH_MS * 1000) {
+            nm_publish(nm);
+            published = usec;
+            dirty = false;
+        }
+        pthread_mutex_unlock(&nm->lock);
+        if (dirty) {
+            int left = (int)((published + NM_DBUS_PUBLISH_MS * 1000 - usec + 999) / 1000);
+            if (timeout < 0 || left < timeout)
+                timeout = left;
+        }
+        pfd[0].fd = sd_bus_get_fd(bus);
+        pfd[0].events = sd_bus_get_events(bus);
+        pfd[1].fd = nm->stop_fd;
+        pfd[1].events = POLLIN;
+        if (poll(pfd, 2, timeout) < 0 && errno != EINTR)
+            break;
+        if (pfd[1].revents & POLLIN)
+            break;
+    }
+
+    return NULL;
+}
+
+/* ====== Backend ====== */
+
+/* First device of type wifi */
+static int nm_find_device(nm_dbus_t *nm)
+{
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *reply = NULL;
+    const char *path;
+    uint32_t type;
+    int r;
+
+    r = sd_bus_call_method(nm->call_bus, NM_DBUS_SERVICE, NM_DBUS_PATH, NM_DBUS_IFACE,
+                           "GetDevices", &error, &reply, "");
+    sd_bus_error_free(&error);
+    if (r < 0)
+        return r;
+    r = sd_bus_message_enter_container(reply, 'a', "o");
+    while (r >= 0 && (r = sd_bus_message_read(reply, "o", &path)) > 0) {
+        r = sd_bus_get_property_trivial(nm->call_bus, NM_DBUS_SERVICE, path, NM_DBUS_IFACE_DEVICE,
+                                        "DeviceType", &error, 'u', &type);
+        sd_bus_error_free(&error);
+        if (r >= 0 && type == NM_DEVICE_TYPE_WIFI) {
+            strncpy(nm->device, path, sizeof(nm->device)-1);
+            break;
+        }
+    }
+    sd_bus_message_unref(reply);
+
+    return nm->device[0] ? 0 : -ENODEV;
+}
+
+/* Access points and active one as of now, signals keep them current */
+static int nm_load(nm_dbus_t *nm)
+{
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *reply = NULL;
+    const char *path;
+    int r;
+
+    r = sd_bus_call_method(nm->call_bus, NM_DBUS_SERVICE, nm->device, NM_DBUS_IFACE_WIRELESS,
+                           "GetAccessPoints", &error, &reply, "");
+    sd_bus_error_free(&error);
+    if (r < 0)
+        return r;
+    r = sd_bus_message_enter_container(reply, 'a', "o");
+    while (r >= 0 && (r = sd_bus_message_read(reply, "o", &path)) > 0)
+        nm_ap_load(nm, nm->call_bus, path);
+    sd_bus_message_unref(reply);
+    reply = NULL;
+
+    r = sd_bus_get_property(nm->call_bus, NM_DBUS_SERVICE, nm->device, NM_DBUS_IFACE_WIRELESS,
+                            "ActiveAccessPoint", &error, &reply, "o");
+    sd_bus_error_free(&error);
+    if (r < 0)
+        return r;
+    if (sd_bus_message_read(reply, "o", &path) > 0) {
+        pthread_mutex_lock(&nm->lock);
+        nm_set_active(nm, path);
+        pthread_mutex_unlock(&nm->lock);
+    }
+    sd_bus_message_unref(reply);
+
+    return 0;
+}
+
+static int nm_subscribe(nm_dbus_t *nm)
+{
+    char rule[512];
+    int r;
+
+    /* Matches are in place before nm_load(), no change is missed */
+    r = sd_bus_match_signal(nm->signal_bus, NULL, NM_DBUS_SERVICE, nm->device,
+                            NM_DBUS_IFACE_WIRELESS, "AccessPointAdded", nm_on_ap_added, nm);
+    if (r < 0)
+        return r;
+    r = sd_bus_match_signal(nm->signal_bus, NULL, NM_DBUS_SERVICE, nm->device,
+                            NM_DBUS_IFACE_WIRELESS, "AccessPointRemoved", nm_on_ap_removed, nm);
+    if (r < 0)
+        return r;
+    snprintf(rule, sizeof(rule), "type='signal',sender='%s',interface='%s',"
+             "member='PropertiesChanged',arg0='%s'",
+             NM_DBUS_SERVICE, DBUS_IFACE_PROPERTIES, NM_DBUS_IFACE_AP);
+    r = sd_bus_add_match(nm->signal_bus, NULL, rule, nm_on_properties_changed, nm);
+    if (r < 0)
+        return r;
+    snprintf(rule, sizeof(rule), "type='signal',sender='%s',path='%s',interface='%s',"
+             "member='PropertiesChanged',arg0='%s'",
+             NM_DBUS_SERVICE, nm->device, DBUS_IFACE_PROPERTIES, NM_DBUS_IFACE_WIRELESS);
+    return sd_bus_add_match(nm->signal_bus, NULL, rule, nm_on_properties_changed, nm);
+}
+
+void nm_dbus_free(void *handle)
+{
+    nm_dbus_t *nm = (nm_dbus_t *)handle;
+    uint64_t one = 1;
+
+    if (nm == NULL)
+        return;
+    if (nm->signal_running) {
+        if (write(nm->stop_fd, &one, sizeof(one)) != sizeof(one))
+            pthread_cancel(nm->signal_thread);
+        pthread_join(nm->signal_thread, NULL);
+    }
+    if (nm->stop_fd >= 0)
+        close(nm->stop_fd);
+    sd_bus_flush_close_unref(nm->signal_bus);
+    sd_bus_flush_close_unref(nm->call_bus);
+    free_ap_list(nm);
+    wifi_arena_destroy(&nm->arena);
+    wifi_snapshot_pub_destroy(&nm->results);
+    pthread_cond_destroy(&nm->active_changed);
+    pthread_mutex_destroy(&nm->call_lock);
+    pthread_mutex_destroy(&nm->lock);
+    free(nm);
+}
+
+static void* nm_dbus_init(void)
+{
+    nm_dbus_t *nm = calloc(1, sizeof(nm_dbus_t));
+    pthread_condattr_t attr;
+
+    if (nm == NULL)
+        return NULL;
+    pthread_mutex_init(&nm->lock, NULL);
+    pthread_mutex_init(&nm->call_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&nm->active_changed, &attr);
+    pthread_condattr_destroy(&attr);
+    INIT_LIST_HEAD(&nm->aps);
+    INIT_LIST_HEAD(&nm->wifi_network);
+    wifi_arena_init(&nm->arena);
+    wifi_snapshot_pub_init(&nm->results);
+    strcpy(nm->active, "/");
+
+    nm->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (nm->stop_fd < 0 ||
+        sd_bus_open_system(&nm->call_bus) < 0 ||
+        sd_bus_open_system(&nm->signal_bus) < 0 ||
+        nm_find_device(nm) < 0 ||
+        nm_subscribe(nm) < 0 ||
+        nm_load(nm) < 0)
+        goto fail;
+
+    if (pthread_create(&nm->signal_thread, NULL, nm_signal_do, nm) != 0)
+        goto fail;
+    nm->signal_running = true;
+
+    return nm;
+fail:
+    nm_dbus_free(nm);
+    return NULL;
+}
+
+bool nm_dbus_is_available(void __attribute__((unused)) *handle)
+{
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *reply = NULL;
+    sd_bus *bus = NULL;
+    int owned = 0;
+
+    if (sd_bus_open_system(&bus) < 0)
+        return false;
+    if (sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                           "org.freedesktop.DBus", "NameHasOwner", &error, &reply,
+                           "s", NM_DBUS_SERVICE) >= 0)
+        sd_bus_message_read(reply, "b", &owned);
+    sd_bus_message_unref(reply);
+    sd_bus_error_free(&error);
+    sd_bus_flush_close_unref(bus);
+
+    return owned;
+}
+
+bool nm_dbus_enable(void *handle, bool enabled)
+{
+    nm_dbus_t *nm = (nm_dbus_t *)handle;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    int r;
+
+    pthread_mutex_lock(&nm->call_lock);
+    r = sd_bus_set_property(nm->call_bus, NM_DBUS_SERVICE, NM_DBUS_PATH, NM_DBUS_IFACE,
+                            "WirelessEnabled", &error, "b", (int)enabled);
+    pthread_mutex_unlock(&nm->call_lock);
+    sd_bus_error_free(&error);
+
+    return r >= 0;
+}
+
+static bool nm_dbus_connection_info(void *handle, wifi_network_info_t *network)
+{
+    nm_dbus_t *nm = (nm_dbus_t *)handle;
+    nm_ap_t *ap;
+    bool active = false;
+
+    if (!network)
+        return false;
+
+    pthread_mutex_lock(&nm->lock);
+    if ((ap = nm_ap_find(nm, nm->active)) != NULL) {
+        memcpy(network->ssid, ap->info.ssid, sizeof(network->ssid));
+        active = true;
+    }
+    pthread_mutex_unlock(&nm->lock);
+
+    return active;
+}
+
+/* Ask for a new scan and return what NetworkManager reported so far
+ *
+ * The request is sent without waiting for a reply, its results come in
+ * as signals and are published by the signal thread.
+ */
+void nm_dbus_scan(void *handle)
+{
+    nm_dbus_t *nm = (nm_dbus_t *)handle;
+    sd_bus_message *m = NULL;
+
+    pthread_mutex_lock(&nm->call_lock);
+    if (sd_bus_message_new_method_call(nm->call_bus, &m, NM_DBUS_SERVICE, nm->device,
+                                       NM_DBUS_IFACE_WIRELESS, "RequestScan") >= 0 &&
+        sd_bus_message_append(m, "a{sv}", 0) >= 0 &&
+        sd_bus_message_set_expect_reply(m, 0) >= 0 &&
+        sd_bus_send(nm->call_bus, m, NULL) >= 0)
+        sd_bus_flush(nm->call_bus);
+    sd_bus_message_unref(m);
+    pthread_mutex_unlock(&nm->call_lock);
+
+    /* The first scan publishes what nm_load() found */
+    pthread_mutex_lock(&nm->lock);
+    if (nm->dirty)
+        nm_publish(nm);
+    pthread_mutex_unlock(&nm->lock);
+}
+
+/* Wait until the active access point belongs to ssid */
+static bool nm_wait_active(nm_dbus_t *nm, const char *ssid, int timeout_ms)
+{
+    struct timespec until;
+    nm_ap_t *ap;
+    bool active = false;
+
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += timeout_ms / 1000;
+    until.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&nm->lock);
+    for (;;) {
+        ap = nm_ap_find(nm, nm->active);
+        if (ap && !strcmp(ap->info.ssid, ssid)) {
+            active = true;
+            break;
+        }
+        if (pthread_cond_timedwait(&nm->active_changed, &nm->lock, &until) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&nm->lock);
+
+    return active;
+}
+
+/* Like `nmcli dev wifi connect`, adds a connection profile and activates it */
+bool nm_dbus_connect_ssid(void *handle, wifi_network_info_t *network, const char *password)
+{
+    nm_dbus_t *nm = (nm_dbus_t *)handle;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *m = NULL;
+    char specific[NM_DBUS_PATH_MAX] = "/";
+    nm_ap_t *ap;
+    int r;
+
+    if (!nm || !network)
+        return false;
+
+    pthread_mutex_lock(&nm->lock);
+    if ((ap = nm_ap_find_ssid(nm, network->ssid)) != NULL)
+        memcpy(specific, ap->path, sizeof(specific));
+    pthread_mutex_unlock(&nm->lock);
+
+    pthread_mutex_lock(&nm->call_lock);
+    r = sd_bus_message_new_method_call(nm->call_bus, &m, NM_DBUS_SERVICE, NM_DBUS_PATH,
+                                       NM_DBUS_IFACE, "AddAndActivateConnection");
+    if (r >= 0)
+        r = sd_bus_message_open_container(m, 'a', "{sa{sv}}");
+    if (r >= 0)
+        r = sd_bus_message_open_container(m, 'e', "sa{sv}");
+    if (r >= 0)
+        r = sd_bus_message_append(m, "s", "802-11-wireless");
+    if (r >= 0)
+        r = sd_bus_message_open_container(m, 'a', "{sv}");
+    if (r >= 0)
+        r = sd_bus_message_open_container(m, 'e', "sv");
+    if (r >= 0)
+        r = sd_bus_message_append(m, "s", "ssid");
+    if (r >= 0)
+        r = sd_bus_message_open_container(m, 'v', "ay");
+    if (r >= 0)
+        r = sd_bus_message_append_array(m, 'y', network->ssid, strlen(network->ssid));
+    if (r >= 0)
+        r = sd_bus_message_close_container(m);  /* v */
+    if (r >= 0)
+        r = sd_bus_message_close_container(m);  /* e */
+    if (r >= 0)
+        r = sd_bus_message_close_container(m);  /* a{sv} */
+    if (r >= 0)
+        r = sd_bus_message_close_container(m);  /* e */
+    if (r >= 0 && password && password[0]) {
+        r = sd_bus_message_append(m, "{sa{sv}}", "802-11-wireless-security", 2,
+                                  "key-mgmt", "s", "wpa-psk",
+                                  "psk", "s", password);
+    }
+    if (r >= 0)
+        r = sd_bus_message_close_container(m);  /* a{sa{sv}} */
+    if (r >= 0)
+        r = sd_bus_message_append(m, "oo", nm->device, specific);
+    if (r >= 0)
+        r = sd_bus_call(nm->call_bus, m, 0, &error, NULL);
+    pthread_mutex_unlock(&nm->call_lock);
+    sd_bus_message_unref(m);
+    sd_bus_error_free(&error);
+    if (r < 0)
+        return false;
+
+    network->connected = nm_wait_active(nm, network->ssid, NM_DBUS_CONNECT_MS);
+    return network->connected;
+}
+
+bool nm_dbus_disconnect_ssid(void *handle, wifi_network_info_t *network)
+{
+    nm_dbus_t *nm = (nm_dbus_t *)handle;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    nm_ap_t *ap;
+    bool active;
+    int r;
+
+    pthread_mutex_lock(&nm->lock);
+    ap = nm_ap_find(nm, nm->active);
+    active = ap && !strcmp(ap->info.ssid, network->ssid);
+    pthread_mutex_unlock(&nm->lock);
+    if (!active)
+        return false;
+
+    pthread_mutex_lock(&nm->call_lock);
+    r = sd_bus_call_method(nm->call_bus, NM_DBUS_SERVICE, nm->device, NM_DBUS_IFACE_DEVICE,
+                           "Disconnect", &error, NULL, "");
+    pthread_mutex_unlock(&nm->call_lock);
+    sd_bus_error_free(&error);
+    if (r < 0)
+        return false;
+
+    network->connected = false;
+    return true;
+}
+
+static wifi_snapshot_pub_t *nm_dbus_results(void *handle)
+{
+    return &((nm_dbus_t *)handle)->results;
+}
+
+wifi_backend_t wifi_nm_dbus = {
+    .init = nm_dbus_init,
+    .free = nm_dbus_free,
+    .is_available = nm_dbus_is_available,
+    .enable = nm_dbus_enable,
+    .connection_info = nm_dbus_connection_info,
+    .scan = nm_dbus_scan,
+    .connect_ssid = nm_dbus_connect_ssid,
+    .disconnect_ssid = nm_dbus_disconnect_ssid,
+    .results = nm_dbus_results,
+    .ident = "networkmanager"
+};
@@ -1,32 +1,298 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
 
 #include "wifi_internal.h"
 #include "stdstring.h"
+#include "subprocess.h"
+
+/* nmcli monitor reports device and connection state, not access points.
+ * With it running the AP list is only listed again once the state changed
+ * or it got this old.
+ */
+#define NMCLI_SCAN_MAX_AGE_MS   (30 * 1000)
+#define NMCLI_MONITOR_LINE      (512)
+#define NMCLI_DEVICES_MAX       (16)
+
+typedef struct nmcli_device {
+    char name[32];
+    bool wifi;                      /* TYPE wifi, not wifi-p2p      */
+} nmcli_device_t;
 
 typedef struct nmcli_handle {
     struct list_head wifi_network;
+    pthread_mutex_t lock;           /* wifi_network, active, stale  */
+    wifi_snapshot_pub_t results;
+
+    /* A refresh builds into one arena while the list in the other is
+     * live, the old one is reset once the new list replaced it.
+     */
+    pthread_mutex_t refresh_lock;
+    wifi_arena_t arena[2];
+    unsigned int live;              /* arena of wifi_network        */
+
+    /* Streaming mode, off if nmcli monitor could not be started */
+    bool streaming;
+    subprocess_t monitor;
+    pthread_t monitor_thread;
+    bool stale;                     /* state changed since the scan */
+    struct timespec scanned;        /* CLOCK_MONOTONIC              */
+    bool active_known;
+    char active[64];                /* ssid of the active wifi connection */
+    char active_device[32];         /* its device, "" if not known  */
+
+    /* Device types, only touched by the monitor thread once it runs */
+    nmcli_device_t devices[NMCLI_DEVICES_MAX];
+    size_t num_devices;
 } nmcli_t;
 
-static void* nmcli_init(void)
+static bool nmcli_run(const char *const argv[], char **output, size_t skip_lines);
+static size_t nmcli_split_terse(char *line, char *field[], size_t n);
+static void nmcli_refresh(nmcli_t *nmcli);
+
+/* Mark the network of the active connection, NULL for none
+ * Notice: Caller MUST hold the nmcli lock
+ */
+static void nmcli_set_active(nmcli_t *nmcli, const char *device, const char *ssid)
 {
-    nmcli_t *nmcli = calloc(1, sizeof(nmcli_t));
-    INIT_LIST_HEAD(&nmcli->wifi_network);
-    return nmcli;
+    wifi_network_info_t *network;
+    bool changed = false;
+
+    nmcli->active_known = true;
+    memset(nmcli->active, 0, sizeof(nmcli->active));
+    memset(nmcli->active_device, 0, sizeof(nmcli->active_device));
+    if (ssid) {
+        strncpy(nmcli->active, ssid, sizeof(nmcli->active)-1);
+        strncpy(nmcli->active_device, device, sizeof(nmcli->active_device)-1);
+    }
+
+    list_for_each_entry(network, &nmcli->wifi_network, list) {
+        bool connected = ssid && !strcmp(network->ssid, ssid);
+        changed |= network->connected != connected;
+        network->connected = connected;
+    }
+    if (changed)
+        wifi_snapshot_publish_list(&nmcli->results, &nmcli->wifi_network,
+                                   nmcli->arena[nmcli->live].used);
 }
 
-static void free_wifi_network(nmcli_t *nmcli)
+/* Learn which devices are wifi ones, replacing what was known
+ *
+ * @return false if nmcli could not list the devices
+ */
+static bool nmcli_devices_load(nmcli_t *nmcli)
 {
-    wifi_network_info_t *network;
+    const char *argv[] = { "nmcli", "-t", "-f", "DEVICE,TYPE", "dev", NULL };
+    char *output = NULL;
+    char *line, *rest;
+
+    if (!nmcli_run(argv, &output, 0) || output == NULL) {
+        free(output);
+        return false;
+    }
+    nmcli->num_devices = 0;
+    for (line = strtok_r(output, "\n", &rest); line && nmcli->num_devices < NMCLI_DEVICES_MAX;
+         line = strtok_r(NULL, "\n", &rest)) {
+        nmcli_device_t *device = &nmcli->devices[nmcli->num_devices];
+        char *field[2];
+
+        /* "wlan0:wifi", "p2p-dev-wlan0:wifi-p2p", "eth0:ethernet" */
+        if (nmcli_split_terse(line, field, 2) < 2)
+            continue;
+        snprintf(device->name, sizeof(device->name), "%s", field[0]);
+        device->wifi = !strcmp(field[1], "wifi");
+        nmcli->num_devices++;
+    }
+    free(output);
+
+    return true;
+}
+
+static const nmcli_device_t *nmcli_device_find(nmcli_t *nmcli, const char *name)
+{
+    size_t n;
+
+    for (n = 0; n < nmcli->num_devices; n++) {
+        if (!strcmp(nmcli->devices[n].name, name))
+            return &nmcli->devices[n];
+    }
+    return NULL;
+}
+
+/* Look up the ssid of a wifi connection profile, its name may differ */
+static bool nmcli_connection_ssid(const char *name, char *ssid, size_t size)
+{
+    const char *argv[] = { "nmcli", "-t", "-g", "802-11-wireless.ssid", "c", "show", "id", name, NULL };
+    char *output = NULL;
+    char *field[1];
+
+    if (!nmcli_run(argv, &output, 0) || output == NULL) {
+        free(output);
+        return false;
+    }
+    output[strcspn(output, "\n")] = '\0';
+    nmcli_split_terse(output, field, 1);
+    snprintf(ssid, size, "%s", field[0]);
+    free(output);
+
+    return ssid[0] != '\0';
+}
+
+/* Apply one line of nmcli monitor output
+ *
+ * Lines look like "wlan0: using connection 'HomeNet'", "wlan0: disconnected"
+ * or "NetworkManager is now in the 'connected' state". Only lines of wifi
+ * devices count, ethernet or wifi-p2p ones leave the wifi state alone.
+ * The active connection is known by its ssid, which is looked up as the
+ * name of a profile may differ from it. Without the ssid the state stays
+ * unknown until wifi_connection_info() asks nmcli again.
+ */
+static void nmcli_monitor_line(nmcli_t *nmcli, char *line)
+{
+    const char *using = "using connection '";
+    const nmcli_device_t *device;
+    char ssid[64], *event, *name, *end;
+    bool known;
+
+    string_trim(line);
+    if ((event = strstr(line, ": ")) == NULL)
+        return;
+    *event = '\0';
+    event += 2;
+    if (line[0] == '\0' || strchr(line, ' ') != NULL)
+        return;
+
+    if ((device = nmcli_device_find(nmcli, line)) == NULL && !strcmp(event, "device created") &&
+        nmcli_devices_load(nmcli))
+        device = nmcli_device_find(nmcli, line);
+    if (device == NULL || !device->wifi)
+        return;
+
+    if (string_starts_with(event, using)) {
+        name = event + strlen(using);
+        /* An overlong line was cut, its name is not the whole one */
+        known = (end = strrchr(name, '\'')) != NULL;
+        if (known) {
+            *end = '\0';
+            known = nmcli_connection_ssid(name, ssid, sizeof(ssid));
+        }
+        pthread_mutex_lock(&nmcli->lock);
+        if (known)
+            nmcli_set_active(nmcli, device->name, ssid);
+        else
+            nmcli->active_known = false;
+    } else if (!strcmp(event, "disconnected") || !strcmp(event, "unavailable") ||
+               !strcmp(event, "deactivating")) {
+        pthread_mutex_lock(&nmcli->lock);
+        /* Another wifi device keeps its connection */
+        if (!nmcli->active_known || !strcmp(nmcli->active_device, device->name))
+            nmcli_set_active(nmcli, NULL, NULL);
+    } else {
+        pthread_mutex_lock(&nmcli->lock);
+    }
+    nmcli->stale = true;
+    pthread_mutex_unlock(&nmcli->lock);
+}
+
+/* Follow nmcli monitor until it exits */
+static void *nmcli_monitor_do(void *arg)
+{
+    nmcli_t *nmcli = (nmcli_t *)arg;
+    char buf[NMCLI_MONITOR_LINE];
+    size_t len = 0;
+
+    for (;;) {
+        struct pollfd pfd = { .fd = nmcli->monitor.out_fd, .events = POLLIN };
+        ssize_t n;
+
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        n = read(nmcli->monitor.out_fd, buf + len, sizeof(buf) - 1 - len);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+            break;
+        if (n < 0)
+            continue;
+        len += n;
+        buf[len] = '\0';
+
+        char *line = buf, *nl;
+        while ((nl = strchr(line, '\n')) != NULL) {
+            *nl = '\0';
+            nmcli_monitor_line(nmcli, line);
+            line = nl + 1;
+        }
+        len -= line - buf;
+        memmove(buf, line, len);
+        /* An overlong line is cut, its rest starts a new one */
+        if (len == sizeof(buf) - 1) {
+            buf[len] = '\0';
+            nmcli_monitor_line(nmcli, buf);
+            len = 0;
+        }
+    }
+
+    /* The stream is gone, answer from nmcli again */
+    pthread_mutex_lock(&nmcli->lock);
+    nmcli->streaming = false;
+    pthread_mutex_unlock(&nmcli->lock);
+    return NULL;
+}
+
+static void nmcli_monitor_start(nmcli_t *nmcli)
+{
+    const char *argv[] = { "nmcli", "monitor", NULL };
 
-    while(!list_empty(&nmcli->wifi_network)) {
-        network = list_first_entry(&nmcli->wifi_network, wifi_network_info_t, list);
-        list_del(&network->list);
-        free(network);
+    /* Lines are told apart by the type of their device */
+    if (!nmcli_devices_load(nmcli))
+        return;
+    if (subprocess_spawn(&nmcli->monitor, argv, SUBPROCESS_STDERR_NULL) != 0)
+        return;
+    nmcli->streaming = true;
+    nmcli->stale = true;
+    if (pthread_create(&nmcli->monitor_thread, NULL, nmcli_monitor_do, nmcli) != 0) {
+        nmcli->streaming = false;
+        kill(nmcli->monitor.pid, SIGTERM);
+        subprocess_wait(&nmcli->monitor);
     }
 }
 
+static void nmcli_monitor_stop(nmcli_t *nmcli)
+{
+    if (nmcli->monitor.pid <= 0)
+        return;
+    kill(nmcli->monitor.pid, SIGTERM);
+    pthread_join(nmcli->monitor_thread, NULL);
+    subprocess_wait(&nmcli->monitor);
+}
+
+static void* nmcli_init(void)
+{
+    nmcli_t *nmcli = calloc(1, sizeof(nmcli_t));
+    if (nmcli == NULL)
+        return NULL;
+    INIT_LIST_HEAD(&nmcli->wifi_network);
+    pthread_mutex_init(&nmcli->lock, NULL);
+    pthread_mutex_init(&nmcli->refresh_lock, NULL);
+    wifi_arena_init(&nmcli->arena[0]);
+    wifi_arena_init(&nmcli->arena[1]);
+    wifi_snapshot_pub_init(&nmcli->results);
+    nmcli->monitor.pid = -1;
+    nmcli->monitor.out_fd = -1;
+    nmcli_monitor_start(nmcli);
+    return nmcli;
+}
+
 static void __attribute__((unused)) dump_network_info(nmcli_t *nmcli)
 {
     wifi_network_info_t *network;
@@ -40,146 +306,236 @@ void nmcli_free(void *handle)
 {
     nmcli_t *nmcli = (nmcli_t *)handle;
 
-    free_wifi_network(nmcli);
-    if (handle)
-        free(handle);
+    if (nmcli == NULL)
+        return;
+    nmcli_monitor_stop(nmcli);
+    wifi_arena_destroy(&nmcli->arena[0]);
+    wifi_arena_destroy(&nmcli->arena[1]);
+    wifi_snapshot_pub_destroy(&nmcli->results);
+    pthread_mutex_destroy(&nmcli->refresh_lock);
+    pthread_mutex_destroy(&nmcli->lock);
+    free(handle);
 }
 
-bool nmcli_enable(void __attribute__((unused)) *handle, bool enabled)
+/* Run nmcli or another helper, true if it exited with status 0 */
+static bool nmcli_run(const char *const argv[], char **output, size_t skip_lines)
 {
-    int ret;
+    int ret = subprocess_run(argv, SUBPROCESS_STDERR_NULL, output, skip_lines);
 
-    if (enabled)
-        ret = pclose(popen("nmcli radio wifi on", "r"));
-    else
-        ret = pclose(popen("nmcli radio wifi off", "r"));
-    
-    if (WIFEXITED(ret) != 1 || WEXITSTATUS(ret) != 0)
+    if (ret == -1 || WIFEXITED(ret) != 1 || WEXITSTATUS(ret) != 0)
         return false;
     else
         return true;
 }
 
-bool nmcli_is_available(void __attribute__((unused)) *handle)
+bool nmcli_enable(void __attribute__((unused)) *handle, bool enabled)
 {
-    FILE *fp = NULL;
-    int ret;
-    char line[512];
+    const char *argv[] = { "nmcli", "radio", "wifi", enabled ? "on" : "off", NULL };
 
-    fp = popen("pidof NetworkManager", "r");
-    while (fgets(line, 512, fp)) {} // avoid SIGPIPE
-    ret = pclose(fp);
-    if (WIFEXITED(ret) != 1 || WEXITSTATUS(ret) != 0) {
-        return false;
-    } else {
-        return true;
-    }
+    return nmcli_run(argv, NULL, 0);
+}
+
+bool nmcli_is_available(void __attribute__((unused)) *handle)
+{
+    const char *argv[] = { "pidof", "NetworkManager", NULL };
 
+    return nmcli_run(argv, NULL, 0);
 }
 
-static bool nmcli_connection_info(void __attribute__((unused)) *handle, wifi_network_info_t *network)
+static bool nmcli_connection_info(void *handle, wifi_network_info_t *network)
 {
-    FILE *fp = NULL;
-    char line[512];
+    nmcli_t *nmcli = (nmcli_t *)handle;
+    const char *argv[] = { "nmcli", "-t", "-f", "NAME,TYPE,DEVICE", "c", "show", "--active", NULL };
+    char *output = NULL;
+    char *line, *rest;
+    char ssid[64];
 
     if (!network)
         return false;
 
-    fp = popen("nmcli -f NAME,TYPE c show --active | tail -n+2", "r");
-    if (fgets(line, sizeof(line), fp)) {
-        if(string_ends_with(string_trim(line), "wifi")) {
-            char *rest = line;
-            char *ssid = strtok_r(rest, " ", &rest);
-            memset(network->ssid, 0, sizeof(network->ssid));
-            strncpy(network->ssid, ssid, sizeof(network->ssid)-1);
-            pclose(fp);
-            return true;
+    /* The monitor keeps the active connection up to date */
+    pthread_mutex_lock(&nmcli->lock);
+    if (nmcli->streaming && nmcli->active_known) {
+        bool active = nmcli->active[0] != '\0';
+        if (active) {
+            snprintf(network->ssid, sizeof(network->ssid), "%s", nmcli->active);
         }
+        pthread_mutex_unlock(&nmcli->lock);
+        return active;
+    }
+    pthread_mutex_unlock(&nmcli->lock);
+
+    nmcli_run(argv, &output, 0);
+    if (output == NULL)
+        return false;
+    for (line = strtok_r(output, "\n", &rest); line; line = strtok_r(NULL, "\n", &rest)) {
+        char *field[3];
+
+        /* "HomeNet 1:802-11-wireless:wlan0", the ssid may differ from the name */
+        if (nmcli_split_terse(line, field, 3) < 3 ||
+            (strcmp(field[1], "802-11-wireless") && strcmp(field[1], "wifi")))
+            continue;
+        if (!nmcli_connection_ssid(field[0], ssid, sizeof(ssid)))
+            snprintf(ssid, sizeof(ssid), "%s", field[0]);
+        snprintf(network->ssid, sizeof(network->ssid), "%s", ssid);
+        pthread_mutex_lock(&nmcli->lock);
+        nmcli_set_active(nmcli, field[2], ssid);
+        pthread_mutex_unlock(&nmcli->lock);
+        free(output);
+        return true;
     }
-    pclose(fp);
+    free(output);
+    pthread_mutex_lock(&nmcli->lock);
+    nmcli_set_active(nmcli, NULL, NULL);
+    pthread_mutex_unlock(&nmcli->lock);
     return false;
 }
 
-void nmcli_scan(void *handle)
+/* Split a terse (-t) line on ':' in place, unescaping "\:" and "\\"
+ * @return number of fields found, at most n
+ */
+static size_t nmcli_split_terse(char *line, char *field[], size_t n)
 {
-    nmcli_t *nmcli = (nmcli_t *)handle;
-    char line[512];
-    FILE *fp = NULL;
+    size_t count = 0;
+    char *out = line;
+
+    if (n == 0)
+        return 0;
+    field[count++] = out;
+    for (; *line; line++) {
+        if (*line == '\\' && line[1]) {
+            *out++ = *++line;
+        } else if (*line == ':' && count < n) {
+            *out++ = '\0';
+            field[count++] = out;
+        } else {
+            *out++ = *line;
+        }
+    }
+    *out = '\0';
 
-    /* Clean up */
-    free_wifi_network(nmcli);
+    return count;
+}
 
-    fp = popen("nmcli -f IN-USE,SSID,SIGNAL dev wifi | tail -n+2", "r");
-    while (fgets(line, 512, fp)) {
-        wifi_network_info_t *network = calloc(1, sizeof(wifi_network_info_t));
-        string_trim(line);
-        if (line[0] == '\0')
+/* List access points with nmcli, replacing the cached ones */
+static void nmcli_refresh(nmcli_t *nmcli)
+{
+    const char *argv[] = { "nmcli", "-t", "-f", "IN-USE,BSSID,FREQ,SIGNAL,SECURITY,SSID", "dev", "wifi", NULL };
+    LIST_HEAD(wifi_network);
+    wifi_arena_t *arena;
+    char *output = NULL;
+    char *line, *rest;
+
+    pthread_mutex_lock(&nmcli->refresh_lock);
+    nmcli_run(argv, &output, 0);
+    if (output == NULL) {
+        pthread_mutex_unlock(&nmcli->refresh_lock);
+        return;
+    }
+    arena = &nmcli->arena[!nmcli->live];
+    for (line = strtok_r(output, "\n", &rest); line; line = strtok_r(NULL, "\n", &rest)) {
+        wifi_network_info_t *network;
+        char *field[6];
+
+        /* "*:00\:11\:22\:33\:44\:55:2412 MHz:80:WPA2:Home Net" */
+        if (nmcli_split_terse(line, field, 6) < 6)
             continue;
-        if (line[0] == '*') {
-            network->connected = true;
-            line[0] = ' ';
-            string_trim(line);
-        }
-        char *tokens[2];
-        size_t count, i;
-        count = string_split(line, " ", tokens, 2);
-        if (count == 2) {
-            memset(network->ssid, 0, sizeof(network->ssid));
-            strncpy(network->ssid, tokens[0], sizeof(network->ssid)-1);
-            network->signal = strtoul(tokens[1], NULL, 10);
-        }
-        for (i=0; i<count; i++)
-            free(tokens[i]);
-        list_add_tail(&network->list, &nmcli->wifi_network);
+        network = wifi_arena_alloc(arena, sizeof(wifi_network_info_t));
+        if (network == NULL)
+            break;
+        network->connected = field[0][0] == '*';
+        wifi_bssid_parse(field[1], network->bssid);
+        network->freq = strtoul(field[2], NULL, 10);
+        network->signal = strtoul(field[3], NULL, 10);
+        network->secured = field[4][0] != '\0' && strcmp(field[4], "--") != 0;
+        strncpy(network->ssid, field[5], sizeof(network->ssid)-1);
+        list_add_tail(&network->list, &wifi_network);
     }
-    pclose(fp);
+    free(output);
+
+    /* Swap in the new list, state changes from here on apply to it */
+    pthread_mutex_lock(&nmcli->lock);
+    INIT_LIST_HEAD(&nmcli->wifi_network);
+    list_splice(&wifi_network, &nmcli->wifi_network);
+    nmcli->live = !nmcli->live;
+    wifi_snapshot_publish_list(&nmcli->results, &nmcli->wifi_network, arena->used);
+    nmcli->stale = false;
+    clock_gettime(CLOCK_MONOTONIC, &nmcli->scanned);
+    pthread_mutex_unlock(&nmcli->lock);
+
+    /* The previous generation retires in one go */
+    wifi_arena_reset(&nmcli->arena[!nmcli->live]);
+    pthread_mutex_unlock(&nmcli->refresh_lock);
+}
+
+/* Scan, or answer from memory while nmcli monitor reports no change */
+void nmcli_scan(void *handle)
+{
+    nmcli_t *nmcli = (nmcli_t *)handle;
+    struct timespec now;
+    bool fresh;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&nmcli->lock);
+    fresh = nmcli->streaming && !nmcli->stale &&
+            (now.tv_sec - nmcli->scanned.tv_sec) * 1000 +
+            (now.tv_nsec - nmcli->scanned.tv_nsec) / 1000000 < NMCLI_SCAN_MAX_AGE_MS;
+    pthread_mutex_unlock(&nmcli->lock);
+
+    if (!fresh)
+        nmcli_refresh(nmcli);
 }
 
-bool nmcli_connect_ssid(void *handle, wifi_network_info_t *network)
+bool nmcli_connect_ssid(void *handle, wifi_network_info_t *network, const char *password)
 {
     nmcli_t *nmcli = (nmcli_t *)handle;
-    char cmd[256];
-    char line[512];
-    FILE *fp = NULL;
+    const char *argv[] = { "nmcli", "-f", "IN-USE,SSID", "dev", "wifi", NULL };
+    char *output = NULL;
+    char *line, *rest;
 
     if (!nmcli || !network)
         return false;
-    
-    snprintf(cmd, sizeof(cmd),
-        "nmcli dev wifi connect \"%s\" password \"%s\" 2>&1", network->ssid, network->password);
-    pclose(popen(cmd, "r"));
 
-    fp = popen("nmcli -f IN-USE,SSID dev wifi | tail -n+2", "r");
-    while (fgets(line, 512, fp)) {
+    /* Passed as separate arguments, no quoting needed */
+    const char *connect[] = { "nmcli", "dev", "wifi", "connect", network->ssid,
+                              password && password[0] ? "password" : NULL, password, NULL };
+    subprocess_run(connect, SUBPROCESS_STDERR_STDOUT, NULL, 0);
+
+    nmcli_run(argv, &output, 1);
+    if (output == NULL)
+        return false;
+    for (line = strtok_r(output, "\n", &rest); line; line = strtok_r(NULL, "\n", &rest)) {
         string_trim(line);
         if (string_starts_with(line, "*")) {
             line[0] = ' ';
-            if (!strncmp(string_trim(line), network->ssid, sizeof(line))) {
+            if (!strcmp(string_trim(line), network->ssid)) {
                 network->connected = true;
-		 pclose(fp);
+                free(output);
                 return true;
             }
         }
     }
-    pclose(fp);
+    free(output);
 
     return false;
 }
 
 bool nmcli_disconnect_ssid(void __attribute__((unused)) *handle, wifi_network_info_t *network)
 {
-    char cmd[256];
-    int ret;
+    const char *argv[] = { "nmcli", "c", "down", network->ssid, NULL };
 
-    snprintf(cmd, sizeof(cmd), "nmcli c down \"%s\"", network->ssid);
-    ret = pclose(popen(cmd, "r"));
-    if (WIFEXITED(ret) != 1 || WEXITSTATUS(ret) != 0) {
+    if (!nmcli_run(argv, NULL, 0)) {
         return false;
     } else {
         network->connected = false;
         return true;
     }
 }
+static wifi_snapshot_pub_t *nmcli_results(void *handle)
+{
+    return &((nmcli_t *)handle)->results;
+}
+
 wifi_backend_t wifi_nmcli = {
     .init = nmcli_init,
     .free = nmcli_free,
@@ -189,6 +545,7 @@ wifi_backend_t wifi_nmcli = {
     .scan = nmcli_scan,
     .connect_ssid = nmcli_connect_ssid,
     .disconnect_ssid = nmcli_disconnect_ssid,
+    .results = nmcli_results,
     .ident = "nmcli"
 };
 
@@ -0,0 +1,412 @@
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wifi_internal.h"
+
+/* Scan results are published RCU style: a new snapshot replaces the
+ * current pointer, readers that already hold the old one keep it until
+ * they release it, and the last reference frees it.
+ *
+ * Between loading the pointer and taking a reference a reader is counted
+ * in pub->readers[pub->phase]. A publisher flips the phase after swapping
+ * the pointer and drops its reference to the old snapshot once the count
+ * of the old phase went to zero, so no reader can be left with a pointer
+ * whose reference was never taken. Readers arriving after the flip count
+ * in the other phase and cannot hold the publisher off. Readers never wait.
+ */
+
+static void wifi_snapshot_put(wifi_snapshot_t *snap)
+{
+    if (snap && atomic_fetch_sub_explicit(&snap->refs, 1, memory_order_acq_rel) == 1)
+        free(snap);
+}
+
+void wifi_snapshot_pub_init(wifi_snapshot_pub_t *pub)
+{
+    atomic_init(&pub->current, NULL);
+    atomic_init(&pub->readers[0], 0);
+    atomic_init(&pub->readers[1], 0);
+    atomic_init(&pub->phase, 0);
+    pthread_mutex_init(&pub->lock, NULL);
+    pub->generation = 0;
+}
+
+/* Notice: Snapshots still acquired stay valid */
+void wifi_snapshot_pub_destroy(wifi_snapshot_pub_t *pub)
+{
+    wifi_snapshot_put(atomic_exchange(&pub->current, NULL));
+    pthread_mutex_destroy(&pub->lock);
+}
+
+/* ====== Index ====== */
+
+static const uint8_t wifi_bssid_none[6];
+
+/* FNV-1a */
+static uint32_t wifi_hash(const void *key, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)key;
+    uint32_t hash = 2166136261u;
+
+    while (len--) {
+        hash ^= *p++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* "00:11:22:aa:bb:cc" to bytes
+ * @return false if str is no bssid
+ */
+bool wifi_bssid_parse(const char *str, uint8_t bssid[6])
+{
+    unsigned int b[6];
+    int i, n = 0;
+
+    if (str == NULL ||
+        sscanf(str, "%2x:%2x:%2x:%2x:%2x:%2x%n", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5], &n) != 6 ||
+        str[n] != '\0')
+        return false;
+    for (i = 0; i < 6; i++)
+        bssid[i] = b[i];
+    return true;
+}
+
+/* Slot of ssid in by_ssid, empty if not interned yet */
+static wifi_index_slot_t *wifi_snapshot_ssid_slot(const wifi_snapshot_t *snap, const char *ssid,
+                                                  uint32_t hash)
+{
+    wifi_index_slot_t *slot;
+    uint32_t pos;
+
+    for (pos = hash & snap->mask; ; pos = (pos + 1) & snap->mask) {
+        slot = &snap->by_ssid[pos];
+        if (slot->index == 0 ||
+            (slot->hash == hash && !strcmp(snap->ssids[slot->index - 1], ssid)))
+            return slot;
+    }
+}
+
+/* Slot of bssid in by_bssid, empty if not indexed yet */
+static wifi_index_slot_t *wifi_snapshot_bss_slot(const wifi_snapshot_t *snap, const uint8_t bssid[6],
+                                                 uint32_t hash)
+{
+    wifi_index_slot_t *slot;
+    uint32_t pos;
+
+    for (pos = hash & snap->mask; ; pos = (pos + 1) & snap->mask) {
+        slot = &snap->by_bssid[pos];
+        if (slot->index == 0 ||
+            (slot->hash == hash && !memcmp(snap->bss[slot->index - 1].bssid, bssid, 6)))
+            return slot;
+    }
+}
+
+/* Append network as a hot record, interning its ssid into pool
+ *
+ * The ssid index doubles as the interning table, the first network of an
+ * ssid gets the next id and a group, later ones join it.
+ * @return pool past the ssid if it was new
+ */
+static char *wifi_snapshot_add(wifi_snapshot_t *snap, const wifi_network_info_t *network, char *pool)
+{
+    wifi_bss_t *bss = &snap->bss[snap->pub.count];
+    wifi_network_group_t *group;
+    wifi_index_slot_t *slot;
+    size_t len = strlen(network->ssid);
+    uint32_t hash;
+
+    memcpy(bss->bssid, network->bssid, sizeof(bss->bssid));
+    bss->freq = network->freq;
+    bss->signal = network->signal;
+    bss->flags = (network->connected ? WIFI_BSS_CONNECTED : 0) |
+                 (network->secured ? WIFI_BSS_SECURED : 0);
+    snap->reported[snap->pub.count] = network->signal;
+
+    hash = wifi_hash(network->ssid, len);
+    slot = wifi_snapshot_ssid_slot(snap, network->ssid, hash);
+    if (slot->index == 0) {
+        snap->ssids[snap->pub.ssid_count] = memcpy(pool, network->ssid, len + 1);
+        pool += len + 1;
+        snap->groups[snap->pub.ssid_count].best = bss;
+        snap->groups[snap->pub.ssid_count].count = 0;
+        slot->hash = hash;
+        slot->index = ++snap->pub.ssid_count;
+    }
+    bss->ssid_id = slot->index - 1;
+    group = &snap->groups[bss->ssid_id];
+    if (bss->signal > group->best->signal)
+        group->best = bss;
+    group->count++;
+
+    if (memcmp(bss->bssid, wifi_bssid_none, sizeof(bss->bssid))) {
+        hash = wifi_hash(bss->bssid, sizeof(bss->bssid));
+        slot = wifi_snapshot_bss_slot(snap, bss->bssid, hash);
+        if (slot->index == 0) {
+            slot->hash = hash;
+            slot->index = snap->pub.count + 1;
+        }
+    }
+    snap->pub.count++;
+
+    return pool;
+}
+
+/* Strongest access point of ssid, NULL if not in the snapshot */
+const wifi_bss_t *wifi_scan_snapshot_find_network(const wifi_scan_snapshot_t *snapshot,
+                                                  const char *ssid)
+{
+    const wifi_snapshot_t *snap;
+    const wifi_index_slot_t *slot;
+
+    if (snapshot == NULL || ssid == NULL)
+        return NULL;
+    snap = container_of(snapshot, wifi_snapshot_t, pub);
+    slot = wifi_snapshot_ssid_slot(snap, ssid, wifi_hash(ssid, strlen(ssid)));
+    return slot->index ? snap->groups[slot->index - 1].best : NULL;
+}
+
+const wifi_bss_t *wifi_scan_snapshot_find_bss(const wifi_scan_snapshot_t *snapshot,
+                                              const uint8_t bssid[6])
+{
+    const wifi_snapshot_t *snap;
+    const wifi_index_slot_t *slot;
+
+    if (snapshot == NULL || bssid == NULL)
+        return NULL;
+    snap = container_of(snapshot, wifi_snapshot_t, pub);
+    slot = wifi_snapshot_bss_slot(snap, bssid, wifi_hash(bssid, 6));
+    return slot->index ? &snap->bss[slot->index - 1] : NULL;
+}
+
+/* ====== Diff ====== */
+
+/* A record with the snapshot it is in, for sorting */
+typedef struct wifi_bss_ref {
+    const wifi_snapshot_t *snap;
+    const wifi_bss_t *bss;
+} wifi_bss_ref_t;
+
+/* Order by ssid, then bssid */
+static int wifi_bss_key_cmp(const wifi_bss_ref_t *x, const wifi_bss_ref_t *y)
+{
+    int ret = strcmp(x->snap->ssids[x->bss->ssid_id], y->snap->ssids[y->bss->ssid_id]);
+
+    if (ret == 0)
+        ret = memcmp(x->bss->bssid, y->bss->bssid, sizeof(x->bss->bssid));
+    return ret;
+}
+
+static int wifi_bss_cmp(const void *a, const void *b)
+{
+    const wifi_bss_ref_t *x = (const wifi_bss_ref_t *)a;
+    const wifi_bss_ref_t *y = (const wifi_bss_ref_t *)b;
+    int ret = wifi_bss_key_cmp(x, y);
+
+    /* Same key, e.g. no bssids: keep scan order, the n-th pairs with the n-th */
+    if (ret == 0)
+        ret = (x->bss > y->bss) - (x->bss < y->bss);
+    return ret;
+}
+
+/* Records of snap sorted by ssid and bssid, to be freed */
+static wifi_bss_ref_t *wifi_snapshot_sorted(const wifi_snapshot_t *snap)
+{
+    wifi_bss_ref_t *sorted;
+    size_t i;
+
+    sorted = malloc((snap->pub.count + 1) * sizeof(*sorted));
+    if (sorted == NULL)
+        return NULL;
+    for (i = 0; i < snap->pub.count; i++) {
+        sorted[i].snap = snap;
+        sorted[i].bss = &snap->bss[i];
+    }
+    qsort(sorted, snap->pub.count, sizeof(*sorted), wifi_bss_cmp);
+    return sorted;
+}
+
+static wifi_event_t *wifi_event_add(wifi_event_t *event, wifi_event_type_t type,
+                                    const wifi_snapshot_t *snap, const wifi_bss_ref_t *ref)
+{
+    event->type = type;
+    event->generation = snap->pub.generation;
+    memset(event->ssid, 0, sizeof(event->ssid));
+    strncpy(event->ssid, ref->snap->ssids[ref->bss->ssid_id], sizeof(event->ssid)-1);
+    memcpy(event->bssid, ref->bss->bssid, sizeof(event->bssid));
+    event->signal = ref->bss->signal;
+    event->old_signal = ref->bss->signal;
+    event->connected = ref->bss->flags & WIFI_BSS_CONNECTED;
+    return event + 1;
+}
+
+/* Pair records of old and snap by ssid and bssid and report what differs
+ *
+ * Carries the last reported signal over, so slow drift still gets reported
+ * once it adds up to the threshold.
+ * Notice: Caller MUST hold pub->lock
+ */
+static void wifi_snapshot_diff(wifi_snapshot_pub_t *pub, const wifi_snapshot_t *old, wifi_snapshot_t *snap)
+{
+    static const wifi_snapshot_t empty;
+    wifi_bss_ref_t *a, *b;
+    wifi_event_t *events, *event;
+    size_t i = 0, j = 0, k;
+    int cmp;
+
+    if (old == NULL)
+        old = &empty;
+    a = wifi_snapshot_sorted(old);
+    b = wifi_snapshot_sorted(snap);
+    /* One event per removal, at most two per record in snap */
+    events = malloc((old->pub.count + 2 * snap->pub.count + 1) * sizeof(wifi_event_t));
+    if (!a || !b || !events)
+        goto out;
+
+    event = events;
+    while (i < old->pub.count || j < snap->pub.count) {
+        if (i == old->pub.count)
+            cmp = 1;
+        else if (j == snap->pub.count)
+            cmp = -1;
+        else
+            cmp = wifi_bss_key_cmp(&a[i], &b[j]);
+
+        if (cmp < 0) {
+            event = wifi_event_add(event, WIFI_EVENT_REMOVED, snap, &a[i++]);
+        } else if (cmp > 0) {
+            event = wifi_event_add(event, WIFI_EVENT_ADDED, snap, &b[j++]);
+        } else {
+            uint8_t was = old->reported[a[i].bss - old->bss];
+            int delta = (int)b[j].bss->signal - was;
+
+            k = b[j].bss - snap->bss;
+            snap->reported[k] = was;
+            if (delta != 0 && abs(delta) >= pub->signal_threshold) {
+                event = wifi_event_add(event, WIFI_EVENT_SIGNAL, snap, &b[j]);
+                event[-1].old_signal = was;
+                snap->reported[k] = b[j].bss->signal;
+            }
+            if ((a[i].bss->flags ^ b[j].bss->flags) & WIFI_BSS_CONNECTED)
+                event = wifi_event_add(event, WIFI_EVENT_CONNECTION, snap, &b[j]);
+            i++;
+            j++;
+        }
+    }
+    if (event != events)
+        pub->notify(pub->notify_arg, events, event - events);
+out:
+    free(events);
+    free(b);
+    free(a);
+}
+
+/* ====== Publication ====== */
+
+static void wifi_snapshot_publish(wifi_snapshot_pub_t *pub, wifi_snapshot_t *snap)
+{
+    wifi_snapshot_t *old;
+    unsigned int phase;
+
+    pthread_mutex_lock(&pub->lock);
+    snap->pub.generation = ++pub->generation;
+    if (pub->notify)
+        wifi_snapshot_diff(pub, atomic_load(&pub->current), snap);
+    old = atomic_exchange(&pub->current, snap);
+
+    /* Grace period, a reader of the old phase may have loaded old but not
+     * yet taken a ref. Still under lock, the next publisher must not flip
+     * back before this phase drained.
+     */
+    phase = atomic_fetch_xor(&pub->phase, 1);
+    while (atomic_load(&pub->readers[phase]) != 0)
+        sched_yield();
+    pthread_mutex_unlock(&pub->lock);
+
+    wifi_snapshot_put(old);
+}
+
+/* Publish a list of wifi_network_info_t as the latest scan
+ *
+ * @param backend_bytes     what the backend spent on the list
+ */
+void wifi_snapshot_publish_list(wifi_snapshot_pub_t *pub, struct list_head *networks,
+                                size_t backend_bytes)
+{
+    wifi_network_info_t *network;
+    wifi_snapshot_t *snap;
+    size_t count = 0, strings = 0, slots = 2, size;
+    char *pool;
+
+    list_for_each_entry(network, networks, list) {
+        count++;
+        strings += strlen(network->ssid) + 1;
+    }
+    /* Both indexes at most half full */
+    while (slots < 2 * count)
+        slots <<= 1;
+
+    /* One block: header, records, ssid pointers, groups, both indexes,
+     * reported signals and the ssid strings
+     */
+    size = sizeof(wifi_snapshot_t) +
+           count * (sizeof(wifi_bss_t) + sizeof(char *) + sizeof(wifi_network_group_t) + 1) +
+           2 * slots * sizeof(wifi_index_slot_t) + strings;
+    snap = malloc(size);
+    if (snap == NULL)
+        return;
+    atomic_init(&snap->refs, 1);
+    snap->ssids = (const char **)&snap->bss[count];
+    snap->groups = (wifi_network_group_t *)&snap->ssids[count];
+    snap->by_ssid = (wifi_index_slot_t *)&snap->groups[count];
+    snap->by_bssid = &snap->by_ssid[slots];
+    snap->reported = (uint8_t *)&snap->by_bssid[slots];
+    pool = (char *)&snap->reported[count];
+    snap->mask = slots - 1;
+    memset(snap->by_ssid, 0, 2 * slots * sizeof(wifi_index_slot_t));
+
+    snap->pub.count = 0;
+    snap->pub.ssid_count = 0;
+    snap->pub.bss = snap->bss;
+    snap->pub.ssids = snap->ssids;
+    snap->pub.groups = snap->groups;
+    snap->pub.bytes = size + backend_bytes;
+    list_for_each_entry(network, networks, list) {
+        pool = wifi_snapshot_add(snap, network, pool);
+    }
+
+    wifi_snapshot_publish(pub, snap);
+}
+
+const wifi_scan_snapshot_t *wifi_snapshot_acquire(wifi_snapshot_pub_t *pub)
+{
+    wifi_snapshot_t *snap;
+    unsigned int phase;
+
+    if (pub == NULL)
+        return NULL;
+    /* Counted in a phase that was still current afterwards, otherwise a
+     * publisher may already have stopped waiting for it
+     */
+    for (;;) {
+        phase = atomic_load(&pub->phase);
+        atomic_fetch_add(&pub->readers[phase], 1);
+        if (atomic_load(&pub->phase) == phase)
+            break;
+        atomic_fetch_sub(&pub->readers[phase], 1);
+    }
+    snap = atomic_load(&pub->current);
+    if (snap)
+        atomic_fetch_add_explicit(&snap->refs, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&pub->readers[phase], 1, memory_order_release);
+
+    return snap ? &snap->pub : NULL;
+}
+
+void wifi_snapshot_release(const wifi_scan_snapshot_t *snapshot)
+{
+    if (snapshot)
+        wifi_snapshot_put(container_of(snapshot, wifi_snapshot_t, pub));
+}
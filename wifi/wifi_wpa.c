@@ -0,0 +1,651 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "wifi_internal.h"
+#include "stdstring.h"
+
+/* Where wpa_supplicant -C puts one socket per interface */
+#ifndef WPA_CTRL_DIR
+#define WPA_CTRL_DIR            "/var/run/wpa_supplicant"
+#endif
+/* Our end of the socket pair, wpa_supplicant replies to it */
+#ifndef WPA_CLIENT_DIR
+#define WPA_CLIENT_DIR          "/tmp"
+#endif
+
+#define WPA_REPLY_SIZE          (16 * 1024)
+#define WPA_REQUEST_MS          (10 * 1000)
+#define WPA_CONNECT_MS          (30 * 1000)
+
+typedef struct wpa_ctrl {
+    int fd;
+    struct sockaddr_un local;
+} wpa_ctrl_t;
+
+typedef struct wpa_handle {
+    pthread_mutex_t lock;           /* wifi_network, active, loaded */
+    pthread_cond_t active_changed;
+    struct list_head wifi_network;  /* last SCAN_RESULTS            */
+    wifi_arena_t arena;             /* entries of wifi_network      */
+    bool loaded;
+    char active[64];                /* ssid when COMPLETED          */
+    wifi_snapshot_pub_t results;
+
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    pthread_mutex_t call_lock;      /* request/reply on ctrl        */
+    wpa_ctrl_t ctrl;
+    wpa_ctrl_t monitor;             /* ATTACHed, events only        */
+    pthread_t monitor_thread;
+    bool monitor_running;
+    int stop_fd;
+} wpa_t;
+
+/* ====== Control socket ====== */
+
+/* Connect a datagram socket to the interface socket at path */
+static int wpa_ctrl_open(wpa_ctrl_t *ctrl, const char *path)
+{
+    static unsigned int counter;
+    struct sockaddr_un dest = { .sun_family = AF_UNIX };
+
+    ctrl->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (ctrl->fd < 0)
+        return -1;
+
+    memset(&ctrl->local, 0, sizeof(ctrl->local));
+    ctrl->local.sun_family = AF_UNIX;
+    snprintf(ctrl->local.sun_path, sizeof(ctrl->local.sun_path), WPA_CLIENT_DIR "/wpa_ctrl_%d-%u",
+             (int)getpid(), __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED));
+    unlink(ctrl->local.sun_path);
+    if (bind(ctrl->fd, (struct sockaddr *)&ctrl->local, sizeof(ctrl->local)) != 0)
+        goto fail;
+
+    strncpy(dest.sun_path, path, sizeof(dest.sun_path)-1);
+    if (connect(ctrl->fd, (struct sockaddr *)&dest, sizeof(dest)) != 0) {
+        unlink(ctrl->local.sun_path);
+        goto fail;
+    }
+    return 0;
+fail:
+    close(ctrl->fd);
+    ctrl->fd = -1;
+    return -1;
+}
+
+static void wpa_ctrl_close(wpa_ctrl_t *ctrl)
+{
+    if (ctrl->fd < 0)
+        return;
+    unlink(ctrl->local.sun_path);
+    close(ctrl->fd);
+    ctrl->fd = -1;
+}
+
+/* Send cmd and wait for its reply
+ *
+ * Unsolicited "<N>..." messages arriving in between are dropped.
+ *
+ * @param reply     NUL terminated reply
+ * @return length of reply, -1 on error or timeout
+ */
+static ssize_t wpa_ctrl_request(wpa_ctrl_t *ctrl, const char *cmd, char *reply, size_t size)
+{
+    struct pollfd pfd = { .fd = ctrl->fd, .events = POLLIN };
+    ssize_t n;
+
+    if (send(ctrl->fd, cmd, strlen(cmd), 0) < 0)
+        return -1;
+    for (;;) {
+        n = poll(&pfd, 1, WPA_REQUEST_MS);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        n = recv(ctrl->fd, reply, size - 1, 0);
+        if (n < 0)
+            return -1;
+        reply[n] = '\0';
+        if (reply[0] != '<')
+            return n;
+    }
+}
+
+/* ====== Parsing ====== */
+
+/* Undo the escaping of ssids in replies, in place
+ *
+ * wpa_supplicant prints quotes and backslashes with a backslash, escape,
+ * newline, CR and tab as \e, \n, \r, \t and other unprintable bytes as \xNN.
+ */
+static char *wpa_ssid_decode(char *ssid)
+{
+    static const char from[] = "enrt", to[] = "\033\n\r\t";
+    char *in = ssid, *out = ssid;
+    const char *special;
+    unsigned int byte;
+
+    while (*in) {
+        if (in[0] != '\\' || in[1] == '\0') {
+            *out++ = *in++;
+        } else if (in[1] == 'x' && isxdigit((unsigned char)in[2]) &&
+                   isxdigit((unsigned char)in[3]) && sscanf(in + 2, "%2x", &byte) == 1) {
+            *out++ = (char)byte;
+            in += 4;
+        } else if ((special = strchr(from, in[1])) != NULL) {
+            *out++ = to[special - from];
+            in += 2;
+        } else {
+            *out++ = in[1];
+            in += 2;
+        }
+    }
+    *out = '\0';
+
+    return ssid;
+}
+
+/* Parse SCAN_RESULTS, one tab separated line per BSS:
+ *
+ *   bssid / frequency / signal level / flags / ssid
+ *   00:11:22:33:44:55\t2412\t-48\t[WPA2-PSK-CCMP][ESS]\tHomeNet
+ *
+ * Notice: Caller MUST hold the lock
+ */
+static void wpa_parse_scan_results(wpa_t *wpa, char *reply)
+{
+    wifi_network_info_t *network;
+    char *line, *rest, *field[5];
+    size_t i;
+    int dbm;
+
+    /* The snapshot holds copies, the old entries go at once */
+    INIT_LIST_HEAD(&wpa->wifi_network);
+    wifi_arena_reset(&wpa->arena);
+
+    line = strtok_r(reply, "\n", &rest);        /* header */
+    for (line = strtok_r(NULL, "\n", &rest); line; line = strtok_r(NULL, "\n", &rest)) {
+        for (i = 0; i < 5 && line; i++)
+            field[i] = strsep(&line, "\t");
+        if (i < 5 || field[4][0] == '\0')
+            continue;                           /* short or hidden */
+
+        network = wifi_arena_alloc(&wpa->arena, sizeof(wifi_network_info_t));
+        if (network == NULL)
+            break;
+        strncpy(network->ssid, wpa_ssid_decode(field[4]), sizeof(network->ssid)-1);
+        wifi_bssid_parse(field[0], network->bssid);
+        network->freq = atoi(field[1]);
+        network->secured = strstr(field[3], "WPA") || strstr(field[3], "RSN") ||
+                           strstr(field[3], "WEP") || strstr(field[3], "SAE");
+        /* dBm to the 0-100 quality nmcli reports */
+        dbm = atoi(field[2]);
+        network->signal = dbm <= -100 ? 0 : dbm >= -50 ? 100 : 2 * (dbm + 100);
+        network->connected = wpa->active[0] && !strcmp(network->ssid, wpa->active);
+        list_add_tail(&network->list, &wpa->wifi_network);
+    }
+    wifi_snapshot_publish_list(&wpa->results, &wpa->wifi_network, wpa->arena.used);
+    wpa->loaded = true;
+}
+
+/* Pick ssid out of STATUS when wpa_state=COMPLETED
+ * Notice: Caller MUST hold the lock
+ */
+static void wpa_parse_status(wpa_t *wpa, char *reply)
+{
+    wifi_network_info_t *network;
+    char *line, *rest, *ssid = NULL;
+    bool completed = false, changed = false;
+
+    for (line = strtok_r(reply, "\n", &rest); line; line = strtok_r(NULL, "\n", &rest)) {
+        if (string_starts_with(line, "ssid="))
+            ssid = line + strlen("ssid=");
+        else if (!strcmp(line, "wpa_state=COMPLETED"))
+            completed = true;
+    }
+
+    memset(wpa->active, 0, sizeof(wpa->active));
+    if (completed && ssid)
+        strncpy(wpa->active, wpa_ssid_decode(ssid), sizeof(wpa->active)-1);
+    list_for_each_entry(network, &wpa->wifi_network, list) {
+        bool connected = wpa->active[0] && !strcmp(network->ssid, wpa->active);
+        changed |= network->connected != connected;
+        network->connected = connected;
+    }
+    if (changed)
+        wifi_snapshot_publish_list(&wpa->results, &wpa->wifi_network, wpa->arena.used);
+    pthread_cond_broadcast(&wpa->active_changed);
+}
+
+/* Run cmd and feed its reply to parse under the lock */
+static bool wpa_refresh(wpa_t *wpa, const char *cmd, void (*parse)(wpa_t *, char *))
+{
+    char *reply = malloc(WPA_REPLY_SIZE);
+    ssize_t n;
+
+    if (reply == NULL)
+        return false;
+    pthread_mutex_lock(&wpa->call_lock);
+    n = wpa_ctrl_request(&wpa->ctrl, cmd, reply, WPA_REPLY_SIZE);
+    pthread_mutex_unlock(&wpa->call_lock);
+    if (n >= 0) {
+        pthread_mutex_lock(&wpa->lock);
+        parse(wpa, reply);
+        pthread_mutex_unlock(&wpa->lock);
+    }
+    free(reply);
+
+    return n >= 0;
+}
+
+/* Send a command whose reply is just "OK" */
+static bool wpa_command(wpa_t *wpa, const char *cmd)
+{
+    char reply[128];
+    ssize_t n;
+
+    pthread_mutex_lock(&wpa->call_lock);
+    n = wpa_ctrl_request(&wpa->ctrl, cmd, reply, sizeof(reply));
+    pthread_mutex_unlock(&wpa->call_lock);
+
+    return n >= 0 && string_starts_with(reply, "OK");
+}
+
+/* ====== Events ====== */
+
+/* Follow unsolicited events until wpa_free() asks us to stop
+ *
+ * Events look like "<3>CTRL-EVENT-SCAN-RESULTS", the level prefix is skipped.
+ */
+static void *wpa_monitor_do(void *arg)
+{
+    wpa_t *wpa = (wpa_t *)arg;
+    char buf[1024], *event;
+    struct pollfd pfd[2];
+    ssize_t n;
+
+    pfd[0].fd = wpa->monitor.fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = wpa->stop_fd;
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (pfd[1].revents & POLLIN)
+            break;
+        if (!(pfd[0].revents & POLLIN))
+            continue;
+        n = recv(wpa->monitor.fd, buf, sizeof(buf) - 1, 0);
+        if (n <= 0)
+            continue;
+        buf[n] = '\0';
+
+        event = buf;
+        if (event[0] == '<' && (event = strchr(event, '>')) != NULL)
+            event++;
+        else
+            event = buf;
+
+        if (string_starts_with(event, "CTRL-EVENT-SCAN-RESULTS")) {
+            wpa_refresh(wpa, "SCAN_RESULTS", wpa_parse_scan_results);
+        } else if (string_starts_with(event, "CTRL-EVENT-CONNECTED") ||
+                   string_starts_with(event, "CTRL-EVENT-DISCONNECTED")) {
+            wpa_refresh(wpa, "STATUS", wpa_parse_status);
+        } else if (string_starts_with(event, "CTRL-EVENT-TERMINATING")) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* ====== Backend ====== */
+
+/* First interface socket in WPA_CTRL_DIR, skipping P2P ones */
+static bool wpa_find_iface(char *path, size_t size)
+{
+    DIR *dir = opendir(WPA_CTRL_DIR);
+    struct dirent *entry;
+    struct stat st;
+    bool found = false;
+
+    if (dir == NULL)
+        return false;
+    while (!found && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.' || string_starts_with(entry->d_name, "p2p-"))
+            continue;
+        if (sizeof(WPA_CTRL_DIR "/") + strlen(entry->d_name) > size)
+            continue;
+        strcpy(stpcpy(path, WPA_CTRL_DIR "/"), entry->d_name);
+        found = stat(path, &st) == 0 && S_ISSOCK(st.st_mode);
+    }
+    closedir(dir);
+
+    return found;
+}
+
+void wpa_free(void *handle)
+{
+    wpa_t *wpa = (wpa_t *)handle;
+    uint64_t one = 1;
+    char reply[16];
+
+    if (wpa == NULL)
+        return;
+    if (wpa->monitor_running) {
+        if (write(wpa->stop_fd, &one, sizeof(one)) != sizeof(one))
+            pthread_cancel(wpa->monitor_thread);
+        pthread_join(wpa->monitor_thread, NULL);
+    }
+    if (wpa->monitor.fd >= 0)
+        wpa_ctrl_request(&wpa->monitor, "DETACH", reply, sizeof(reply));
+    wpa_ctrl_close(&wpa->monitor);
+    wpa_ctrl_close(&wpa->ctrl);
+    if (wpa->stop_fd >= 0)
+        close(wpa->stop_fd);
+
+    wifi_arena_destroy(&wpa->arena);
+    wifi_snapshot_pub_destroy(&wpa->results);
+    pthread_cond_destroy(&wpa->active_changed);
+    pthread_mutex_destroy(&wpa->call_lock);
+    pthread_mutex_destroy(&wpa->lock);
+    free(wpa);
+}
+
+static void* wpa_init(void)
+{
+    wpa_t *wpa = calloc(1, sizeof(wpa_t));
+    pthread_condattr_t attr;
+    char reply[16];
+
+    if (wpa == NULL)
+        return NULL;
+    pthread_mutex_init(&wpa->lock, NULL);
+    pthread_mutex_init(&wpa->call_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wpa->active_changed, &attr);
+    pthread_condattr_destroy(&attr);
+    INIT_LIST_HEAD(&wpa->wifi_network);
+    wifi_arena_init(&wpa->arena);
+    wifi_snapshot_pub_init(&wpa->results);
+    wpa->ctrl.fd = -1;
+    wpa->monitor.fd = -1;
+
+    wpa->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (wpa->stop_fd < 0 ||
+        !wpa_find_iface(wpa->path, sizeof(wpa->path)) ||
+        wpa_ctrl_open(&wpa->ctrl, wpa->path) != 0 ||
+        wpa_ctrl_open(&wpa->monitor, wpa->path) != 0 ||
+        wpa_ctrl_request(&wpa->monitor, "ATTACH", reply, sizeof(reply)) < 0 ||
+        !string_starts_with(reply, "OK"))
+        goto fail;
+
+    if (pthread_create(&wpa->monitor_thread, NULL, wpa_monitor_do, wpa) != 0)
+        goto fail;
+    wpa->monitor_running = true;
+
+    wpa_refresh(wpa, "STATUS", wpa_parse_status);
+    return wpa;
+fail:
+    wpa_free(wpa);
+    return NULL;
+}
+
+bool wpa_is_available(void __attribute__((unused)) *handle)
+{
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    char reply[16];
+    wpa_ctrl_t ctrl;
+    bool pong;
+
+    if (!wpa_find_iface(path, sizeof(path)) || wpa_ctrl_open(&ctrl, path) != 0)
+        return false;
+    pong = wpa_ctrl_request(&ctrl, "PING", reply, sizeof(reply)) >= 0 &&
+           string_starts_with(reply, "PONG");
+    wpa_ctrl_close(&ctrl);
+
+    return pong;
+}
+
+/* wpa_supplicant has no radio switch, networks are enabled or disabled */
+bool wpa_enable(void *handle, bool enabled)
+{
+    wpa_t *wpa = (wpa_t *)handle;
+
+    return wpa_command(wpa, enabled ? "ENABLE_NETWORK all" : "DISABLE_NETWORK all");
+}
+
+static bool wpa_connection_info(void *handle, wifi_network_info_t *network)
+{
+    wpa_t *wpa = (wpa_t *)handle;
+    bool active;
+
+    if (!network)
+        return false;
+
+    pthread_mutex_lock(&wpa->lock);
+    active = wpa->active[0] != '\0';
+    if (active)
+        memcpy(network->ssid, wpa->active, sizeof(network->ssid));
+    pthread_mutex_unlock(&wpa->lock);
+
+    return active;
+}
+
+/* Start a scan, its results come with CTRL-EVENT-SCAN-RESULTS
+ *
+ * Only the first call waits for results, later ones keep what the last
+ * completed scan reported.
+ */
+void wpa_scan(void *handle)
+{
+    wpa_t *wpa = (wpa_t *)handle;
+    bool loaded;
+
+    wpa_command(wpa, "SCAN");
+
+    pthread_mutex_lock(&wpa->lock);
+    loaded = wpa->loaded;
+    pthread_mutex_unlock(&wpa->lock);
+    if (!loaded)
+        wpa_refresh(wpa, "SCAN_RESULTS", wpa_parse_scan_results);
+}
+
+/* Wait until wpa_supplicant completed association with ssid */
+static bool wpa_wait_active(wpa_t *wpa, const char *ssid, int timeout_ms)
+{
+    struct timespec until;
+    bool active = false;
+
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += timeout_ms / 1000;
+    until.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&wpa->lock);
+    for (;;) {
+        if (!strcmp(wpa->active, ssid)) {
+            active = true;
+            break;
+        }
+        if (pthread_cond_timedwait(&wpa->active_changed, &wpa->lock, &until) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&wpa->lock);
+
+    return active;
+}
+
+/* Id of the network block of ssid, -1 if there is none
+ *
+ * LIST_NETWORKS prints one tab separated line per block:
+ *
+ *   network id / ssid / bssid / flags
+ *   0\tHomeNet\tany\t[CURRENT]
+ */
+static int wpa_find_network(wpa_t *wpa, const char *ssid)
+{
+    char *reply, *line, *rest, *id, *name;
+    int found = -1;
+    ssize_t n;
+
+    reply = malloc(WPA_REPLY_SIZE);
+    if (reply == NULL)
+        return -1;
+    pthread_mutex_lock(&wpa->call_lock);
+    n = wpa_ctrl_request(&wpa->ctrl, "LIST_NETWORKS", reply, WPA_REPLY_SIZE);
+    pthread_mutex_unlock(&wpa->call_lock);
+
+    line = n < 0 ? NULL : strtok_r(reply, "\n", &rest);      /* header */
+    for (line = line ? strtok_r(NULL, "\n", &rest) : NULL; line; line = strtok_r(NULL, "\n", &rest)) {
+        id = strsep(&line, "\t");
+        name = strsep(&line, "\t");
+        if (name && !strcmp(wpa_ssid_decode(name), ssid)) {
+            found = atoi(id);
+            break;
+        }
+    }
+    free(reply);
+
+    return found;
+}
+
+/* What a password is to wpa_supplicant
+ *
+ * @return 1 for a passphrase of 8 to 63 printable characters, 2 for a raw
+ *         PSK of 64 hex digits, 0 for none, -1 for anything else
+ */
+static int wpa_psk_kind(const char *password)
+{
+    size_t i, len = password ? strlen(password) : 0;
+    bool hex = true;
+
+    if (len == 0)
+        return 0;
+    for (i = 0; i < len; i++) {
+        if (password[i] < 32 || password[i] > 126)
+            return -1;
+        hex &= isxdigit((unsigned char)password[i]) != 0;
+    }
+    if (len == 64 && hex)
+        return 2;
+
+    return len >= 8 && len <= 63 ? 1 : -1;
+}
+
+/* Select the network block of ssid, adding one unless it exists already */
+bool wpa_connect_ssid(void *handle, wifi_network_info_t *network, const char *password)
+{
+    wpa_t *wpa = (wpa_t *)handle;
+    char cmd[256], reply[32];
+    size_t i, len;
+    bool added = false, ok;
+    int id, kind;
+
+    if (!wpa || !network)
+        return false;
+    if ((kind = wpa_psk_kind(password)) < 0)
+        return false;
+
+    id = wpa_find_network(wpa, network->ssid);
+    if (id < 0) {
+        pthread_mutex_lock(&wpa->call_lock);
+        if (wpa_ctrl_request(&wpa->ctrl, "ADD_NETWORK", reply, sizeof(reply)) < 0 ||
+            sscanf(reply, "%d", &id) != 1) {
+            pthread_mutex_unlock(&wpa->call_lock);
+            return false;
+        }
+        pthread_mutex_unlock(&wpa->call_lock);
+        added = true;
+
+        /* Hex needs no quoting whatever bytes the ssid holds */
+        len = snprintf(cmd, sizeof(cmd), "SET_NETWORK %d ssid ", id);
+        for (i = 0; network->ssid[i] && len + 2 < sizeof(cmd); i++)
+            len += snprintf(cmd + len, sizeof(cmd) - len, "%02x", (unsigned char)network->ssid[i]);
+        if (!wpa_command(wpa, cmd))
+            goto fail;
+    }
+
+    /* A reused block may have been open or secured before */
+    snprintf(cmd, sizeof(cmd), "SET_NETWORK %d key_mgmt %s", id, kind ? "WPA-PSK" : "NONE");
+    if (!wpa_command(wpa, cmd))
+        goto fail;
+    if (kind) {
+        /* wpa_supplicant takes a quoted passphrase up to its last quote */
+        if (kind == 2)
+            snprintf(cmd, sizeof(cmd), "SET_NETWORK %d psk %s", id, password);
+        else
+            snprintf(cmd, sizeof(cmd), "SET_NETWORK %d psk \"%s\"", id, password);
+        ok = wpa_command(wpa, cmd);
+        explicit_bzero(cmd, sizeof(cmd));
+        if (!ok)
+            goto fail;
+    }
+
+    snprintf(cmd, sizeof(cmd), "SELECT_NETWORK %d", id);
+    if (!wpa_command(wpa, cmd))
+        goto fail;
+
+    network->connected = wpa_wait_active(wpa, network->ssid, WPA_CONNECT_MS);
+    return network->connected;
+fail:
+    if (added) {
+        snprintf(cmd, sizeof(cmd), "REMOVE_NETWORK %d", id);
+        wpa_command(wpa, cmd);
+    }
+    return false;
+}
+
+bool wpa_disconnect_ssid(void *handle, wifi_network_info_t *network)
+{
+    wpa_t *wpa = (wpa_t *)handle;
+    bool active;
+
+    pthread_mutex_lock(&wpa->lock);
+    active = wpa->active[0] && !strcmp(wpa->active, network->ssid);
+    pthread_mutex_unlock(&wpa->lock);
+    if (!active || !wpa_command(wpa, "DISCONNECT"))
+        return false;
+
+    network->connected = false;
+    return true;
+}
+
+static wifi_snapshot_pub_t *wpa_results(void *handle)
+{
+    return &((wpa_t *)handle)->results;
+}
+
+wifi_backend_t wifi_wpa = {
+    .init = wpa_init,
+    .free = wpa_free,
+    .is_available = wpa_is_available,
+    .enable = wpa_enable,
+    .connection_info = wpa_connection_info,
+    .scan = wpa_scan,
+    .connect_ssid = wpa_connect_ssid,
+    .disconnect_ssid = wpa_disconnect_ssid,
+    .results = wpa_results,
+    .ident = "wpa_supplicant"
+};